@@ -36,16 +36,88 @@
 # See the course web page for lab policies and guidelines.
 
 
-# Find test files that exist in testfiles/ and put their numbers in an array.
-# Ex: o1 o10 o3 -> tests=(1 10 3)
-tests=(); for v in `find sample.output`; do tests+=(${v:1}); done
-# Sort them. Ex: tests=(1 3 10)
-#tests=($(printf '%d\n' ${tests[@]} | sort -n))
+# Each test is the file holding the expected output, a tab, and the
+# command whose output, stderr included, must match it. Commands run in
+# this directory, with $tmp a scratch directory for the files they make.
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+tests=(
+  "sample.output	./sim sample.dump"
+  "elf.output	./sim -r -m elf.elf"
+  "shortstr.output	./sim -r -m shortstr.elf"
+  "sample.output	./sim -f sample.dump"
+  "testcase3.output	./sim -f -r -m testcase3.dump"
+  "testcase3.final	./sim -q testcase3.dump"
+  "sample.output	./sim -j sample.dump"
+  "testcase3.output	./sim -j -r -m testcase3.dump"
+  "testcase3.final	./sim -q -j testcase3.dump"
+  "sample.final	./sim -q sample.dump"
+  'testcase3.final	./aot testcase3.dump "$tmp/testcase3.so" && ./sim -q -a "$tmp/testcase3.so" testcase3.dump'
+  'testcase3.output	./sim -a "$tmp/testcase3.so" -r -m testcase3.dump'
+  'testcase3.final	mkdir "$tmp/cache" && ./sim -q -c "$tmp/cache" testcase3.dump'
+  'testcase3.final	./sim -q -c "$tmp/cache" testcase3.dump'
+  'testcase3.final	for f in "$tmp"/cache/*; do printf "%064d" 0 | dd of="$f" bs=1 seek=100 conv=notrunc 2>/dev/null; done; ./sim -q -c "$tmp/cache" testcase3.dump'
+  'testcase3.final	./sim -q -c "$tmp/cache" testcase3.dump'
+  # Flip the imm of the first cached op: 32 bytes of header, 16 per
+  # block, then the ops, each with its imm 16 bytes in
+  'testcase3.final	for f in "$tmp"/cache/*; do n=$(od -An -t d4 -j 24 -N 4 "$f"); printf "\007" | dd of="$f" bs=1 seek=$((32 + 16 * n + 16)) conv=notrunc 2>/dev/null; done; ./sim -q -c "$tmp/cache" testcase3.dump'
+  'testcase3.final	./sim -q -c "$tmp/cache" testcase3.dump'
+  "test.output	./sim -r -m test.dump"
+  "test.output	./sim -f -r -m test.dump"
+  "test2.output	./sim -r -m test2.dump"
+  "test2.output	./sim -f -r -m test2.dump"
+  "test2.output	./sim -j -r -m test2.dump"
+  'testcase3.output	./sim -b "$tmp/testcase3.bin" testcase3.dump && ./render -r -m "$tmp/testcase3.bin"'
+  'sample.output	./sim -b "$tmp/sample.bin" sample.dump && ./render "$tmp/sample.bin"'
+  'test.output	./sim -b "$tmp/test.bin" test.dump; ./render -r -m "$tmp/test.bin"'
+  "sample.batch	./simbatch -j 3 sample.manifest | sed -E 's/[0-9]+\.[0-9]+ s/- s/'"
+  "pool.batch	./simbatch -j 1 pool.manifest | sed -E 's/[0-9]+\.[0-9]+ s/- s/'"
+  "sweep.output	./sim -s 4=0,1,2,3,5,8,100,7 -s 5=3 sweep.dump"
+  "counter.output	./sim -p 4,7 counter.dump"
+  "counter.output	./sim -p 4,7 -j counter.dump"
+  "counter.total	./sim -p 4 counter.dump | tail -1"
+  "counter.mesi	./sim -p 4,7 -l 16,2,32 counter.dump"
+  "testcase3.bigmem	./sim -q -M 64,1048576 testcase3.dump"
+  "testcase3.bigmem	./sim -q -j -M 64,1048576 testcase3.dump"
+  "sample.toobig	./sim -M 4,64 sample.dump"
+  "sample.output	./sim -M 10,1 sample.dump"
+  "testcase3.final	./sim -q -g testcase3.dump"
+  "test.final	./sim -q -j -g test.dump"
+  "test.final	./sim -q -G test.dump"
+  "testcase3.final	./sim -q -j -G testcase3.dump"
+  "sample.output	./sim sample.hex"
+  "sample.output	./sim -M 10,16 sample.hex"
+  "sample.toobig	./sim -M 9,16 sample.hex"
+  "testcase3.output	./sim -r -m testcase3.be"
+  "testcase3.final	./sim -q -j testcase3.be"
+  'testcase3.resumed	./sim -S 40,"$tmp/testcase3.ckp" testcase3.dump && ./sim -r -m -R "$tmp/testcase3.ckp"'
+  'testcase3.final	./sim -q -j -R "$tmp/testcase3.ckp"'
+  'sample.resumed	./sim -S @0x400010,"$tmp/sample.ckp" sample.dump && ./sim -q -R "$tmp/sample.ckp"'
+  'fuzz.output	./fuzz -n 2000 -s 1 -o "$tmp" sample.dump testcase3.dump counter.dump | sed "s/, [0-9]* inputs.s//"'
+  'fuzz.random	./fuzz -n 200 -s 7 -r -m -o "$tmp" | sed "s/, [0-9]* inputs.s//"'
+  "memzero.output	./sim -r -m memzero.dump"
+  "memzero.output	./sim -f -r -m memzero.dump"
+  "memzero.output	./sim -j -r -m memzero.dump"
+  "memzero.final	./sim -q memzero.dump"
+  "isa.output	./sim -r -m isa.dump"
+  "isa.output	./sim -f -r -m isa.dump"
+  "isa.output	./sim -j -r -m isa.dump"
+  "isa.final	./sim -q isa.dump"
+  "isa.final	./sim -q -j isa.dump"
+  "isa.output	./sim -r -m isa.be"
+  "muldiv.output	./sim -r -m -L 4,12 muldiv.dump"
+  "muldiv.output	./sim -f -r -m -L 4,12 muldiv.dump"
+  "muldiv.output	./sim -j -r -m -L 4,12 muldiv.dump"
+  "muldiv.final	./sim -q -L 4,12 muldiv.dump"
+  "muldiv.final	./sim -q -j -L 4,12 muldiv.dump"
+  "case1.output	./sim -r -m case1.dump"
+)
 
-# Apply a.exe to each test file and count how many are correct.
-correct=0;
-for i in ${tests[@]}; do
-  ./sim sample.dump | diff -q sample.output - > /dev/null
+# Run each test and count how many are correct.
+correct=0; i=0
+for t in "${tests[@]}"; do
+  ((i=i+1))
+  eval "${t#*	}" 2>&1 | diff -q "${t%%	*}" - > /dev/null
   if [ "$?" -eq 0 ] ; then # if exit code is 0 then correct
     echo "Test $i: correct."
     ((correct=correct+1))
@@ -54,4 +126,3 @@ for i in ${tests[@]}; do
   fi
 done
 echo "Total correct: "$correct"/"${#tests[@]};
-
@@ -0,0 +1,307 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "computer.h"
+#include "threaded.h"
+#undef mips /* gcc already has a def for mips */
+
+/*
+	Ahead-of-time translator.
+
+	Usage: aot [-M text,data] file.dump file.so
+
+	Loads file.dump, in any format loader.c takes, with InitComputer,
+	finds every basic block reachable from its entry with FindBlocks(),
+	and writes file.c with one C function per block plus AotRun(), which
+	dispatches between them with a switch on the pc (so jr lands on any
+	block it knows). file.c is then compiled into file.so, which sim
+	loads with -a. The translation is made for the segment sizes given
+	with -M, in words, and sim only takes it for a machine of those
+	sizes.
+
+	Blocks come from the threaded engine's BlockAt(), so the generated
+	code has exactly its semantics. Unsupported instructions, ll and sc
+	are left out; AotRun() returns at them and the interpreter takes
+	over.
+*/
+
+/*
+ *  Return the number of ops of b that can be translated.
+ */
+static int Translatable(Block *b)
+{
+	int n;
+
+	/* ll, sc and HI/LO are left to the interpreter, which keeps the link and the unit */
+	for (n = 0; n < b->count; n++)
+	{
+		if (b->ops[n].kind == K_UNSUPPORTED || b->ops[n].kind == K_LL || b->ops[n].kind == K_SC ||
+				IsMulDiv(b->ops[n].kind))
+		{
+			break;
+		}
+	}
+	return n;
+}
+
+/*
+ *  Write the C statements for op, at pc, the k-th op of its block.
+ */
+static void EmitOp(FILE *out, Op *op, int pc, int k)
+{
+	switch (op->kind)
+	{
+	case K_ADDU:
+		fprintf(out, "\tr[%d] = r[%d] + r[%d];\n", op->rd, op->rs, op->rt);
+		break;
+	case K_SUBU:
+		fprintf(out, "\tr[%d] = r[%d] - r[%d];\n", op->rd, op->rs, op->rt);
+		break;
+	case K_AND:
+		fprintf(out, "\tr[%d] = r[%d] & r[%d];\n", op->rd, op->rs, op->rt);
+		break;
+	case K_OR:
+		fprintf(out, "\tr[%d] = r[%d] | r[%d];\n", op->rd, op->rs, op->rt);
+		break;
+	case K_SLT:
+		fprintf(out, "\tr[%d] = (int)r[%d] < (int)r[%d];\n", op->rd, op->rs, op->rt);
+		break;
+	case K_XOR:
+		fprintf(out, "\tr[%d] = r[%d] ^ r[%d];\n", op->rd, op->rs, op->rt);
+		break;
+	case K_NOR:
+		fprintf(out, "\tr[%d] = ~(r[%d] | r[%d]);\n", op->rd, op->rs, op->rt);
+		break;
+	case K_SLL:
+		fprintf(out, "\tr[%d] = r[%d] << %d;\n", op->rd, op->rt, op->imm);
+		break;
+	case K_SRL:
+	case K_SRA:
+		fprintf(out, "\tr[%d] = (int)r[%d] >> %d;\n", op->rd, op->rt, op->imm);
+		break;
+	case K_SLLV:
+		fprintf(out, "\tr[%d] = r[%d] << (r[%d] & 31);\n", op->rd, op->rt, op->rs);
+		break;
+	case K_SRLV:
+		fprintf(out, "\tr[%d] = r[%d] >> (r[%d] & 31);\n", op->rd, op->rt, op->rs);
+		break;
+	case K_SRAV:
+		fprintf(out, "\tr[%d] = (int)r[%d] >> (r[%d] & 31);\n", op->rd, op->rt, op->rs);
+		break;
+	case K_ADDIU:
+	case K_ADDI:
+		fprintf(out, "\tr[%d] = r[%d] + 0x%8.8xu;\n", op->rd, op->rs, op->imm);
+		break;
+	case K_XORI:
+		fprintf(out, "\tr[%d] = r[%d] ^ 0x%8.8xu;\n", op->rd, op->rs, op->imm);
+		break;
+	case K_SLTI:
+		fprintf(out, "\tr[%d] = (int)r[%d] < %d;\n", op->rd, op->rs, op->imm);
+		break;
+	case K_SLTIU:
+		fprintf(out, "\tr[%d] = r[%d] < 0x%8.8xu;\n", op->rd, op->rs, op->imm);
+		break;
+	case K_ANDI:
+		fprintf(out, "\tr[%d] = r[%d] & 0x%8.8xu;\n", op->rd, op->rs, op->imm);
+		break;
+	case K_ORI:
+		fprintf(out, "\tr[%d] = r[%d] | 0x%8.8xu;\n", op->rd, op->rs, op->imm);
+		break;
+	case K_LUI:
+		fprintf(out, "\tr[%d] = 0x%8.8xu;\n", op->rd, (unsigned int)op->imm << 16);
+		break;
+	case K_LW:
+	case K_SW:
+		fprintf(out, "\ta = r[%d] + 0x%8.8xu;\n", op->rs, op->imm);
+		fprintf(out, "\tif (BAD_DATA_ADDR(a))\n\t{\n");
+		fprintf(out, "\t\t*pc = 0x%8.8x;\n\t\t*addr = a;\n\t\treturn %d;\n\t}\n",
+						pc + 4, k);
+		if (op->kind == K_LW)
+			fprintf(out, "\tr[%d] = m[(a - 0x%8.8xu) / 4];\n", op->rd, TEXT_BASE);
+		else
+			fprintf(out, "\tm[(a - 0x%8.8xu) / 4] = r[%d];\n", TEXT_BASE, op->rt);
+		break;
+	case K_BEQ:
+	case K_BNE:
+		fprintf(out, "\t*pc = r[%d] %s r[%d] ? 0x%8.8x : 0x%8.8x;\n", op->rs,
+						op->kind == K_BEQ ? "==" : "!=", op->rt, pc + 4 + op->imm, pc + 4);
+		break;
+	case K_BLEZ:
+	case K_BGTZ:
+	case K_BLTZ:
+	case K_BGEZ:
+		fprintf(out, "\t*pc = (int)r[%d] %s 0 ? 0x%8.8x : 0x%8.8x;\n", op->rs,
+						op->kind == K_BLEZ ? "<=" : op->kind == K_BGTZ ? ">" : op->kind == K_BLTZ ? "<" : ">=",
+						pc + 4 + op->imm, pc + 4);
+		break;
+	case K_JAL:
+		fprintf(out, "\tr[31] = 0x%8.8x;\n", pc + 4);
+		/* fall through */
+	case K_J:
+		fprintf(out, "\t*pc = 0x%8.8x;\n", op->imm);
+		break;
+	case K_JR:
+		fprintf(out, "\t*pc = r[%d];\n", op->rs);
+		break;
+	case K_JALR:
+		fprintf(out, "\t*pc = r[%d];\n\tr[%d] = 0x%8.8x;\n", op->rs, op->rd, pc + 4);
+		break;
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	Computer *mips;
+	FILE *filein, *out;
+	char source[1024], command[3200], extra;
+	int textWords = MAXNUMINSTRS, dataWords = MAXNUMDATA;
+	int *starts;
+	int nblocks, words = 0;
+	int i, k, n, pc;
+	size_t len;
+	Block *b;
+
+	if (argc == 5 && strcmp(argv[1], "-M") == 0)
+	{
+		if (sscanf(argv[2], "%d,%d%c", &textWords, &dataWords, &extra) != 2 ||
+				textWords <= 0 || dataWords <= 0)
+		{
+			fprintf(stderr, "Bad memory size \"%s\", expected text,data\n", argv[2]);
+			exit(1);
+		}
+		argc -= 2;
+		argv += 2;
+	}
+	if (argc != 3)
+	{
+		fprintf(stderr, "Usage: aot [-M text,data] file.dump file.so\n");
+		exit(1);
+	}
+	filein = fopen(argv[1], "r");
+	if (filein == NULL)
+	{
+		fprintf(stderr, "Can't open file: %s\n", argv[1]);
+		exit(1);
+	}
+	mips = NewComputer();
+	if (mips == NULL)
+	{
+		fprintf(stderr, "Out of memory.\n");
+		exit(1);
+	}
+	k = SetMemorySize(mips, textWords, dataWords);
+	if (k != SIM_OK)
+	{
+		fprintf(stderr, k == SIM_TOO_BIG ? "Memory too big.\n" : "Out of memory.\n");
+		exit(1);
+	}
+	k = InitComputer(mips, filein, 0, 0, 0, 0);
+	if (k != SIM_OK)
+	{
+		fprintf(stderr, k == SIM_TOO_BIG ? "Program too big.\n" : k == SIM_BAD_PROGRAM ? "Not a program: %s\n" : "Out of memory.\n", argv[1]);
+		exit(1);
+	}
+	fclose(filein);
+
+	len = strlen(argv[2]);
+	if (len + 3 > sizeof(source))
+	{
+		fprintf(stderr, "File name too long: %s\n", argv[2]);
+		exit(1);
+	}
+	strcpy(source, argv[2]);
+	if (len > 3 && strcmp(source + len - 3, ".so") == 0)
+		strcpy(source + len - 3, ".c");
+	else
+		strcat(source, ".c");
+	out = fopen(source, "w");
+	if (out == NULL)
+	{
+		fprintf(stderr, "Can't open file: %s\n", source);
+		exit(1);
+	}
+
+	for (k = 0; k < mips->textWords; k++)
+	{
+		if (mips->memory[k] != 0)
+			words = k + 1;
+	}
+	fprintf(out, "/* Generated by aot from %s. Do not edit. */\n\n", argv[1]);
+	fprintf(out, "const unsigned int AotText[] = {");
+	for (k = 0; k < words; k++)
+	{
+		fprintf(out, "%s0x%8.8x,", k % 6 ? " " : "\n\t", mips->memory[k]);
+	}
+	fprintf(out, "\n\t0};\nconst int AotTextWords = %d;\n", words);
+	fprintf(out, "const int AotSegments[2] = {%d, %d};\n\n", mips->textWords, mips->dataWords);
+	fprintf(out, "#define BAD_DATA_ADDR(a) ((a) - 0x%8.8xu >= 0x%xu || (a) %% 4 != 0)\n",
+					DATA_BASE(mips), 4u * mips->dataWords);
+
+	/* One function per block */
+	starts = MapTable(mips->textWords * sizeof(int));
+	nblocks = starts != NULL ? FindBlocks(mips, starts) : -1;
+	if (nblocks < 0)
+	{
+		fprintf(stderr, "Out of memory.\n");
+		exit(1);
+	}
+	for (i = 0; i < nblocks; i++)
+	{
+		pc = starts[i];
+		b = BlockAt(mips, pc);
+		n = Translatable(b);
+		if (n == 0)
+		{
+			continue;
+		}
+		fprintf(out, "\nstatic int B_%8.8x(unsigned int *r, int *m, int *pc, int *addr)\n{\n", pc);
+		for (k = 0; k < n; k++)
+		{
+			if (b->ops[k].kind == K_LW || b->ops[k].kind == K_SW)
+			{
+				fprintf(out, "\tunsigned int a;\n\n");
+				break;
+			}
+		}
+		for (k = 0; k < n; k++)
+		{
+			EmitOp(out, &b->ops[k], pc + 4 * k, k);
+		}
+		if (!EndsBlock(b->ops[n - 1].kind) || n < b->count)
+		{
+			fprintf(out, "\t*pc = 0x%8.8x;\n", pc + 4 * n);
+		}
+		fprintf(out, "\treturn %d;\n}\n", n);
+	}
+
+	/* The dispatcher */
+	fprintf(out, "\nint AotRun(unsigned int *r, int *m, int *pc, int *addr, unsigned long *retired)\n{\n");
+	fprintf(out, "\tint n;\n\n\tfor (;;)\n\t{\n\t\tswitch (*pc)\n\t\t{\n");
+	for (k = 0; k < nblocks; k++)
+	{
+		b = BlockAt(mips, starts[k]);
+		n = Translatable(b);
+		if (n == 0)
+		{
+			continue;
+		}
+		fprintf(out, "\t\tcase 0x%8.8x:\n", starts[k]);
+		fprintf(out, "\t\t\tn = B_%8.8x(r, m, pc, addr);\n", starts[k]);
+		fprintf(out, "\t\t\t*retired += n;\n");
+		fprintf(out, "\t\t\tif (n < %d)\n\t\t\t\treturn 1;\n", n);
+		fprintf(out, "\t\t\tbreak;\n");
+	}
+	fprintf(out, "\t\tdefault:\n\t\t\treturn 0;\n\t\t}\n\t}\n}\n");
+	fclose(out);
+
+	snprintf(command, sizeof(command), "gcc -O2 -shared -fPIC -o '%s' '%s'",
+					 argv[2], source);
+	if (system(command) != 0)
+	{
+		fprintf(stderr, "Compiling %s failed.\n", source);
+		exit(1);
+	}
+	UnmapTable(starts, mips->textWords * sizeof(int));
+	FreeComputer(mips);
+	return 0;
+}
@@ -0,0 +1,271 @@
+#include <stdio.h>
+#include <stddef.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "computer.h"
+#include "threaded.h"
+#undef mips /* gcc already has a def for mips */
+
+/*
+	On-disk translation cache.
+
+	One file per program and engine, named after a hash of the loaded
+	text and the build ID. It holds the blocks FindBlocks() found, the
+	successors each one links to and the translated ops of each block
+	in turn, so a later run of the same image maps the file and rebuilds
+	its blocks without analysing anything; only the words the blocks
+	cover are decoded again, to check the ops against. Text that no
+	block covers costs nothing, however large the text segment is.
+
+	The build ID is a checksum of the engine sources, which the Makefile
+	passes in as ENGINE_SOURCES, and the layout of an op, so any build
+	of the same engine shares its files and no other build does.
+
+	Files are written to a temporary name and renamed into place, so a
+	reader never sees a partial one. A file that does not match, or has
+	an op that is not the translation of its word, is ignored and
+	rewritten.
+*/
+
+#ifndef ENGINE_SOURCES
+#error "build cache.c with the Makefile, which defines ENGINE_SOURCES"
+#endif
+
+#define CACHE_MAGIC "MIPSBLK2"
+
+typedef struct
+{
+	char magic[8];
+	unsigned long long build;
+	unsigned long long text;
+	int nblocks;
+	int nops; /* the ops of every block, in block order */
+} CacheHeader;
+
+typedef struct
+{
+	int pc;
+	int count;
+	int next[2]; /* successor pcs, or -1 */
+} CacheBlock;
+
+/*
+ *  64-bit FNV-1a hash of n bytes, continuing from h.
+ */
+static unsigned long long Hash(unsigned long long h, const void *p, size_t n)
+{
+	const unsigned char *c = p;
+
+	while (n-- > 0)
+	{
+		h = (h ^ *c++) * 0x100000001b3ULL;
+	}
+	return h;
+}
+
+static unsigned long long BuildId(void)
+{
+	unsigned long long h = 0xcbf29ce484222325ULL;
+	int layout[7] = {sizeof(Op), offsetof(Op, kind), offsetof(Op, rd), offsetof(Op, rs),
+									 offsetof(Op, rt), offsetof(Op, imm), NUM_KINDS};
+
+	h = Hash(h, ENGINE_SOURCES, sizeof(ENGINE_SOURCES));
+	return Hash(h, layout, sizeof(layout));
+}
+
+static unsigned long long TextHash(Computer *mips)
+{
+	int segments[3] = {mips->textWords, mips->dataWords, mips->entry};
+	unsigned long long h = 0xcbf29ce484222325ULL;
+
+	h = Hash(h, segments, sizeof(segments));
+	return Hash(h, mips->memory, mips->textWords * sizeof(int));
+}
+
+static void CachePath(Computer *mips, char *path, size_t size, const char *dir)
+{
+	snprintf(path, size, "%s/%16.16llx-%16.16llx.blk", dir, TextHash(mips), BuildId());
+}
+
+/*
+ *  True if pc is where a cached block could start.
+ */
+static int ValidStart(Engine *e, int pc)
+{
+	return pc % 4 == 0 && (unsigned int)(pc - TEXT_BASE) / 4 < (unsigned int)e->words;
+}
+
+/*
+ *  True if op, the cached op for pc, is the translation of the word
+ *  there, field for field. Anything else would run another program, or
+ *  index past the engine's tables.
+ */
+static int ValidOp(Computer *mips, const Op *op, int pc)
+{
+	Op fresh;
+
+	Translate(mips, &fresh, pc);
+	return memcmp(op, &fresh, sizeof(Op)) == 0;
+}
+
+/*
+ *  Rebuild ops and blocks from the cache file for the loaded program.
+ *  Returns 0, having changed nothing, if there is no usable file.
+ */
+int LoadCache(Computer *mips, const char *dir)
+{
+	Engine *e = mips->engine;
+	char path[1024];
+	const CacheHeader *h;
+	const CacheBlock *cb;
+	const Op *ops;
+	struct stat st;
+	void *map;
+	size_t size, nops = 0;
+	int fd, k, i, ok = 1;
+	Block *b;
+
+	CachePath(mips, path, sizeof(path), dir);
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+	{
+		return 0;
+	}
+	if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(CacheHeader))
+	{
+		close(fd);
+		return 0;
+	}
+	size = st.st_size;
+	map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+	{
+		return 0;
+	}
+
+	h = map;
+	cb = (const CacheBlock *)((const char *)map + sizeof(CacheHeader));
+	if (memcmp(h->magic, CACHE_MAGIC, 8) != 0 || h->build != BuildId() ||
+			h->text != TextHash(mips) || h->nblocks < 0 || h->nblocks > e->words || h->nops < 0 ||
+			size != sizeof(CacheHeader) + h->nblocks * sizeof(CacheBlock) +
+									(size_t)h->nops * sizeof(Op))
+	{
+		munmap(map, size);
+		return 0;
+	}
+	ops = (const Op *)(cb + h->nblocks);
+	for (k = 0; k < h->nblocks && ok; k++)
+	{
+		ok = ValidStart(e, cb[k].pc) && cb[k].count > 0 &&
+				 cb[k].count <= e->words - (cb[k].pc - TEXT_BASE) / 4 &&
+				 cb[k].count <= h->nops - (int)nops;
+		for (i = 0; i < 2 && ok; i++)
+		{
+			ok = cb[k].next[i] == -1 || ValidStart(e, cb[k].next[i]);
+		}
+		for (i = 0; i < cb[k].count && ok; i++)
+		{
+			ok = ValidOp(mips, &ops[nops + i], cb[k].pc + 4 * i);
+		}
+		nops += ok ? cb[k].count : 0;
+	}
+	if (!ok || nops != (size_t)h->nops)
+	{
+		munmap(map, size);
+		return 0;
+	}
+
+	for (k = 0, nops = 0; k < h->nblocks && ok; nops += cb[k++].count)
+	{
+		memcpy(&e->ops[(cb[k].pc - TEXT_BASE) / 4], &ops[nops], cb[k].count * sizeof(Op));
+		ok = NewBlock(mips, cb[k].pc, cb[k].count) != NULL;
+	}
+	for (k = 0; k < h->nblocks && ok; k++)
+	{
+		b = e->blocks[(cb[k].pc - TEXT_BASE) / 4];
+		for (i = 0; i < 2 && ok; i++)
+		{
+			if (cb[k].next[i] != -1)
+			{
+				b->next[i] = BlockAt(mips, cb[k].next[i]);
+				ok = b->next[i] != NULL;
+			}
+		}
+	}
+	munmap(map, size);
+	if (!ok)
+	{
+		ResetBlocks(mips);
+	}
+	return ok;
+}
+
+/*
+ *  Find the blocks of the loaded program and write them, with their
+ *  translated ops, to the cache file for it.
+ */
+void SaveCache(Computer *mips, const char *dir)
+{
+	Engine *e = mips->engine;
+	char path[1024], temp[1100];
+	size_t startBytes = e->words * sizeof(int);
+	int *starts;
+	CacheHeader h;
+	CacheBlock cb;
+	FILE *out;
+	int k, i, ok;
+	Block *b;
+
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, CACHE_MAGIC, 8);
+	h.build = BuildId();
+	h.text = TextHash(mips);
+	starts = MapTable(startBytes);
+	h.nblocks = starts != NULL ? FindBlocks(mips, starts) : -1;
+	if (h.nblocks < 0)
+	{
+		UnmapTable(starts, startBytes);
+		return;
+	}
+
+	CachePath(mips, path, sizeof(path), dir);
+	snprintf(temp, sizeof(temp), "%s.%d", path, (int)getpid());
+	out = fopen(temp, "wb");
+	if (out == NULL)
+	{
+		fprintf(stderr, "Can't write translation cache in %s\n", dir);
+		UnmapTable(starts, startBytes);
+		return;
+	}
+	for (k = 0; k < h.nblocks; k++)
+	{
+		h.nops += e->blocks[(starts[k] - TEXT_BASE) / 4]->count;
+	}
+	ok = fwrite(&h, sizeof(h), 1, out) == 1;
+	for (k = 0; k < h.nblocks && ok; k++)
+	{
+		b = e->blocks[(starts[k] - TEXT_BASE) / 4];
+		cb.pc = b->pc;
+		cb.count = b->count;
+		for (i = 0; i < 2; i++)
+		{
+			cb.next[i] = b->next[i] != NULL ? b->next[i]->pc : -1;
+		}
+		ok = fwrite(&cb, sizeof(cb), 1, out) == 1;
+	}
+	for (k = 0; k < h.nblocks && ok; k++)
+	{
+		b = e->blocks[(starts[k] - TEXT_BASE) / 4];
+		ok = fwrite(b->ops, sizeof(Op), b->count, out) == (size_t)b->count;
+	}
+	if (fclose(out) != 0 || !ok || rename(temp, path) != 0)
+	{
+		fprintf(stderr, "Can't write translation cache in %s\n", dir);
+		unlink(temp);
+	}
+	UnmapTable(starts, startBytes);
+}
@@ -7,7 +7,7 @@
 		addiu	$a0,$0,3
 		addiu	$a1,$0,2
 		jal	Mystery
-		addi	$0,$0,0 #unsupported instruction, terminate
+		syscall		#unsupported instruction, terminate
 
 
 Mystery:
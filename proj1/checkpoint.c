@@ -0,0 +1,210 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "computer.h"
+#undef mips /* gcc already has a def for mips */
+
+/*
+	Checkpoints.
+
+	A checkpoint is the whole state of a machine in a file laid out to
+	be mapped: a header in the first HEADER_BYTES, then memory exactly
+	as the machine holds it. Restoring maps the memory copy-on-write
+	over the machine's, as a pool maps its image, so it costs the same
+	for any size of memory and the run reads in only the pages it
+	touches. Pages that are all zero are left as holes, so a checkpoint
+	of a large sparse memory takes little more disk than it uses.
+
+	The text segment is part of memory, so a checkpoint needs no program
+	file. Decodings and translations are not saved; the restored machine
+	makes them again as it runs.
+*/
+
+#define CHECKPOINT_MAGIC "MIPSCKP2"
+
+/* Where memory starts in the file: a multiple of any host page size */
+#define HEADER_BYTES 65536
+
+typedef struct
+{
+	char magic[8]; /* CHECKPOINT_MAGIC */
+	int textWords, dataWords;
+	int registers[32];
+	int hi, lo;
+	int pc, entry;
+	int linked, linkAddr, linkValue;
+	int printingRegisters, printingMemory;
+	int mulLatency, divLatency;
+	unsigned long retired;
+	unsigned long hiloReady, interlocks;
+} CheckpointHeader;
+
+/*
+ *  Return bytes rounded up to a whole number of pages of page bytes.
+ */
+static size_t Pages(size_t bytes, size_t page)
+{
+	return (bytes + page - 1) / page * page;
+}
+
+/*
+ *  Write the header and the nonzero pages of memory of mips to fd.
+ *  Returns 0 if it could not be written.
+ */
+static int WriteCheckpoint(Computer *mips, int fd)
+{
+	const char *from = (const char *)mips->memory;
+	size_t bytes = MEMORY_BYTES(mips), at, n, k;
+	CheckpointHeader h;
+
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, CHECKPOINT_MAGIC, 8);
+	h.textWords = mips->textWords;
+	h.dataWords = mips->dataWords;
+	memcpy(h.registers, mips->registers, sizeof(h.registers));
+	h.hi = mips->hi;
+	h.lo = mips->lo;
+	h.pc = mips->pc;
+	h.entry = mips->entry;
+	h.linked = mips->linked;
+	h.linkAddr = mips->linkAddr;
+	h.linkValue = mips->linkValue;
+	h.printingRegisters = mips->printingRegisters;
+	h.printingMemory = mips->printingMemory;
+	h.mulLatency = mips->mulLatency;
+	h.divLatency = mips->divLatency;
+	h.retired = mips->retired;
+	h.hiloReady = mips->hiloReady;
+	h.interlocks = mips->interlocks;
+	if (pwrite(fd, &h, sizeof(h), 0) != sizeof(h) ||
+			ftruncate(fd, HEADER_BYTES + Pages(bytes, HEADER_BYTES)) != 0)
+	{
+		return 0;
+	}
+	for (at = 0; at < bytes; at += n)
+	{
+		n = bytes - at < 4096 ? bytes - at : 4096;
+		for (k = 0; k < n && from[at + k] == 0; k++)
+			;
+		if (k < n && pwrite(fd, from + at, n, HEADER_BYTES + at) != (ssize_t)n)
+		{
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/*
+ *  Save the state of mips, which must not be a hart, in file, replacing
+ *  it whole only once the new one is written, so file may be the one
+ *  mips was restored from. Returns SIM_FILE_ERROR if it could not be
+ *  written.
+ */
+int SaveCheckpoint(Computer *mips, const char *file)
+{
+	char temp[4096];
+	int fd, ok;
+
+	if (snprintf(temp, sizeof(temp), "%s.%d", file, (int)getpid()) >= (int)sizeof(temp))
+	{
+		return SIM_FILE_ERROR;
+	}
+	fd = open(temp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+	{
+		return SIM_FILE_ERROR;
+	}
+	ok = WriteCheckpoint(mips, fd);
+	if (close(fd) != 0 || !ok || rename(temp, file) != 0)
+	{
+		unlink(temp);
+		return SIM_FILE_ERROR;
+	}
+	return SIM_OK;
+}
+
+/*
+ *  Put mips, which must not be a hart, in the state saved in file,
+ *  giving it the checkpoint's memory size, guarded again if it was
+ *  guarded. The memory maps the file, which must not be changed in
+ *  place while mips uses it; if it can't be mapped it is read instead.
+ *  Returns SIM_FILE_ERROR if file can't be read, SIM_BAD_CHECKPOINT if
+ *  it is not a checkpoint, or a status of SetMemorySize() or
+ *  GuardMemory() if mips can't take its memory.
+ */
+int RestoreCheckpoint(Computer *mips, const char *file)
+{
+	long page = sysconf(_SC_PAGESIZE);
+	int fd = open(file, O_RDONLY), status = SIM_OK;
+	int guarded = mips->guarded, hugePages = mips->hugePages;
+	CheckpointHeader h;
+	struct stat st;
+	size_t bytes;
+
+	if (fd < 0)
+	{
+		return SIM_FILE_ERROR;
+	}
+	if (pread(fd, &h, sizeof(h), 0) != sizeof(h) || fstat(fd, &st) != 0 ||
+			memcmp(h.magic, CHECKPOINT_MAGIC, 8) != 0 || h.textWords < 1 || h.dataWords < 1 ||
+			(size_t)st.st_size < HEADER_BYTES + Pages((size_t)(h.textWords + (size_t)h.dataWords) * 4, HEADER_BYTES))
+	{
+		close(fd);
+		return SIM_BAD_CHECKPOINT;
+	}
+	if (h.textWords != mips->textWords || h.dataWords != mips->dataWords)
+	{
+		status = SetMemorySize(mips, h.textWords, h.dataWords);
+		if (status == SIM_OK && guarded)
+		{
+			status = GuardMemory(mips, hugePages);
+		}
+	}
+	else
+	{
+		/* Forget what was decoded from the old text */
+		FreeTrace(mips);
+		FreeEngine(mips);
+		memset(mips->decodedValid, 0, mips->textWords);
+		status = NewEngine(mips);
+	}
+	if (status != SIM_OK)
+	{
+		close(fd);
+		return status;
+	}
+
+	bytes = MEMORY_BYTES(mips);
+	if (page <= 0 || HEADER_BYTES % page != 0 ||
+			mmap(mips->memory, Pages(bytes, page), PROT_READ | PROT_WRITE,
+					 MAP_PRIVATE | MAP_FIXED, fd, HEADER_BYTES) == MAP_FAILED)
+	{
+		if (pread(fd, mips->memory, bytes, HEADER_BYTES) != (ssize_t)bytes)
+		{
+			close(fd);
+			return SIM_FILE_ERROR;
+		}
+	}
+	close(fd);
+
+	memcpy(mips->registers, h.registers, sizeof(mips->registers));
+	mips->hi = h.hi;
+	mips->lo = h.lo;
+	mips->pc = h.pc;
+	mips->entry = h.entry;
+	mips->linked = h.linked;
+	mips->linkAddr = h.linkAddr;
+	mips->linkValue = h.linkValue;
+	mips->printingRegisters = h.printingRegisters;
+	mips->printingMemory = h.printingMemory;
+	mips->mulLatency = h.mulLatency;
+	mips->divLatency = h.divLatency;
+	mips->retired = h.retired;
+	mips->hiloReady = h.hiloReady;
+	mips->interlocks = h.interlocks;
+	return SIM_OK;
+}
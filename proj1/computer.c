@@ -1,166 +1,409 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <netinet/in.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
 #include "computer.h"
 #undef mips /* gcc already has a def for mips */
 
-unsigned int endianSwap(unsigned int);
+/* How many instructions may retire between two looks at the clock */
+#define CHECK_INTERVAL (1UL << 16)
 
-void PrintInfo(int changedReg, int changedMem);
-unsigned int Fetch(int);
-void Decode(unsigned int, DecodedInstr *, RegVals *);
-int Execute(DecodedInstr *, RegVals *);
-int Mem(DecodedInstr *, int, int *);
-void RegWrite(DecodedInstr *, int, int *);
-void UpdatePC(DecodedInstr *, int);
-void PrintInstruction(DecodedInstr *);
+/*
+	All machine state lives in the Computer passed to each function, so
+	one process can run any number of independent machines. Nothing
+	here exits; problems come back as SIM_ codes.
+*/
+
+/*
 
-/*Globally accessible Computer variable*/
-Computer mips;
-RegVals rVals;
+	Implementing Control
 
-/*  
-	opcodes for I-format
-*/
-#define andi 0x0C
-#define addiu 0x09
-#define beq 0x04
-#define bne 0x05
-#define bgtz 0x07
-#define lui 0x0F
-#define lw 0x23
-#define ori 0x0D
-#define sw 0x2B
-/*  
-	opcodes for J-format
 */
-#define jal 0x03
-#define jump 0x02
+/*
+ *  Return bytes of zeroed memory for a table indexed by address, or
+ *  NULL if there is no room. The host gives it pages as they are first
+ *  touched, so a table for a large memory costs only what is used.
+ */
+void *MapTable(size_t bytes)
+{
+	void *table = mmap(NULL, bytes, PROT_READ | PROT_WRITE,
+										 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+	return table != MAP_FAILED ? table : NULL;
+}
+
+void UnmapTable(void *table, size_t bytes)
+{
+	if (table != NULL)
+	{
+		munmap(table, bytes);
+	}
+}
 
 /*
+ *  Give mips the tables kept per text word: its decodings and engine.
+ */
+static int MapText(Computer *mips)
+{
+	mips->decoded = MapTable(mips->textWords * sizeof(DecodedInstr));
+	mips->decodedVals = MapTable(mips->textWords * sizeof(RegVals));
+	mips->decodedValid = MapTable(mips->textWords);
+	if (mips->decoded == NULL || mips->decodedVals == NULL || mips->decodedValid == NULL)
+	{
+		return SIM_NO_MEMORY;
+	}
+	return NewEngine(mips);
+}
 
-	function codes for R-Format
+static void UnmapText(Computer *mips)
+{
+	FreeTrace(mips);
+	FreeEngine(mips);
+	UnmapTable(mips->decoded, mips->textWords * sizeof(DecodedInstr));
+	UnmapTable(mips->decodedVals, mips->textWords * sizeof(RegVals));
+	UnmapTable(mips->decodedValid, mips->textWords);
+	mips->decoded = NULL;
+	mips->decodedVals = NULL;
+	mips->decodedValid = NULL;
+}
 
-*/
+/*
+ *  Return a new machine printing to stdout, with the default memory
+ *  size, or NULL if there is no memory for one. Load a program into it
+ *  with InitComputer.
+ */
+Computer *NewComputer(void)
+{
+	Computer *mips = calloc(1, sizeof(Computer));
 
-#define addu 0x21
-#define and 0x24
-#define jr 0x08
-#define or 0x25
-#define slt 0x2A
-#define sll 0x00 // uses shamt
-#define srl 0x02 // uses shamt
-#define subu 0x23
+	if (mips == NULL)
+	{
+		return NULL;
+	}
+	mips->out = stdout;
+	mips->entry = TEXT_BASE;
+	if (SetMemorySize(mips, MAXNUMINSTRS, MAXNUMDATA) != SIM_OK)
+	{
+		FreeComputer(mips);
+		return NULL;
+	}
+	return mips;
+}
 
 /*
+ *  Give mips a text segment of textWords words and a data segment of
+ *  dataWords words after it, empty, before a program is loaded. The
+ *  memory is mapped, so that a pool can map its image over it page by
+ *  page, and only the pages a program touches take up host memory.
+ *  Returns SIM_TOO_BIG if the segments would reach MEMORY_END, and
+ *  SIM_NO_MEMORY, after which mips can only be freed, if there is no
+ *  memory for them. Not for harts.
+ */
+int SetMemorySize(Computer *mips, int textWords, int dataWords)
+{
+	if (textWords < 1 || dataWords < 1 ||
+			(unsigned long)textWords + dataWords >= (MEMORY_END - TEXT_BASE) / 4)
+	{
+		return SIM_TOO_BIG;
+	}
+	UnmapText(mips);
+	UntrackNonzero(mips);
+	UnmapTable(mips->memory, mips->mapped);
+	mips->textWords = textWords;
+	mips->dataWords = dataWords;
+	mips->mapped = MEMORY_BYTES(mips);
+	mips->guarded = 0;
+	mips->hugePages = 0;
+	mips->memory = MapTable(mips->mapped);
+	if (mips->memory == NULL)
+	{
+		return SIM_NO_MEMORY;
+	}
+	return MapText(mips);
+}
 
-	Implementing Control
+/*
+ *  Move the memory of mips, before a program is loaded, to the start of
+ *  a reservation reaching 4 GiB past the start of the data segment,
+ *  the rest of which can't be accessed. Any 32-bit offset from the data
+ *  segment then either lands in it or faults, so native code loads and
+ *  stores without comparing against its bounds and the JIT turns the
+ *  host's faults into Memory Access Exceptions. With hugePages set the
+ *  host is asked to back memory with huge pages. Returns SIM_TOO_BIG
+ *  if memory does not end on a page boundary, and SIM_NO_MEMORY, after
+ *  which mips can only be freed, if there is no room. Not for harts.
+ */
+int GuardMemory(Computer *mips, int hugePages)
+{
+	long page = sysconf(_SC_PAGESIZE);
+	size_t mapped = 4 * (size_t)mips->textWords + ((size_t)1 << 32);
+	void *reserved;
+
+	if (page <= 0 || MEMORY_BYTES(mips) % page != 0)
+	{
+		return SIM_TOO_BIG;
+	}
+	reserved = mmap(NULL, mapped, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (reserved == MAP_FAILED)
+	{
+		return SIM_NO_MEMORY;
+	}
+	if (mmap(reserved, MEMORY_BYTES(mips), PROT_READ | PROT_WRITE,
+					 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0) == MAP_FAILED)
+	{
+		munmap(reserved, mapped);
+		return SIM_NO_MEMORY;
+	}
+	UnmapText(mips);
+	UnmapTable(mips->memory, mips->mapped);
+	mips->memory = reserved;
+	mips->mapped = mapped;
+	mips->guarded = 1;
+	mips->hugePages = hugePages;
+	if (hugePages)
+	{
+		madvise(mips->memory, MEMORY_BYTES(mips), MADV_HUGEPAGE);
+	}
+	return MapText(mips);
+}
 
-*/
 /*
- *  Return an initialized computer with the stack pointer set to the
+ *  Return a new hart of mips: a machine with its own pc, registers and
+ *  engine that shares mips's memory, and so its program, starting with
+ *  mips's registers and settings. NULL if there is no memory for one.
+ *  Free it before mips.
+ */
+Computer *NewHart(Computer *mips)
+{
+	Computer *hart = calloc(1, sizeof(Computer));
+
+	if (hart == NULL)
+	{
+		return NULL;
+	}
+	hart->memory = mips->memory;
+	hart->textWords = mips->textWords;
+	hart->dataWords = mips->dataWords;
+	hart->guarded = mips->guarded;
+	hart->parent = mips;
+	memcpy(hart->registers, mips->registers, sizeof(hart->registers));
+	hart->pc = mips->pc;
+	hart->entry = mips->entry;
+	hart->printingRegisters = mips->printingRegisters;
+	hart->printingMemory = mips->printingMemory;
+	hart->debugging = mips->debugging;
+	hart->out = mips->out;
+	hart->budget = mips->budget;
+	hart->timeLimit = mips->timeLimit;
+	hart->mulLatency = mips->mulLatency;
+	hart->divLatency = mips->divLatency;
+	if (MapText(hart) != SIM_OK)
+	{
+		FreeComputer(hart);
+		return NULL;
+	}
+	return hart;
+}
+
+void FreeComputer(Computer *mips)
+{
+	if (mips != NULL)
+	{
+		UnmapText(mips);
+		UntrackNonzero(mips);
+		if (mips->parent == NULL)
+		{
+			UnmapTable(mips->memory, mips->mapped);
+		}
+		free(mips);
+	}
+}
+
+/*
+ *  Initialize the computer with the stack pointer set to the
  *  address of the end of data memory, the remaining registers initialized
- *  to zero, and the instructions read from the given file.
+ *  to zero, and the instructions read from the given file, which an ELF
+ *  executable may change along with where the program starts.
  *  The other arguments govern how the program interacts with the user.
+ *  Returns SIM_TOO_BIG if the program does not fit in the text segment,
+ *  or another status of LoadProgram() if it could not be loaded.
  */
-void InitComputer(FILE *filein, int printingRegisters, int printingMemory, int debugging, int interactive)
+int InitComputer(Computer *mips, FILE *filein, int printingRegisters, int printingMemory, int debugging, int interactive)
 {
-	int k;
-	unsigned int instr;
+	int k, status;
 
 	/* Initialize registers and memory */
 
 	for (k = 0; k < 32; k++)
 	{
-		mips.registers[k] = 0;
+		mips->registers[k] = 0;
 	}
+	mips->hi = mips->lo = 0;
 
 	/* stack pointer - Initialize to highest address of data segment */
-	mips.registers[29] = 0x00400000 + (MAXNUMINSTRS + MAXNUMDATA) * 4;
+	mips->registers[29] = DATA_BASE(mips) + 4 * mips->dataWords;
 
-	for (k = 0; k < MAXNUMINSTRS + MAXNUMDATA; k++)
+	/* Fresh pages read as zero and are only given memory on first touch */
+	if (mmap(mips->memory, MEMORY_BYTES(mips), PROT_READ | PROT_WRITE,
+					 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0) == MAP_FAILED)
+	{
+		memset(mips->memory, 0, MEMORY_BYTES(mips));
+	}
+	if (mips->hugePages)
 	{
-		mips.memory[k] = 0;
+		madvise(mips->memory, MEMORY_BYTES(mips), MADV_HUGEPAGE);
 	}
 
-	k = 0;
-	while (fread(&instr, 4, 1, filein))
+	memset(mips->decodedValid, 0, mips->textWords);
+	mips->linked = 0;
+	mips->entry = TEXT_BASE;
+
+	status = LoadProgram(mips, filein);
+	if (status != SIM_OK)
 	{
-		/*swap to big endian, convert to host byte order. Ignore this.*/
-		mips.memory[k] = ntohl(endianSwap(instr));
-		k++;
-		if (k > MAXNUMINSTRS)
-		{
-			fprintf(stderr, "Program too big.\n");
-			exit(1);
-		}
+		return status;
 	}
 
-	mips.printingRegisters = printingRegisters;
-	mips.printingMemory = printingMemory;
-	mips.interactive = interactive;
-	mips.debugging = debugging;
+	mips->printingRegisters = printingRegisters;
+	mips->printingMemory = printingMemory;
+	mips->interactive = interactive;
+	mips->debugging = debugging;
+	return SIM_OK;
+}
+
+static double Now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
 }
 
-unsigned int endianSwap(unsigned int i)
+/*
+ *  Return the retired count at which CheckLimits() must next be called.
+ */
+static unsigned long NextCheck(Computer *mips)
 {
-	return (i >> 24) | (i >> 8 & 0x0000ff00) | (i << 8 & 0x00ff0000) | (i << 24);
+	unsigned long next = ULONG_MAX;
+
+	if (mips->timeLimit > 0)
+	{
+		next = mips->retired + CHECK_INTERVAL;
+	}
+	if (mips->budget != 0 && mips->budget < next)
+	{
+		next = mips->budget;
+	}
+	return next;
 }
 
 /*
- *  Run the simulation.
+ *  Start a run under the instruction budget and time limit set in mips
+ *  (0 for none). Clears the retired count, with the cycles counted
+ *  by MulDiv(), and returns the count at which to first call
+ *  CheckLimits(); ULONG_MAX if there are no limits.
  */
-void Simulate()
+unsigned long StartLimits(Computer *mips)
+{
+	mips->retired = 0;
+	mips->hiloReady = 0;
+	mips->interlocks = 0;
+	if (mips->timeLimit > 0)
+	{
+		mips->deadline = Now() + mips->timeLimit;
+	}
+	return NextCheck(mips);
+}
+
+/*
+ *  Return SIM_BUDGET or SIM_TIMEOUT if the run has used up its budget
+ *  or its time, and otherwise SIM_OK with *checkAt moved on.
+ */
+int CheckLimits(Computer *mips, unsigned long *checkAt)
+{
+	if (mips->budget != 0 && mips->retired >= mips->budget)
+	{
+		return SIM_BUDGET;
+	}
+	if (mips->timeLimit > 0 && Now() >= mips->deadline)
+	{
+		return SIM_TIMEOUT;
+	}
+	*checkAt = NextCheck(mips);
+	return SIM_OK;
+}
+
+/*
+ *  Run the simulation. Returns why it stopped.
+ */
+static int RunSimulation(Computer *mips)
 {
 	char s[40]; /* used for handling interactive input */
 	unsigned int instr;
-	int changedReg = -1, changedMem = -1, val;
-	DecodedInstr d;
-
-	/* Initialize the PC to the start of the code section */
-	mips.pc = 0x00400000;
+	int changedReg = -1, changedMem = -1, val, status;
+	unsigned long checkAt;
+	DecodedInstr *d;
+	RegVals rVals;
+
+	/* Initialize the PC to the program's entry point */
+	mips->pc = mips->entry;
+	checkAt = StartLimits(mips);
 	while (1)
 	{
-		if (mips.interactive)
+		if (mips->retired >= checkAt && (status = CheckLimits(mips, &checkAt)) != SIM_OK)
 		{
-			printf("> ");
-			fgets(s, sizeof(s), stdin);
-			if (s[0] == 'q')
+			return status;
+		}
+		if (mips->interactive)
+		{
+			fprintf(mips->out, "> ");
+			fflush(mips->out);
+			if (fgets(s, sizeof(s), stdin) == NULL || s[0] == 'q')
 			{
-				return;
+				return SIM_QUIT;
 			}
 		}
 
-		/* Fetch instr at mips.pc, returning it in instr */
-		instr = Fetch(mips.pc);
+		/* Fetch instr at mips->pc, returning it in instr */
+		instr = Fetch(mips, mips->pc);
 
-		printf("Executing instruction at %8.8x: %8.8x\n", mips.pc, instr);
+		fprintf(mips->out, "Executing instruction at %8.8x: %8.8x\n", mips->pc, instr);
 
 		/* 
-	 * Decode instr, putting decoded instr in d
-	 * Note that we reuse the d struct for each instruction.
+	 * Look up the decoded form of instr, decoding it only the first
+	 * time this pc is executed.
 	 */
-		Decode(instr, &d, &rVals);
+		d = FetchDecoded(mips, mips->pc, &rVals);
 
 		/*Print decoded instruction*/
-		PrintInstruction(&d);
+		status = PrintInstruction(mips, d);
+		if (status != SIM_OK)
+		{
+			return status;
+		}
 
 		/* 
 	 * Perform computation needed to execute d, returning computed value 
 	 * in val 
 	 */
-		val = Execute(&d, &rVals);
+		val = Execute(mips, d, &rVals);
 
-		UpdatePC(&d, val);
+		UpdatePC(mips, d, val);
 
 		/* 
 	 * Perform memory load or store. Place the
 	 * address of any updated memory in *changedMem, 
 	 * otherwise put -1 in *changedMem. 
-	 * Return any memory value that is read, otherwise return -1.
+	 * Replace val with any memory value that is read.
 	 */
-		val = Mem(&d, val, &changedMem);
+		status = Mem(mips, d, &val, &changedMem);
+		if (status != SIM_OK)
+		{
+			return status;
+		}
 
 		/* 
 	 * Write back to register. If the instruction modified a register--
@@ -168,12 +411,26 @@ void Simulate()
 		 * put the index of the modified register in *changedReg,
 		 * otherwise put -1 in *changedReg.
 		 */
-		RegWrite(&d, val, &changedReg);
+		RegWrite(mips, d, val, &changedReg);
 
-		PrintInfo(changedReg, changedMem);
+		PrintInfo(mips, changedReg, changedMem);
+		mips->retired++;
 	}
 }
 
+int Simulate(Computer *mips)
+{
+	int status;
+
+	if (mips->printingMemory)
+	{
+		TrackNonzero(mips);
+	}
+	status = RunSimulation(mips);
+	UntrackNonzero(mips);
+	return status;
+}
+
 /*
  *  Print relevant information about the state of the computer.
  *  changedReg is the index of the register changed by the instruction
@@ -184,66 +441,423 @@ void Simulate()
  *  registers or just the one that changed, and whether to print
  *  all the nonzero memory or just the memory location that changed.
  */
-void PrintInfo(int changedReg, int changedMem)
+void PrintInfo(Computer *mips, int changedReg, int changedMem)
 {
 	int k, addr;
-	printf("New pc = %8.8x\n", mips.pc);
-	if (!mips.printingRegisters && changedReg == -1)
+	fprintf(mips->out, "New pc = %8.8x\n", mips->pc);
+	if (!mips->printingRegisters && changedReg == -1)
+	{
+		fprintf(mips->out, "No register was updated.\n");
+	}
+	else if (!mips->printingRegisters && changedReg == HILO_REG)
 	{
-		printf("No register was updated.\n");
+		fprintf(mips->out, "Updated hi to %8.8x and lo to %8.8x\n", mips->hi, mips->lo);
 	}
-	else if (!mips.printingRegisters)
+	else if (!mips->printingRegisters)
 	{
-		printf("Updated r%2.2d to %8.8x\n",
-					 changedReg, mips.registers[changedReg]);
+		fprintf(mips->out, "Updated r%2.2d to %8.8x\n",
+					 changedReg, mips->registers[changedReg]);
 	}
 	else
 	{
 		for (k = 0; k < 32; k++)
 		{
-			printf("r%2.2d: %8.8x  ", k, mips.registers[k]);
+			fprintf(mips->out, "r%2.2d: %8.8x  ", k, mips->registers[k]);
 			if ((k + 1) % 4 == 0)
 			{
-				printf("\n");
+				fprintf(mips->out, "\n");
 			}
 		}
+		fprintf(mips->out, "hi: %8.8x  lo: %8.8x  \n", mips->hi, mips->lo);
 	}
-	if (!mips.printingMemory && changedMem == -1)
+	if (!mips->printingMemory && changedMem == -1)
 	{
-		printf("No memory location was updated.\n");
+		fprintf(mips->out, "No memory location was updated.\n");
 	}
-	else if (!mips.printingMemory)
+	else if (!mips->printingMemory)
 	{
-		printf("Updated memory at address %8.8x to %8.8x\n",
-					 changedMem, Fetch(changedMem));
+		fprintf(mips->out, "Updated memory at address %8.8x to %8.8x\n",
+					 changedMem, Fetch(mips, changedMem));
 	}
 	else
 	{
-		printf("Nonzero memory\n");
-		printf("ADDR	  CONTENTS\n");
-		for (addr = 0x00400000 + 4 * MAXNUMINSTRS;
-				 addr < 0x00400000 + 4 * (MAXNUMINSTRS + MAXNUMDATA);
-				 addr = addr + 4)
+		MarkNonzero(mips, changedMem);
+		fprintf(mips->out, "Nonzero memory\n");
+		fprintf(mips->out, "ADDR	  CONTENTS\n");
+		for (addr = NextNonzero(mips, DATA_BASE(mips)); addr != -1; addr = NextNonzero(mips, addr + 4))
+		{
+			fprintf(mips->out, "%8.8x  %8.8x\n", addr, Fetch(mips, addr));
+		}
+	}
+}
+
+/*
+ *  Run multiply/divide unit instruction kind, with rs and rt its
+ *  operands, as the index-th instruction of the run, counting from 0.
+ *  Every instruction before it took a cycle, and the stalls counted
+ *  in interlocks, so it issues at cycle index + interlocks, unless the
+ *  unit is still busy and it waits. Returns the register mfhi and mflo
+ *  read. Nothing traps: division by zero gives a quotient of all ones
+ *  and leaves the dividend as the remainder.
+ */
+int MulDiv(Computer *mips, int kind, unsigned int rs, unsigned int rt, unsigned long index)
+{
+	unsigned long cycle = index + mips->interlocks;
+	unsigned long long product;
+
+	if (mips->hiloReady > cycle)
+	{
+		mips->interlocks += mips->hiloReady - cycle;
+		cycle = mips->hiloReady;
+	}
+	switch (kind)
+	{
+	case K_MULT:
+	case K_MULTU:
+		product = kind == K_MULT ? (unsigned long long)((long long)(int)rs * (int)rt)
+														 : (unsigned long long)rs * rt;
+		mips->hi = product >> 32;
+		mips->lo = product;
+		mips->hiloReady = cycle + mips->mulLatency;
+		break;
+	case K_DIV:
+		if (rt == 0 || (rs == 0x80000000u && rt == 0xFFFFFFFFu))
+		{
+			/* -2^31 / -1 overflows back to -2^31 */
+			mips->lo = rt == 0 ? -1 : (int)rs;
+			mips->hi = rt == 0 ? (int)rs : 0;
+		}
+		else
 		{
-			if (Fetch(addr) != 0)
+			mips->lo = (int)rs / (int)rt;
+			mips->hi = (int)rs % (int)rt;
+		}
+		mips->hiloReady = cycle + mips->divLatency;
+		break;
+	case K_DIVU:
+		mips->lo = rt == 0 ? 0xFFFFFFFFu : rs / rt;
+		mips->hi = rt == 0 ? rs : rs % rt;
+		mips->hiloReady = cycle + mips->divLatency;
+		break;
+	case K_MFHI:
+		return mips->hi;
+	case K_MFLO:
+		return mips->lo;
+	case K_MTHI:
+		mips->hi = rs;
+		break;
+	case K_MTLO:
+		mips->lo = rs;
+		break;
+	}
+	return 0;
+}
+
+/*
+ *  Print the cycles the run lost waiting for the multiply/divide unit,
+ *  if it is timed.
+ */
+void PrintInterlocks(Computer *mips)
+{
+	if (mips->mulLatency > 0 || mips->divLatency > 0)
+	{
+		fprintf(mips->out, "Interlocked for %lu cycles on HI/LO\n", mips->interlocks);
+	}
+}
+
+/* Words of the nonzero map and of its summary */
+#define NONZERO_WORDS(mips) (((size_t)(mips)->dataWords + 63) / 64)
+#define SUMMARY_WORDS(mips) ((NONZERO_WORDS(mips) + 63) / 64)
+
+/*
+ *  Map the nonzero words of the data segment of mips as memory holds
+ *  them now, so that printing it costs the nonzero words, skipping 64
+ *  words at a bit of the summary, rather than the whole segment. Until
+ *  UntrackNonzero(), every store must then go through MarkNonzero(),
+ *  as PrintInfo() does with the word each step changed. Without memory
+ *  for the map, NextNonzero() scans memory instead.
+ */
+void TrackNonzero(Computer *mips)
+{
+	size_t words = NONZERO_WORDS(mips), k;
+	int i, base;
+
+	UntrackNonzero(mips);
+	mips->nonzero = MapTable((words + SUMMARY_WORDS(mips)) * sizeof(unsigned long));
+	if (mips->nonzero == NULL)
+	{
+		return;
+	}
+	mips->nonzeroSummary = mips->nonzero + words;
+	for (k = 0; k < words; k++)
+	{
+		base = mips->textWords + 64 * k;
+		for (i = 0; i < 64 && 64 * k + i < (size_t)mips->dataWords; i++)
+		{
+			if (mips->memory[base + i] != 0)
 			{
-				printf("%8.8x  %8.8x\n", addr, Fetch(addr));
+				mips->nonzero[k] |= 1UL << i;
 			}
 		}
+		if (mips->nonzero[k] != 0)
+		{
+			mips->nonzeroSummary[k / 64] |= 1UL << k % 64;
+		}
 	}
 }
 
+void UntrackNonzero(Computer *mips)
+{
+	if (mips->nonzero != NULL)
+	{
+		UnmapTable(mips->nonzero, (NONZERO_WORDS(mips) + SUMMARY_WORDS(mips)) * sizeof(unsigned long));
+	}
+	mips->nonzero = NULL;
+	mips->nonzeroSummary = NULL;
+}
+
+/*
+ *  Bring the nonzero map up to date with the word at addr, which may
+ *  be -1 or outside the data segment, in which case nothing changes.
+ */
+void MarkNonzero(Computer *mips, int addr)
+{
+	unsigned int k = (unsigned int)(addr - DATA_BASE(mips)) / 4;
+
+	if (mips->nonzero == NULL || BAD_DATA_ADDR(mips, addr))
+	{
+		return;
+	}
+	if (mips->memory[mips->textWords + k] != 0)
+	{
+		mips->nonzero[k / 64] |= 1UL << k % 64;
+		mips->nonzeroSummary[k / 4096] |= 1UL << k / 64 % 64;
+	}
+	else
+	{
+		mips->nonzero[k / 64] &= ~(1UL << k % 64);
+		if (mips->nonzero[k / 64] == 0)
+		{
+			mips->nonzeroSummary[k / 4096] &= ~(1UL << k / 64 % 64);
+		}
+	}
+}
+
+/*
+ *  Return the first address from addr on of a nonzero word of the data
+ *  segment, or -1 if there is none.
+ */
+int NextNonzero(Computer *mips, int addr)
+{
+	unsigned int k = (unsigned int)(addr - DATA_BASE(mips)) / 4;
+	size_t w, s, words = NONZERO_WORDS(mips);
+	unsigned long bits;
+
+	if (mips->nonzero == NULL)
+	{
+		for (; k < (unsigned int)mips->dataWords; k++)
+		{
+			if (mips->memory[mips->textWords + k] != 0)
+			{
+				return DATA_BASE(mips) + 4 * k;
+			}
+		}
+		return -1;
+	}
+	if (k >= (unsigned int)mips->dataWords)
+	{
+		return -1;
+	}
+	w = k / 64;
+	bits = mips->nonzero[w] & (~0UL << k % 64);
+	if (bits == 0)
+	{
+		/* Find the next map word with a bit set from the summary */
+		w++;
+		s = w / 64;
+		if (s >= SUMMARY_WORDS(mips))
+		{
+			return -1;
+		}
+		bits = mips->nonzeroSummary[s] & (~0UL << w % 64);
+		while (bits == 0)
+		{
+			if (++s >= SUMMARY_WORDS(mips))
+			{
+				return -1;
+			}
+			bits = mips->nonzeroSummary[s];
+		}
+		w = 64 * s + __builtin_ctzl(bits);
+		if (w >= words)
+		{
+			return -1;
+		}
+		bits = mips->nonzero[w];
+	}
+	return DATA_BASE(mips) + 4 * (64 * w + __builtin_ctzl(bits));
+}
+
 /*
  *  Return the contents of memory at the given address. Simulates
- *  instruction fetch. 
+ *  instruction fetch. Words outside memory read as zero.
  */
-unsigned int Fetch(int addr)
+unsigned int Fetch(Computer *mips, int addr)
 {
-	return mips.memory[(addr - 0x00400000) / 4];
+	unsigned int k = (unsigned int)(addr - TEXT_BASE) / 4;
+
+	return k < (unsigned int)(mips->textWords + mips->dataWords) ? mips->memory[k] : 0;
+}
+
+/*
+ *  Return the decoded instruction at addr, filling *rVals the same way
+ *  Decode does. Text segment words are decoded once and cached;
+ *  anything outside the text segment is decoded afresh every time.
+ */
+DecodedInstr *FetchDecoded(Computer *mips, int addr, RegVals *rVals)
+{
+	unsigned int k = (unsigned int)(addr - TEXT_BASE) / 4;
+
+	if (k >= (unsigned int)mips->textWords)
+	{
+		Decode(mips, Fetch(mips, addr), &mips->decodedOutside, rVals);
+		return &mips->decodedOutside;
+	}
+	if (!mips->decodedValid[k])
+	{
+		Decode(mips, Fetch(mips, addr), &mips->decoded[k], &mips->decodedVals[k]);
+		mips->decodedValid[k] = 1;
+	}
+	*rVals = mips->decodedVals[k];
+	return &mips->decoded[k];
+}
+
+/*
+	The instruction table. Decoding looks the opcode up in opKinds, the
+	funct of an R-format word in functKinds and the rt of a regimm word
+	in regimmKinds; 0 means the simulator does not support it. The kind
+	found indexes instrTable for everything else PrintInstruction() and
+	RegWrite() need to know, and Execute(), UpdatePC() and every engine
+	switch on it.
+*/
+static const unsigned char opKinds[64] = {
+		[addiu] = K_ADDIU,
+		[andi] = K_ANDI,
+		[ori] = K_ORI,
+		[lui] = K_LUI,
+		[beq] = K_BEQ,
+		[bne] = K_BNE,
+		[bgtz] = K_BGTZ,
+		[lw] = K_LW,
+		[sw] = K_SW,
+		[ll] = K_LL,
+		[sc] = K_SC,
+		[jump] = K_J,
+		[jal] = K_JAL,
+		[addi] = K_ADDI,
+		[slti] = K_SLTI,
+		[sltiu] = K_SLTIU,
+		[xori] = K_XORI,
+		[blez] = K_BLEZ,
+};
+
+static const unsigned char functKinds[64] = {
+		[addu] = K_ADDU,
+		[subu] = K_SUBU,
+		[and] = K_AND,
+		[or] = K_OR,
+		[slt] = K_SLT,
+		[sll] = K_SLL,
+		[srl] = K_SRL,
+		[jr] = K_JR,
+		[sra] = K_SRA,
+		[sllv] = K_SLLV,
+		[srlv] = K_SRLV,
+		[srav] = K_SRAV,
+		[nor] = K_NOR,
+		[xor] = K_XOR,
+		[jalr] = K_JALR,
+		[mult] = K_MULT,
+		[multu] = K_MULTU,
+		[div] = K_DIV,
+		[divu] = K_DIVU,
+		[mfhi] = K_MFHI,
+		[mflo] = K_MFLO,
+		[mthi] = K_MTHI,
+		[mtlo] = K_MTLO,
+};
+
+static const unsigned char regimmKinds[32] = {
+		[bltz] = K_BLTZ,
+		[bgez] = K_BGEZ,
+};
+
+const InstrInfo instrTable[NUM_KINDS] = {
+		[K_ADDU] = {"addu", F_RD_RS_RT, W_RD},
+		[K_SUBU] = {"subu", F_RD_RS_RT, W_RD},
+		[K_AND] = {"and", F_RD_RS_RT, W_RD},
+		[K_OR] = {"or", F_RD_RS_RT, W_RD},
+		[K_SLT] = {"slt", F_RD_RS_RT, W_RD},
+		[K_SLL] = {"sll", F_RD_RS_SHAMT, W_RD},
+		[K_SRL] = {"srl", F_RD_RS_SHAMT, W_RD},
+		[K_JR] = {"jr", F_RA, W_NONE},
+		[K_ADDIU] = {"addiu", F_RT_RS_IMM, W_RT},
+		[K_ANDI] = {"andi", F_RT_RS_IMM, W_RT},
+		[K_ORI] = {"ori", F_RT_RS_IMM, W_RT},
+		[K_LUI] = {"lui", F_RT_RS_IMM, W_RT},
+		[K_BEQ] = {"beq", F_RS_RT_TARGET, W_NONE},
+		[K_BNE] = {"bne", F_RS_RT_TARGET, W_NONE},
+		[K_BGTZ] = {"bgtz", F_RS_TARGET, W_NONE},
+		[K_LW] = {"lw", F_MEMORY, W_RT},
+		[K_SW] = {"sw", F_MEMORY, W_NONE},
+		[K_J] = {"j", F_TARGET, W_NONE},
+		[K_JAL] = {"jal", F_TARGET, W_RA},
+		[K_LL] = {"ll", F_MEMORY, W_RT},
+		[K_SC] = {"sc", F_MEMORY, W_RT},
+		[K_ADDI] = {"addi", F_RT_RS_IMM, W_RT},
+		[K_SLTI] = {"slti", F_RT_RS_IMM, W_RT},
+		[K_SLTIU] = {"sltiu", F_RT_RS_IMM, W_RT},
+		[K_XORI] = {"xori", F_RT_RS_IMM, W_RT},
+		[K_SRA] = {"sra", F_RD_RT_SHAMT, W_RD},
+		[K_SLLV] = {"sllv", F_RD_RT_RS, W_RD},
+		[K_SRLV] = {"srlv", F_RD_RT_RS, W_RD},
+		[K_SRAV] = {"srav", F_RD_RT_RS, W_RD},
+		[K_NOR] = {"nor", F_RD_RS_RT, W_RD},
+		[K_XOR] = {"xor", F_RD_RS_RT, W_RD},
+		[K_BLEZ] = {"blez", F_RS_TARGET, W_NONE},
+		[K_BLTZ] = {"bltz", F_RS_TARGET, W_NONE},
+		[K_BGEZ] = {"bgez", F_RS_TARGET, W_NONE},
+		[K_JALR] = {"jalr", F_RD_RS, W_RD},
+		[K_MULT] = {"mult", F_RS_RT, W_HILO},
+		[K_MULTU] = {"multu", F_RS_RT, W_HILO},
+		[K_DIV] = {"div", F_RS_RT, W_HILO},
+		[K_DIVU] = {"divu", F_RS_RT, W_HILO},
+		[K_MFHI] = {"mfhi", F_RD, W_RD},
+		[K_MFLO] = {"mflo", F_RD, W_RD},
+		[K_MTHI] = {"mthi", F_RS, W_HILO},
+		[K_MTLO] = {"mtlo", F_RS, W_HILO},
+};
+
+/*
+ *  Return the kind of instr, K_UNSUPPORTED if the simulator does not
+ *  support it.
+ */
+int InstrKind(unsigned int instr)
+{
+	unsigned int opcode = instr >> 26;
+	int kind;
+
+	if (opcode == 0)
+		kind = functKinds[instr & 63];
+	else if (opcode == regimm)
+		kind = regimmKinds[(instr >> 16) & 31];
+	else
+		kind = opKinds[opcode];
+	return kind != K_TRANSLATE ? kind : K_UNSUPPORTED;
 }
 
 /* Decode instr, returning decoded instruction. */
-void Decode(unsigned int instr, DecodedInstr *d, RegVals *rVals)
+void Decode(Computer *mips, unsigned int instr, DecodedInstr *d, RegVals *rVals)
 {
 	//printf("Calling Decode\n");
 	char format;
@@ -268,6 +882,7 @@ void Decode(unsigned int instr, DecodedInstr *d, RegVals *rVals)
 	rVals->R_rs = 0;
 	rVals->R_rt = 0;
 	rVals->R_rd = 0;
+	d->kind = InstrKind(instr);
 
 	if (opcode == 0)
 		format = 'R';
@@ -359,7 +974,7 @@ void Decode(unsigned int instr, DecodedInstr *d, RegVals *rVals)
 			*/
 		d->type = J;
 		d->op = opcode;
-		int curr_pc = (mips.pc >> 28) << 28;
+		int curr_pc = (mips->pc >> 28) << 28;
 
 		int target_pc = ((instr << 6) >> 4) | curr_pc;
 
@@ -373,289 +988,164 @@ void Decode(unsigned int instr, DecodedInstr *d, RegVals *rVals)
 
 /*
  *  Print the disassembled version of the given instruction
- *  followed by a newline.
+ *  followed by a newline. Returns SIM_UNSUPPORTED, after saying so,
+ *  for an instruction the simulator does not support.
  */
-void PrintInstruction(DecodedInstr *d)
+int PrintInstruction(Computer *mips, DecodedInstr *d)
 {
-	/* Your code goes here */
-	// Check if the instruction is R-foarmat
-	char *instr = (char *)malloc(sizeof(char) * 5);
-	int supported_instr = 1;
-
-	//printf("%d\n", d->op);
-	//printf("R: %d\n", d->regs.r.funct);
-
-	if (d->type == R)
-	{
-		//printf("R: %d\n", d->regs.r.funct);
-		switch (d->regs.r.funct)
-		{
-		case addu:
-			strcpy(instr, "addu");
-			break;
-
-		case and:
-			strcpy(instr, "and");
-			break;
-
-		case jr:
-			strcpy(instr, "jr");
-			break;
-
-		case or:
-			strcpy(instr, "or");
-			break;
-
-		case slt:
-			strcpy(instr, "slt");
-			break;
-
-		case sll:
-			strcpy(instr, "sll");
-			break;
-
-		case srl:
-			strcpy(instr, "srl");
-			break;
-
-		case subu:
-			strcpy(instr, "subu");
-			break;
-		default: // gets triggered if theres an unsupported code
-			supported_instr = 0;
-			break;
-		}
-	}
-	else if (d->type == I)
-	{
-		switch (d->op)
-		{
-			//printf("%d\n", d->op);
-
-		case addiu:
-			strcpy(instr, "addiu");
-			break;
-
-		case beq:
-			strcpy(instr, "beq");
-			break;
-
-		case bne:
-			strcpy(instr, "bne");
-			break;
-
-		case bgtz:
-			strcpy(instr, "bgtz");
-			break;
-
-		case lui:
-			strcpy(instr, "lui");
-			break;
-
-		case lw:
-			strcpy(instr, "lw");
-			break;
-
-		case ori:
-			strcpy(instr, "ori");
-			break;
-
-		case sw:
-			strcpy(instr, "sw");
-			break;
+	const InstrInfo *info = &instrTable[d->kind];
 
-		case andi:
-			strcpy(instr, "andi");
-			break;
-
-		default: // gets triggered if theres an unsupported code
-			supported_instr = 0;
-			break;
-		}
-	}
-	else
-	{
-		switch (d->op)
-		{
-		case jal:
-			strcpy(instr, "jal");
-			break;
-
-		case jump:
-			strcpy(instr, "j");
-			break;
-
-		default: // gets triggered if theres an unsupported code
-			supported_instr = 0;
-			break;
-		}
-	}
-
-	if (supported_instr == 0)
+	if (d->kind == K_UNSUPPORTED)
 	{
-		printf("Unsupported instruction found. Terminating program\n");
-		exit(0);
+		fprintf(mips->out, "Unsupported instruction found. Terminating program\n");
+		return SIM_UNSUPPORTED;
 	}
 
-	if (d->type == R)
-	{
-		if (d->regs.r.funct == sll || d->regs.r.funct == srl)
-		{
-			printf("%s\t$%d, $%d, %d\n", instr, d->regs.r.rd, d->regs.r.rs, d->regs.r.shamt);
-		}
-		else if (d->regs.r.funct == jr)
-		{
-			printf("%s\t$%d\n", instr, 31);
-		}
-		else
-		{
-			printf("%s\t$%d, $%d, $%d\n", instr, d->regs.r.rd, d->regs.r.rs, d->regs.r.rt);
-		}
-	}
-	else if (d->type == I)
-	{
-		if (d->op == bne || d->op == beq)
-		{
-			printf("%s\t$%d, $%d, 0x%8.8x\n", instr, d->regs.i.rs, d->regs.i.rt, mips.pc + ((4 * d->regs.i.addr_or_immed) + 4));
-		}
-		else if (d->op == lw || d->op == sw)
-		{
-			printf("%s\t$%d, %d($%d)\n", instr, d->regs.i.rt, d->regs.i.addr_or_immed, d->regs.i.rs);
-		}
-		else
-			printf("%s\t$%d, $%d, %d\n", instr, d->regs.i.rt, d->regs.i.rs, d->regs.i.addr_or_immed);
-	}
-	else if (d->type == J)
+	switch (info->format)
 	{
-		printf("%s\t0x%8.8x\n", instr, d->regs.j.target);
+	case F_RD_RS_RT:
+		fprintf(mips->out, "%s\t$%d, $%d, $%d\n", info->name, d->regs.r.rd, d->regs.r.rs, d->regs.r.rt);
+		break;
+	case F_RD_RT_RS:
+		fprintf(mips->out, "%s\t$%d, $%d, $%d\n", info->name, d->regs.r.rd, d->regs.r.rt, d->regs.r.rs);
+		break;
+	case F_RD_RS_SHAMT:
+		fprintf(mips->out, "%s\t$%d, $%d, %d\n", info->name, d->regs.r.rd, d->regs.r.rs, d->regs.r.shamt);
+		break;
+	case F_RD_RT_SHAMT:
+		fprintf(mips->out, "%s\t$%d, $%d, %d\n", info->name, d->regs.r.rd, d->regs.r.rt, d->regs.r.shamt);
+		break;
+	case F_RA:
+		fprintf(mips->out, "%s\t$%d\n", info->name, 31);
+		break;
+	case F_RD_RS:
+		fprintf(mips->out, "%s\t$%d, $%d\n", info->name, d->regs.r.rd, d->regs.r.rs);
+		break;
+	case F_RT_RS_IMM:
+		fprintf(mips->out, "%s\t$%d, $%d, %d\n", info->name, d->regs.i.rt, d->regs.i.rs, d->regs.i.addr_or_immed);
+		break;
+	case F_RS_RT_TARGET:
+		fprintf(mips->out, "%s\t$%d, $%d, 0x%8.8x\n", info->name, d->regs.i.rs, d->regs.i.rt, mips->pc + ((4 * d->regs.i.addr_or_immed) + 4));
+		break;
+	case F_RS_TARGET:
+		fprintf(mips->out, "%s\t$%d, 0x%8.8x\n", info->name, d->regs.i.rs, mips->pc + ((4 * d->regs.i.addr_or_immed) + 4));
+		break;
+	case F_MEMORY:
+		fprintf(mips->out, "%s\t$%d, %d($%d)\n", info->name, d->regs.i.rt, d->regs.i.addr_or_immed, d->regs.i.rs);
+		break;
+	case F_TARGET:
+		fprintf(mips->out, "%s\t0x%8.8x\n", info->name, d->regs.j.target);
+		break;
+	case F_RS_RT:
+		fprintf(mips->out, "%s\t$%d, $%d\n", info->name, d->regs.r.rs, d->regs.r.rt);
+		break;
+	case F_RD:
+		fprintf(mips->out, "%s\t$%d\n", info->name, d->regs.r.rd);
+		break;
+	case F_RS:
+		fprintf(mips->out, "%s\t$%d\n", info->name, d->regs.r.rs);
+		break;
 	}
-
-	free(instr);
+	return SIM_OK;
 }
 
 /* Perform computation needed to execute d, returning computed value */
-int Execute(DecodedInstr *d, RegVals *rVals)
+int Execute(Computer *mips, DecodedInstr *d, RegVals *rVals)
 {
-	//printf("Calling Execute\n");
-	/* Your code goes here */
+	unsigned int rs = mips->registers[rVals->R_rs], rt = mips->registers[rVals->R_rt];
+	int imm = d->regs.i.addr_or_immed, taken;
 
-	// if its an R-format
-	if (d->type == R)
+	switch (d->kind)
 	{
-		switch (d->regs.r.funct)
+	case K_ADDU:
+		return mips->registers[rVals->R_rs] + mips->registers[rVals->R_rt];
+	case K_SUBU:
+		return mips->registers[rVals->R_rs] - mips->registers[rVals->R_rt];
+	case K_SLL:
+		return (unsigned int)mips->registers[rVals->R_rt] << d->regs.r.shamt;
+	case K_SRL:
+		/* Shifts the signed register, so srl is arithmetic like sra */
+	case K_SRA:
+		return mips->registers[rVals->R_rt] >> d->regs.r.shamt;
+	case K_AND:
+		return mips->registers[rVals->R_rs] & mips->registers[rVals->R_rt];
+	case K_OR:
+		return mips->registers[rVals->R_rs] | mips->registers[rVals->R_rt];
+	case K_SLT:
+		return (mips->registers[rVals->R_rs] < mips->registers[rVals->R_rt]) ? 1 : 0;
+	case K_JR:
+		return mips->registers[31];
+	case K_SLLV:
+		return rt << (rs & 31);
+	case K_SRLV:
+		return rt >> (rs & 31);
+	case K_SRAV:
+		return (int)rt >> (rs & 31);
+	case K_NOR:
+		return ~(rs | rt);
+	case K_XOR:
+		return rs ^ rt;
+	case K_JALR:
+		/* The link; UpdatePC() jumps to $rs before RegWrite() sets $rd */
+		return mips->pc + 4;
+	case K_MULT:
+	case K_MULTU:
+	case K_DIV:
+	case K_DIVU:
+	case K_MFHI:
+	case K_MFLO:
+	case K_MTHI:
+	case K_MTLO:
+		return MulDiv(mips, d->kind, rs, rt, mips->retired);
+
+	case K_ADDIU:
+		return (mips->registers[d->regs.i.rs] + d->regs.i.addr_or_immed);
+	case K_ADDI:
+		/* There are no overflow exceptions, so addi wraps like addiu */
+		return rs + imm;
+	case K_ANDI:
+		return mips->registers[rVals->R_rs] & d->regs.i.addr_or_immed;
+	case K_ORI:
+		return mips->registers[rVals->R_rs] | d->regs.i.addr_or_immed;
+	case K_XORI:
+		return rs ^ (imm & 0xFFFF);
+	case K_SLTI:
+		return (int)rs < imm;
+	case K_SLTIU:
+		return rs < (unsigned int)imm;
+	case K_LUI:
+		return d->regs.i.addr_or_immed << 16;
+	case K_BEQ:
+		if (mips->registers[rVals->R_rt] - mips->registers[rVals->R_rs] == 0)
 		{
-		case addu:
-			//mips.registers[d->regs.r.rd] = mips.registers[rVals->R_rs] + mips.registers[rVals->R_rt];
-			//	printf("R_rt: %d\nR_rs: %d\n\n\n", mips.registers[rVals->R_rt], mips.registers[rVals->R_rs]);
-
-			return mips.registers[rVals->R_rs] + mips.registers[rVals->R_rt];
-			break;
-
-		case subu:
-			//	mips.registers[d->regs.r.rd] = mips.registers[rVals->R_rs] - mips.registers[rVals->R_rt];
-			return mips.registers[rVals->R_rs] - mips.registers[rVals->R_rt];
-			break;
-
-		case sll:
-			//mips.registers[d->regs.r.rd] = mips.registers[rVals->R_rt] << d->regs.r.shamt;
-			return (unsigned int)mips.registers[rVals->R_rt] << d->regs.r.shamt;
-			break;
-
-		case srl:
-			//mips.registers[d->regs.r.rd] = mips.registers[rVals->R_rt] >> d->regs.r.shamt;
-			return mips.registers[rVals->R_rt] >> d->regs.r.shamt;
-			break;
-
-		case and:
-			//mips.registers[d->regs.r.rd] = mips.registers[rVals->R_rs] & mips.registers[rVals->R_rt];
-			return mips.registers[rVals->R_rs] & mips.registers[rVals->R_rt];
-			break;
-
-		case or:
-			//mips.registers[d->regs.r.rd] = mips.registers[rVals->R_rs] | mips.registers[rVals->R_rt];
-			return mips.registers[rVals->R_rs] | mips.registers[rVals->R_rt];
-			break;
-
-		case slt:
-			//mips.registers[d->regs.r.rd] = (mips.registers[rVals->R_rs] < mips.registers[rVals->R_rt]) ? 1 : 0;
-			return (mips.registers[rVals->R_rs] < mips.registers[rVals->R_rt]) ? 1 : 0;
-			break;
-
-		case jr:
-			return mips.registers[31];
-			break;
-
-			//return 0;
+			return ((4 * d->regs.i.addr_or_immed));
 		}
-	}
-	if (d->type == I)
-	{
-		switch (d->op)
+		return 0;
+	case K_BNE:
+		if (mips->registers[rVals->R_rt] - mips->registers[rVals->R_rs] != 0)
 		{
-
-		case addiu:
-			//mips.registers[d->regs.i.rt] = mips.registers[d->regs.i.rs] + d->regs.i.addr_or_immed;
-			//printf("R_rt: %d\nR_rs: %d\n\n\n", mips.registers[rVals->R_rt], mips.registers[rVals->R_rs]);
-			return (mips.registers[d->regs.i.rs] + d->regs.i.addr_or_immed);
-
-		case andi:
-			//mips.registers[d->regs.i.rt] = mips.registers[rVals->R_rs] & d->regs.i.addr_or_immed;
-			return mips.registers[rVals->R_rs] & d->regs.i.addr_or_immed;
-
-		case ori:
-			//mips.registers[d->regs.i.rt] = mips.registers[rVals->R_rs] | d->regs.i.addr_or_immed;
-			return mips.registers[rVals->R_rs] | d->regs.i.addr_or_immed;
-		case lui:
-			return d->regs.i.addr_or_immed << 16;
-
-		case beq:
-			//printf("R_rt: %d\nR_rs: %d\n\n\n", mips.registers[d->regs.i.rt], mips.registers[d->regs.i.rs]);
-			if (mips.registers[rVals->R_rt] - mips.registers[rVals->R_rs] == 0)
-			{
-				//printf("R_rt: %d\nR_rs: %d\n\n\n", mips.registers[rVals->R_rt], mips.registers[rVals->R_rs]);
-
-				//printf("BEQ Output: %d\n\n\n", ((4 * d->regs.i.addr_or_immed)));
-				return ((4 * d->regs.i.addr_or_immed));
-			}
-			break;
-			//return 0;
-
-		case bne:
-			if (mips.registers[rVals->R_rt] - mips.registers[rVals->R_rs] != 0)
-			{
-				return d->regs.i.addr_or_immed;
-			}
-			break;
-			//return 0;
-
-		case lw:
-			// Since our stack memory pointer is in the highest memory of our current program
-			// We are subtract our stack pointer by our immediate * 4.
-			return (mips.registers[d->regs.i.rs] + (d->regs.i.addr_or_immed));
-			break;
-
-		case sw:
-			// Since our stack memory pointer is in the highest memory of our current program
-			// We are subtract our stack pointer by our immediate * 4.
-			//printf("Accessing Memory: 0x%8.8x\n",mips.registers[d->regs.i.rs] - (d->regs.i.addr_or_immed ));
-			return (mips.registers[d->regs.i.rs] + (d->regs.i.addr_or_immed));
-			break;
-
-		default:
-			return 0;
-		}
-	}
-
-	if (d->op == jal || d->op == jump)
-	{
-		if (d->op == jal)
-		{
-			mips.registers[31] = mips.pc + 4;
-			return d->regs.j.target;
+			return d->regs.i.addr_or_immed;
 		}
+		return 0;
+	case K_BLEZ:
+	case K_BGTZ:
+	case K_BLTZ:
+	case K_BGEZ:
+		/* The pc to go to, which UpdatePC() takes as it is */
+		taken = d->kind == K_BLEZ ? (int)rs <= 0 : d->kind == K_BGTZ ? (int)rs > 0 : d->kind == K_BLTZ ? (int)rs < 0 : (int)rs >= 0;
+		return mips->pc + 4 + (taken ? 4 * imm : 0);
+	case K_LW:
+	case K_SW:
+	case K_LL:
+	case K_SC:
+		return (mips->registers[d->regs.i.rs] + (d->regs.i.addr_or_immed));
+
+	case K_JAL:
+		mips->registers[31] = mips->pc + 4;
+		return d->regs.j.target;
+	case K_J:
 		return d->regs.j.target;
 	}
-
 	return 0;
 }
 
@@ -664,95 +1154,146 @@ int Execute(DecodedInstr *d, RegVals *rVals)
  * instructions other than branches and jumps, for example, the PC
  * increments by 4 (which we have provided).
  */
-void UpdatePC(DecodedInstr *d, int val)
+void UpdatePC(Computer *mips, DecodedInstr *d, int val)
 {
-	//printf("Calling UpdatePC\n");
-	mips.pc += 4;
-	if (d->type == J && (d->op == jump || d->op == jal))
-	{
-		mips.pc = val;
-	}
-	if (d->type == R && d->regs.r.funct == jr)
-	{
-		mips.pc = mips.registers[31];
-	}
-	if (d->type == I && (d->op == beq || d->op == bne))
+	mips->pc += 4;
+	switch (d->kind)
 	{
+	case K_J:
+	case K_JAL:
+	case K_BLEZ:
+	case K_BGTZ:
+	case K_BLTZ:
+	case K_BGEZ:
+		mips->pc = val;
+		break;
+	case K_JR:
+		mips->pc = mips->registers[31];
+		break;
+	case K_JALR:
+		mips->pc = mips->registers[d->regs.r.rs];
+		break;
+	case K_BEQ:
+	case K_BNE:
+		/* Only forward branches are taken */
 		if (val > 0)
 		{
-			//printf("Called\n\n");
-			mips.pc += val;
+			mips->pc += val;
 		}
+		break;
 	}
-
-	/* Your code goes here */
 }
 
 /*
- * Perform memory load or store. Place the address of any updated memory 
- * in *changedMem, otherwise put -1 in *changedMem. Return any memory value 
- * that is read, otherwise return -1. 
+ * Perform memory load or store of the address in *val. Place the address
+ * of any updated memory in *changedMem, otherwise put -1 in *changedMem.
+ * Replace *val with any memory value that is read. Returns
+ * SIM_MEMORY_EXCEPTION, after saying so, for a bad address.
  *
- * Remember that we're mapping MIPS addresses to indices in the mips.memory 
- * array. mips.memory[0] corresponds with address 0x00400000, mips.memory[1] 
+ * Remember that we're mapping MIPS addresses to indices in the mips->memory 
+ * array. mips->memory[0] corresponds with address 0x00400000, mips->memory[1] 
  * with address 0x00400004, and so forth.
  * 
  */
-int Mem(DecodedInstr *d, int val, int *changedMem)
+int Mem(Computer *mips, DecodedInstr *d, int *value, int *changedMem)
 {
+	int val = *value;
+
 	/* Your code goes here */
 	//printf("Value in Memory: %d\n", val);
 
-	// Max size in mips.memory is 4,096
-	// So we can only access mips.memory[0] up to mips.memory[4095]
+	// mips->memory holds textWords + dataWords words, and only the data
+	// segment after the text can be loaded from or stored to.
 	//
 
 	*changedMem = -1;
 
-	// Given in the project's PDF under Mem.
-	int memoryLowerBound = 0x00401000,
-			memoryUpperBound = 0x00403FFF;
-
 	if (d->op == sw)
 	{
-		// Prevent memory access in any address accessed out of the bounds 0x00401000 and
-		// 0x00403FFC
+		// Prevent memory access in any address accessed out of the data segment,
+		// 0x00401000 to 0x00403FFC by default
 
 		// Check if the value is out of bounds or if the user is inputting an offset that
 		// is not divisible by 4. Exit program if triggered
-		if (val < memoryLowerBound || val > memoryUpperBound || val % 4 != 0)
+		if (BAD_DATA_ADDR(mips, val))
 		{
-			printf("Memory Access Exception at 0x%8.8x: address 0x%8.8x\n", mips.pc, val);
+			fprintf(mips->out, "Memory Access Exception at 0x%8.8x: address 0x%8.8x\n", mips->pc, val);
 			*changedMem = -1;
-			exit(0);
+			return SIM_MEMORY_EXCEPTION;
 		}
 
-		// mips.registers[29] = 0x00400000 + (MAXNUMINSTRS + MAXNUMDATA) * 4;
 		// Update Memory because you accessed and changed memory
 		*changedMem = val;
 
-		int memoryIndex = (val - 0x00400000) / 4;
+		unsigned int memoryIndex = (unsigned int)(val - TEXT_BASE) / 4;
 
-		mips.memory[memoryIndex] = mips.registers[d->regs.i.rt];
+		if (mips->l1 != NULL)
+		{
+			CacheAccess(mips, val, 1);
+		}
+		mips->memory[memoryIndex] = mips->registers[d->regs.i.rt];
 	}
 	if (d->op == lw)
 	{
-		// Prevent memory access in any address accessed out of the bounds 0x00401000 and
-		// 0x00403FFC
-		if (val < memoryLowerBound || val > memoryUpperBound || val % 4 != 0)
+		// Prevent memory access in any address accessed out of the data segment
+		if (BAD_DATA_ADDR(mips, val))
 		{
-			printf("Memory Access Exception at 0x%8.8x: address 0x%8.8x\n", mips.pc, val);
+			fprintf(mips->out, "Memory Access Exception at 0x%8.8x: address 0x%8.8x\n", mips->pc, val);
 			*changedMem = -1;
-			exit(0);
+			return SIM_MEMORY_EXCEPTION;
 		}
 		// Load word doesn't change memory, it only access it.
 		*changedMem = -1;
 
-		int memoryIndex = (val - 0x00400000) / 4;
+		unsigned int memoryIndex = (unsigned int)(val - TEXT_BASE) / 4;
+
+		if (mips->l1 != NULL)
+		{
+			CacheAccess(mips, val, 0);
+		}
+		*value = mips->memory[memoryIndex];
+	}
+	if (d->op == ll || d->op == sc)
+	{
+		if (BAD_DATA_ADDR(mips, val))
+		{
+			fprintf(mips->out, "Memory Access Exception at 0x%8.8x: address 0x%8.8x\n", mips->pc, val);
+			*changedMem = -1;
+			return SIM_MEMORY_EXCEPTION;
+		}
+
+		unsigned int memoryIndex = (unsigned int)(val - TEXT_BASE) / 4;
 
-		val = mips.memory[memoryIndex];
+		if (d->op == ll)
+		{
+			*value = __atomic_load_n(&mips->memory[memoryIndex], __ATOMIC_SEQ_CST);
+			mips->linked = 1;
+			mips->linkAddr = val;
+			mips->linkValue = *value;
+		}
+		else
+		{
+			// The store goes through only if the word still holds what ll read,
+			// which other harts sharing the memory may have changed since.
+			int expected = mips->linkValue;
+
+			*value = mips->linked && mips->linkAddr == val &&
+							 __atomic_compare_exchange_n(&mips->memory[memoryIndex], &expected,
+																					 mips->registers[d->regs.i.rt], 0,
+																					 __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+			if (*value)
+			{
+				*changedMem = val;
+			}
+			mips->linked = 0;
+		}
+		if (mips->l1 != NULL)
+		{
+			/* A failed sc only read the word */
+			CacheAccess(mips, val, d->op == sc && *value);
+		}
 	}
-	return val;
+	return SIM_OK;
 }
 
 /* 
@@ -761,36 +1302,24 @@ int Mem(DecodedInstr *d, int val, int *changedMem)
  * put the index of the modified register in *changedReg,
  * otherwise put -1 in *changedReg.
  */
-void RegWrite(DecodedInstr *d, int val, int *changedReg)
+void RegWrite(Computer *mips, DecodedInstr *d, int val, int *changedReg)
 {
 	*changedReg = -1;
-	//	printf("Value in Regw: %d\n", val);
-	if (d->type == J)
-	{
-		if (d->op == jal)
-		{
-			*changedReg = 31;
-		}
-	}
-	if (d->type == R)
-	{
-		if (d->regs.r.funct != jr)
-		{
-			*changedReg = d->regs.r.rd;
-			mips.registers[*changedReg] = val;
-		}
-	}
-	if (d->type == I)
+	switch (instrTable[d->kind].writes)
 	{
-		if ((d->op == bne || d->op == beq || d->op == sw))
-		{
-			return;
-		}
-		else
-		{
-			//	printf("Updated RT: %d\n", val);
-			*changedReg = d->regs.i.rt;
-			mips.registers[*changedReg] = val;
-		}
+	case W_RD:
+		*changedReg = d->regs.r.rd;
+		mips->registers[*changedReg] = val;
+		break;
+	case W_RT:
+		*changedReg = d->regs.i.rt;
+		mips->registers[*changedReg] = val;
+		break;
+	case W_RA:
+		*changedReg = 31;
+		break;
+	case W_HILO:
+		*changedReg = HILO_REG;
+		break;
 	}
 }
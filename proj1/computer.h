@@ -1,14 +1,173 @@
-#define MAXNUMINSTRS 1024 /* max # instrs in a program */
-#define MAXNUMDATA 3072   /* max # data words */
+#define MAXNUMINSTRS 1024 /* default max # instrs in a program */
+#define MAXNUMDATA 3072   /* default max # data words */
 
-struct SimulatedComputer
+/*
+	Memory runs from TEXT_BASE, text first and then data, up to at most
+	the end of the user segment; SetMemorySize() picks the sizes.
+*/
+#define TEXT_BASE 0x00400000
+#define MEMORY_END 0x80000000u
+
+/*  
+	opcodes for I-format
+*/
+#define andi 0x0C
+#define addiu 0x09
+#define beq 0x04
+#define bne 0x05
+#define bgtz 0x07
+#define lui 0x0F
+#define lw 0x23
+#define ori 0x0D
+#define sw 0x2B
+#define ll 0x30
+#define sc 0x38
+#define addi 0x08
+#define slti 0x0A
+#define sltiu 0x0B
+#define xori 0x0E
+#define blez 0x06
+#define regimm 0x01 /* bltz and bgez, told apart by rt */
+
+/*
+	rt codes for regimm
+*/
+#define bltz 0x00
+#define bgez 0x01
+/*  
+	opcodes for J-format
+*/
+#define jal 0x03
+#define jump 0x02
+
+/*
+
+	function codes for R-Format
+
+*/
+
+#define addu 0x21
+#define and 0x24
+#define jr 0x08
+#define or 0x25
+#define slt 0x2A
+#define sll 0x00 // uses shamt
+#define srl 0x02 // uses shamt
+#define subu 0x23
+#define sra 0x03
+#define sllv 0x04
+#define srlv 0x06
+#define srav 0x07
+#define jalr 0x09
+#define xor 0x26
+#define nor 0x27
+#define mfhi 0x10
+#define mthi 0x11
+#define mflo 0x12
+#define mtlo 0x13
+#define mult 0x18
+#define multu 0x19
+#define div 0x1A
+#define divu 0x1B
+
+/*
+	What each instruction is, as the instruction table in computer.c
+	decodes it. Simulate() and every engine switch on these; the
+	threaded engine's ops use the same values, with K_TRANSLATE and
+	K_END of its own.
+*/
+enum
 {
-	int memory[MAXNUMINSTRS + MAXNUMDATA];
-	int registers[32];
-	int pc;
-	int printingRegisters, printingMemory, interactive, debugging;
+	K_TRANSLATE = 0, /* not translated yet */
+	K_ADDU,
+	K_SUBU,
+	K_AND,
+	K_OR,
+	K_SLT,
+	K_SLL,
+	K_SRL,
+	K_JR,
+	K_ADDIU,
+	K_ANDI,
+	K_ORI,
+	K_LUI,
+	K_BEQ,
+	K_BNE,
+	K_BGTZ,
+	K_LW,
+	K_SW,
+	K_J,
+	K_JAL,
+	K_LL,
+	K_SC,
+	K_ADDI,
+	K_SLTI,
+	K_SLTIU,
+	K_XORI,
+	K_SRA,
+	K_SLLV,
+	K_SRLV,
+	K_SRAV,
+	K_NOR,
+	K_XOR,
+	K_BLEZ,
+	K_BLTZ,
+	K_BGEZ,
+	K_JALR,
+	K_MULT,
+	K_MULTU,
+	K_DIV,
+	K_DIVU,
+	K_MFHI,
+	K_MFLO,
+	K_MTHI,
+	K_MTLO,
+	K_UNSUPPORTED,
+	K_END, /* ends a block that runs off the text segment */
+	NUM_KINDS
 };
-typedef struct SimulatedComputer Computer;
+
+/* How PrintInstruction() lays out the operands of an instruction */
+enum
+{
+	F_RD_RS_RT,			/* $rd, $rs, $rt */
+	F_RD_RT_RS,			/* $rd, $rt, $rs: shifts by a register */
+	F_RD_RS_SHAMT,	/* $rd, $rs, shamt: sll and srl, as the reference prints them */
+	F_RD_RT_SHAMT,	/* $rd, $rt, shamt */
+	F_RA,						/* $31: jr, which always returns through it */
+	F_RD_RS,				/* $rd, $rs */
+	F_RT_RS_IMM,		/* $rt, $rs, imm */
+	F_RS_RT_TARGET, /* $rs, $rt, 0xtarget: beq and bne */
+	F_RS_TARGET,		/* $rs, 0xtarget */
+	F_MEMORY,				/* $rt, imm($rs) */
+	F_TARGET,				/* 0xtarget */
+	F_RS_RT,				/* $rs, $rt: multiplies and divides */
+	F_RD,						/* $rd */
+	F_RS						/* $rs */
+};
+
+/* Which register RegWrite() reports an instruction changed */
+enum
+{
+	W_NONE,
+	W_RD,
+	W_RT,
+	W_RA,		/* $31, which Execute() already set */
+	W_HILO /* HI and LO, which Execute() already set */
+};
+
+/* The changedReg of a step that changed HI and LO */
+#define HILO_REG 32
+
+typedef struct
+{
+	const char *name; /* mnemonic, NULL for kinds that are not instructions */
+	int format;				/* an F_ value */
+	int writes;				/* a W_ value */
+} InstrInfo;
+
+extern const InstrInfo instrTable[NUM_KINDS];
+int InstrKind(unsigned int instr);
 
 typedef enum
 {
@@ -42,6 +201,7 @@ typedef struct
 {
 	InstrType type;
 	int op;
+	int kind; /* K_ value from the instruction table, K_UNSUPPORTED if none */
 	union {
 		RRegs r;
 		IRegs i;
@@ -56,7 +216,225 @@ typedef struct
 	int R_rd;
 } RegVals;
 
+struct SimulatedComputer
+{
+	int *memory; /* textWords + dataWords words, page-aligned */
+	int textWords, dataWords;
+
+	/*
+		Address space the memory takes: MEMORY_BYTES, or with guarded
+		set, the 4 GiB past the start of the data segment, inaccessible
+		past the end of memory. See GuardMemory().
+	*/
+	size_t mapped;
+	int guarded, hugePages;
+
+	int registers[32];
+	int hi, lo; /* results of the multiply/divide unit */
+	int pc;
+	int entry; /* where runs start: TEXT_BASE, or an ELF program's entry point */
+	int printingRegisters, printingMemory, interactive, debugging;
+	FILE *out; /* where the simulation prints, stdout unless changed */
+
+	/*
+		Limits on a run, 0 for none. A run that reaches one stops with
+		SIM_BUDGET or SIM_TIMEOUT. Untraced threaded runs check them
+		between blocks, so they can go up to one block further.
+	*/
+	unsigned long budget; /* instructions */
+	double timeLimit;			/* seconds */
+	double deadline;			/* when the running simulation times out */
+
+	unsigned long retired; /* instructions completed by the last run */
+
+	/*
+		Multiply/divide unit timing, with every other instruction taking
+		a cycle. mult and div keep the unit busy for mulLatency and
+		divLatency cycles, and an instruction that uses it before then
+		stalls until it is free; interlocks counts the cycles the run
+		lost that way. Latencies of 0 leave the unit untimed.
+	*/
+	int mulLatency, divLatency;
+	unsigned long hiloReady; /* the cycle the unit is free */
+	unsigned long interlocks;
+
+	/*
+		Link set by ll. sc stores only if it is to linkAddr and the word
+		there still holds linkValue, comparing and storing in one atomic
+		step, so harts sharing memory can synchronize with them.
+	*/
+	int linked, linkAddr, linkValue;
+
+	/*
+		While a traced run prints all of memory, a bit per data word, set
+		if the word is nonzero, and a summary bit per 64 of those, set if
+		any of them is; otherwise NULL. See TrackNonzero().
+	*/
+	unsigned long *nonzero, *nonzeroSummary;
+
+	/* The machine whose memory a hart made by NewHart() shares, or NULL */
+	struct SimulatedComputer *parent;
+
+	/* Private data cache in a coherence model, see mesi.c, or NULL */
+	struct L1 *l1;
+
+	/*
+		Predecoded text segment, indexed by (pc - 0x00400000) / 4.
+		An entry is decoded the first time its pc is executed and stays
+		valid until new text is loaded: stores only reach the data
+		segment, so the text is read-only while a program runs.
+	*/
+	DecodedInstr *decoded;
+	RegVals *decodedVals;
+	char *decodedValid;
+	DecodedInstr decodedOutside; /* the last word decoded outside the text */
+
+	struct Engine *engine; /* threaded engine state, see threaded.c */
+	struct Trace *trace;	 /* trace writer state, made by the first Trace call */
+};
+typedef struct SimulatedComputer Computer;
+
+#define MEMORY_BYTES(mips) ((size_t)((mips)->textWords + (mips)->dataWords) * sizeof(int))
+#define DATA_BASE(mips) (TEXT_BASE + 4 * (mips)->textWords)
+
+/* True unless addr is a word-aligned address in the data segment */
+#define BAD_DATA_ADDR(mips, addr) \
+	((unsigned int)(addr) - DATA_BASE(mips) >= 4u * (mips)->dataWords || (addr) % 4 != 0)
+
+/*
+	Why a simulation stopped, or why a machine could not be set up.
+	Every entry point that can fail returns one of these.
+*/
+enum
+{
+	SIM_OK = 0,
+	SIM_QUIT,							/* the user typed q in interactive mode */
+	SIM_UNSUPPORTED,			/* stopped at an unsupported instruction */
+	SIM_MEMORY_EXCEPTION, /* stopped at a bad lw or sw address */
+	SIM_TOO_BIG,					/* the program does not fit the text segment, or memory the user segment */
+	SIM_NO_MEMORY,				/* the host ran out of memory */
+	SIM_BUDGET,						/* ran the whole instruction budget */
+	SIM_TIMEOUT,					/* ran out of time */
+	SIM_PAUSED,						/* ran its slice, and can be continued */
+	SIM_BAD_PROGRAM,			/* the program file is in no format the loader knows */
+	SIM_BAD_CHECKPOINT,		/* the file is not a checkpoint */
+	SIM_FILE_ERROR				/* a file could not be opened, read or written */
+};
+
+Computer *NewComputer(void);
+void FreeComputer(Computer *);
+int SetMemorySize(Computer *, int textWords, int dataWords);
+int GuardMemory(Computer *, int hugePages);
+void *MapTable(size_t bytes);
+void UnmapTable(void *, size_t bytes);
+int InitComputer(Computer *, FILE *, int printingRegisters, int printingMemory,
+								 int debugging, int interactive);
+int LoadProgram(Computer *, FILE *);
+int Simulate(Computer *);
+int SimulateThreaded(Computer *, int tracing, int compiling);
+int ContinueThreaded(Computer *, int tracing, int compiling);
+int StepThreaded(Computer *, int compiling, unsigned long slice);
+int PauseThreaded(Computer *, int compiling, int resume, unsigned long count, int pc);
+void PrintSummary(Computer *);
+void PrintInterlocks(Computer *);
+
+/* Whole machine states saved to files, see checkpoint.c */
+int SaveCheckpoint(Computer *, const char *file);
+int RestoreCheckpoint(Computer *, const char *file);
+
+/* Machines running one program side by side, see lanes.c */
+#define MAXLANES 16
+int SimulateLanes(Computer **lanes, int n, int *status);
+unsigned long StartLimits(Computer *);
+int CheckLimits(Computer *, unsigned long *checkAt);
+int NewEngine(Computer *);
+void FreeEngine(Computer *);
+
+/* Harts: machines running on one memory, see harts.c */
+Computer *NewHart(Computer *);
+int SimulateHarts(Computer **harts, int n, unsigned long quantum, int compiling, int *status);
+
+/* Private L1s kept coherent with MESI, see mesi.c */
+typedef struct Coherence Coherence;
+typedef struct L1 L1;
+Coherence *NewCoherence(Computer *, int sets, int ways, int lineBytes);
+int AttachL1(Coherence *, Computer *);
+void CacheAccess(Computer *, int addr, int write);
+int PrintCoherence(Coherence *, FILE *);
+void FreeCoherence(Coherence *);
+
+/* Machines that all run one loaded program, reset copy-on-write */
+typedef struct Pool Pool;
+Pool *NewPool(Computer *image, int n);
+Computer *TakeComputer(Pool *);
+void GiveComputer(Pool *, Computer *);
+void FreePool(Pool *);
+
+/*
+	Entry point of an ahead-of-time translation made by the aot tool.
+	Runs from *pc until it reaches a pc it has no code for and returns
+	0, or until a Memory Access Exception and returns 1 with the
+	exception's pc in *pc and address in *addr.
+*/
+typedef int (*Translation)(unsigned int *reg, int *memory, int *pc, int *addr,
+													 unsigned long *retired);
+int UseTranslation(Computer *, Translation, const unsigned int *text, int words,
+									 const int *segments);
+void UseTranslationCache(Computer *, const char *dir);
+
+/*
+	Binary trace: TRACE_MAGIC, the text and data sizes in words as two
+	ints, the 32 registers and then HI and LO the run starts with, the
+	nonzero words the data segment was loaded with as address and value
+	pairs of ints, ending with a pair whose address is 0, then one
+	record per step. A step that completed records the registers and
+	memory it changed; the last record says why the program stopped.
+	The pc after each step is the pc of the next record.
+*/
+#define TRACE_MAGIC "MIPSTRC4"
+
+typedef struct
+{
+	int pc;
+	unsigned int instr;
+	unsigned int how; /* TRACE_CHANGES(...), TRACE_UNSUPPORTED or TRACE_EXCEPTION */
+	int reg;					/* new value of the changed register or HI, or the exception pc */
+	int addr;					/* the changed address (-1 for none), or the bad address */
+	int mem;					/* new value of the changed word or LO */
+} TraceRecord;
+
+/* Changed register + 1 in the top byte */
+#define TRACE_CHANGES(changedReg) ((unsigned int)((changedReg) + 1) << 24)
+#define TRACE_CHANGED_REG(how) ((int)((how) >> 24) - 1)
+#define TRACE_UNSUPPORTED 0xFE000000u
+#define TRACE_EXCEPTION 0xFF000000u
+#define TRACE_STOPS(how) ((how) >= TRACE_UNSUPPORTED)
+
+/* Buffered trace output, identical to what Simulate() prints */
+int TraceReset(Computer *);
+int TraceBinary(Computer *, FILE *);
+int TraceAsync(Computer *);
+int TraceStep(Computer *, int pc);
+void TraceInfo(Computer *, int changedReg, int changedMem);
+void TraceException(Computer *, int pc, int addr);
+void TraceFlush(Computer *);
+void TraceReplay(Computer *, const TraceRecord *rec, const TraceRecord *next);
+void FreeTrace(Computer *);
+
+/* The stages of Simulate(), shared by the simulation engines */
+unsigned int Fetch(Computer *, int addr);
+void Decode(Computer *, unsigned int, DecodedInstr *, RegVals *);
+DecodedInstr *FetchDecoded(Computer *, int addr, RegVals *);
+int PrintInstruction(Computer *, DecodedInstr *);
+int Execute(Computer *, DecodedInstr *, RegVals *);
+void UpdatePC(Computer *, DecodedInstr *, int val);
+int Mem(Computer *, DecodedInstr *, int *val, int *changedMem);
+void RegWrite(Computer *, DecodedInstr *, int val, int *changedReg);
+void PrintInfo(Computer *, int changedReg, int changedMem);
+int MulDiv(Computer *, int kind, unsigned int rs, unsigned int rt, unsigned long index);
 
-void InitComputer(FILE *, int printingRegisters, int printingMemory,
-									int debugging, int interactive);
-void Simulate();
+/* The nonzero words of the data segment, for printing all of memory */
+void TrackNonzero(Computer *);
+void UntrackNonzero(Computer *);
+void MarkNonzero(Computer *, int addr);
+int NextNonzero(Computer *, int addr);
@@ -0,0 +1,23 @@
+# Shared counter for several harts: each one adds 1 to the word at
+# 0x00403000 a hundred times with ll/sc, so with sim -p N the word ends
+# up holding 100 * N however the harts interleave.
+#
+# Branches here only go forward; the loops go back with j.
+#
+
+		.text
+		addiu	$t1,$0,100
+		lui	$t0,0x0040
+		ori	$t0,$t0,0x3000
+Loop:
+		ll	$t2,0($t0)
+		addiu	$t2,$t2,1
+		sc	$t2,0($t0)
+		beq	$t2,$0,Retry	# another hart got there first
+		addiu	$t1,$t1,-1
+		beq	$t1,$0,Done
+		j	Loop
+Retry:
+		j	Loop
+Done:
+		syscall		#unsupported instruction, terminate
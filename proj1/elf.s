@@ -0,0 +1,30 @@
+# Hand-built big-endian ELF executable, elf.elf, for the ELF loader.
+#
+# The text is loaded at 0x00400000 but e_entry is 0x00400004. The data
+# segment is at 0x00401000 with 10 bytes in the file, the last word
+# only half there, and 32 in memory, so the rest is .bss. .reginfo sets
+# $gp to 0x00401000, overriding the _gp symbol (0x0040f000), and the
+# __stack symbol sets $sp to 0x00402000. Run as: sim -r -m elf.elf
+#
+# shortstr.elf is the same program with a one-byte .strtab at the end
+# of the file, and symbol names far past it, so no symbol is found and
+# $sp keeps its default.
+#
+
+		.data
+		.word	0x11111111, 0x22222222
+		.byte	0x33, 0x44
+		.space	22		# .bss
+
+		.text
+		syscall			# never run: not the entry point
+__start:
+		lw	$t1, 0($gp)
+		lw	$t2, 4($gp)
+		addu	$t3, $t1, $t2
+		lw	$t4, 8($gp)	# the half word from the file
+		lw	$t5, 16($gp)	# .bss, zero
+		sw	$t3, 20($gp)
+		addiu	$sp, $sp, -4
+		sw	$gp, 0($sp)
+		syscall			# unsupported instruction, terminate
@@ -0,0 +1,494 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include "computer.h"
+#undef mips /* gcc already has a def for mips */
+
+/*
+	Differential fuzzer.
+
+	Usage: fuzz [-n inputs] [-b budget] [-s seed] [-o dir] [-r] [-m] [program...]
+
+	Runs each input program through Simulate() and the threaded engine
+	and checks that they agree. The traced text must be identical; the
+	quiet runs with and without the JIT must print the same summary; and
+	unless the budget cut it off, a quiet run must stop for the same
+	reason as Simulate(), with the same retired count, pc, registers,
+	HI/LO, stalls on them and data segment. -r and -m trace as they do in sim.
+
+	The inputs are the programs given, in any format the loader knows,
+	mutated a few words at a time, or random programs of the supported
+	instructions if none are given. Most inputs get an unsupported word
+	at the end, so that they stop instead of running on through the
+	rest of the text, which reads as no-ops, and every run stops after
+	budget instructions, 1000 by default. An input the engines disagree
+	on is written to dir as fail-N.dump, which sim runs as it is.
+
+	Every run takes a machine from one pool of empty machines, writes the
+	input into its text and gives it back, so resetting a machine costs
+	the pages the run dirtied rather than a new load; see pool.c. The
+	text's decodings are forgotten before each run, since unlike a pool's
+	usual users the runs do not all share one program.
+
+	Built with -DLIBFUZZER this file instead has LLVMFuzzerTestOneInput(),
+	which takes the input as little-endian words and aborts when the
+	engines disagree, for libFuzzer's main to drive.
+*/
+
+#define DEFAULT_BUDGET 1000
+
+/* How a run ended, and what it printed */
+typedef struct
+{
+	int status;
+	unsigned long retired;
+	int pc;
+	int registers[32];
+	int hi, lo;
+	unsigned long interlocks;
+	char *text;
+	size_t size;
+} Outcome;
+
+static Pool *pool;
+static int textWords, dataWords;
+static int *data[2]; /* the data segments the reference and quiet runs left */
+
+/*
+ *  Make the pool of empty machines the inputs run on.
+ */
+static void MakePool(unsigned long budget, int printingRegisters, int printingMemory)
+{
+	Computer *mips = NewComputer();
+	FILE *empty = fopen("/dev/null", "r");
+
+	if (mips == NULL || empty == NULL ||
+			InitComputer(mips, empty, printingRegisters, printingMemory, 0, 0) != SIM_OK)
+	{
+		fprintf(stderr, "Out of memory.\n");
+		exit(1);
+	}
+	fclose(empty);
+	mips->budget = budget;
+	/* Time the multiply/divide unit, so the engines must agree on its stalls */
+	mips->mulLatency = 3;
+	mips->divLatency = 10;
+	textWords = mips->textWords;
+	dataWords = mips->dataWords;
+	pool = NewPool(mips, 0);
+	data[0] = malloc(dataWords * sizeof(int));
+	data[1] = malloc(dataWords * sizeof(int));
+	if (pool == NULL || data[0] == NULL || data[1] == NULL)
+	{
+		fprintf(stderr, "Out of memory.\n");
+		exit(1);
+	}
+	FreeComputer(mips);
+}
+
+/*
+ *  Run the n words of program on a machine from the pool: with
+ *  Simulate() for engine 0, the traced threaded engine for 1, or the
+ *  quiet one for 2, and with the JIT for 3. Puts how it ended in *o,
+ *  and the data segment it left in segment if that is not NULL.
+ *  Returns 0 if there was no memory for the run.
+ */
+static int RunInput(const unsigned int *program, int n, int engine, Outcome *o, int *segment)
+{
+	Computer *mips = TakeComputer(pool);
+
+	o->text = NULL;
+	if (mips == NULL)
+	{
+		return 0;
+	}
+	memcpy(mips->memory, program, n * sizeof(int));
+	memset(mips->decodedValid, 0, mips->textWords);
+	mips->out = open_memstream(&o->text, &o->size);
+	if (mips->out == NULL)
+	{
+		GiveComputer(pool, mips);
+		return 0;
+	}
+	o->status = engine == 0 ? Simulate(mips) : SimulateThreaded(mips, engine == 1, engine == 3);
+	fclose(mips->out);
+	mips->out = stdout;
+	o->retired = mips->retired;
+	o->pc = mips->pc;
+	memcpy(o->registers, mips->registers, sizeof(o->registers));
+	o->hi = mips->hi;
+	o->lo = mips->lo;
+	o->interlocks = mips->interlocks;
+	if (segment != NULL)
+	{
+		memcpy(segment, mips->memory + mips->textWords, dataWords * sizeof(int));
+	}
+	GiveComputer(pool, mips);
+	return o->status != SIM_NO_MEMORY;
+}
+
+static int SameText(const Outcome *a, const Outcome *b)
+{
+	return a->size == b->size && memcmp(a->text, b->text, a->size) == 0;
+}
+
+/*
+ *  Run program on every engine. Returns NULL if they all agree, and
+ *  otherwise what they disagree on.
+ */
+static const char *Check(const unsigned int *program, int n)
+{
+	Outcome o[4];
+	const char *problem = NULL;
+	int k, ran = 1;
+
+	for (k = 0; k < 4; k++)
+	{
+		ran &= RunInput(program, n, k, &o[k], k == 0 ? data[0] : k == 2 ? data[1] : NULL);
+	}
+	if (!ran)
+	{
+		problem = "no memory to run it";
+	}
+	else if (o[0].status != o[1].status || !SameText(&o[0], &o[1]))
+	{
+		problem = "traced text";
+	}
+	else if (o[2].status != o[3].status || !SameText(&o[2], &o[3]))
+	{
+		problem = "quiet text with and without the JIT";
+	}
+	else if (o[0].status != SIM_BUDGET &&
+					 (o[0].status != o[2].status || o[0].retired != o[2].retired || o[0].pc != o[2].pc ||
+						memcmp(o[0].registers, o[2].registers, sizeof(o[0].registers)) != 0 ||
+						o[0].hi != o[2].hi || o[0].lo != o[2].lo || o[0].interlocks != o[2].interlocks ||
+						memcmp(data[0], data[1], dataWords * sizeof(int)) != 0))
+	{
+		problem = "final state";
+	}
+	for (k = 0; k < 4; k++)
+	{
+		free(o[k].text);
+	}
+	return problem;
+}
+
+#ifdef LIBFUZZER
+
+int LLVMFuzzerTestOneInput(const uint8_t *bytes, size_t size)
+{
+	unsigned int program[MAXNUMINSTRS];
+	size_t n = size / 4;
+	const char *problem;
+
+	if (pool == NULL)
+	{
+		MakePool(DEFAULT_BUDGET, 0, 0);
+	}
+	if (n > MAXNUMINSTRS)
+	{
+		n = MAXNUMINSTRS;
+	}
+	memcpy(program, bytes, n * 4);
+	problem = Check(program, n);
+	if (problem != NULL)
+	{
+		fprintf(stderr, "Engines disagree on %s\n", problem);
+		abort();
+	}
+	return 0;
+}
+
+#else
+
+static unsigned long long seed;
+
+static double Now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static unsigned int Random(void)
+{
+	seed ^= seed << 13;
+	seed ^= seed >> 7;
+	seed ^= seed << 17;
+	return seed >> 32;
+}
+
+/* Opcodes and functs of the instructions Simulate() knows */
+static const int opcodes[] = {addiu, andi, ori, lui, beq, bne, bgtz, lw, sw, ll, sc, jump, jal,
+														 addi, slti, sltiu, xori, blez, regimm};
+static const int functs[] = {addu, subu, and, or, slt, sll, srl, jr,
+														 sra, sllv, srlv, srav, nor, xor, jalr, mult, multu, div,
+														 divu, mfhi, mflo, mthi, mtlo};
+
+typedef struct
+{
+	unsigned int *words;
+	int n;
+} Program;
+
+static Program *corpus;
+static int ncorpus;
+
+/*
+ *  Mostly $t0..$t7, so that instructions feed each other.
+ */
+static int RandomReg(void)
+{
+	return Random() % 4 == 0 ? Random() % 32 : 8 + Random() % 8;
+}
+
+/*
+ *  Return a random instruction for a program of n words, mostly one
+ *  Simulate() knows, with loads and stores mostly near the stack.
+ */
+static unsigned int RandomInstr(int n)
+{
+	int op, rs = RandomReg(), rt = RandomReg(), rd = RandomReg();
+	unsigned int imm = Random() & 0xFFFF;
+
+	if (Random() % 16 == 0)
+	{
+		return Random();
+	}
+	if (Random() % 3 == 0)
+	{
+		return rs << 21 | rt << 16 | rd << 11 | (Random() % 32) << 6 |
+					 functs[Random() % (sizeof(functs) / sizeof(functs[0]))];
+	}
+	op = opcodes[Random() % (sizeof(opcodes) / sizeof(opcodes[0]))];
+	switch (op)
+	{
+	case jump:
+	case jal:
+		return op << 26 | (TEXT_BASE / 4 + Random() % n);
+	case regimm:
+		rt = Random() % 2 == 0 ? bltz : bgez;
+		/* fall through */
+	case beq:
+	case bne:
+	case bgtz:
+	case blez:
+		imm = (Random() % 16 - 8) & 0xFFFF;
+		break;
+	case lw:
+	case sw:
+	case ll:
+	case sc:
+		if (Random() % 2 == 0)
+		{
+			rs = 29;
+			imm = -4 * (int)(1 + Random() % 64) & 0xFFFF;
+		}
+		break;
+	}
+	return op << 26 | rs << 21 | rt << 16 | imm;
+}
+
+/*
+ *  Load the program in file into the corpus, or complain and exit.
+ */
+static void AddProgram(const char *file)
+{
+	Computer *mips = NewComputer();
+	FILE *in = fopen(file, "r");
+	Program *p;
+	int status;
+
+	if (in == NULL)
+	{
+		fprintf(stderr, "Can't open file: %s\n", file);
+		exit(1);
+	}
+	status = mips != NULL ? InitComputer(mips, in, 0, 0, 0, 0) : SIM_NO_MEMORY;
+	if (status != SIM_OK)
+	{
+		fprintf(stderr, status == SIM_NO_MEMORY ? "Out of memory.\n" : "Not a program for the default memory: %s\n", file);
+		exit(1);
+	}
+	fclose(in);
+	corpus = realloc(corpus, (ncorpus + 1) * sizeof(Program));
+	if (corpus == NULL)
+	{
+		fprintf(stderr, "Out of memory.\n");
+		exit(1);
+	}
+	p = &corpus[ncorpus++];
+	for (p->n = textWords; p->n > 0 && mips->memory[p->n - 1] == 0; p->n--)
+		;
+	p->words = malloc((p->n + 1) * sizeof(int));
+	if (p->words == NULL)
+	{
+		fprintf(stderr, "Out of memory.\n");
+		exit(1);
+	}
+	memcpy(p->words, mips->memory, p->n * sizeof(int));
+	FreeComputer(mips);
+}
+
+/*
+ *  Make the next input in program, returning its length in words.
+ */
+static int NextInput(unsigned int *program)
+{
+	Program *from;
+	int n, k, i, at, count;
+
+	if (ncorpus == 0)
+	{
+		n = 1 + Random() % 32;
+		for (k = 0; k < n; k++)
+		{
+			program[k] = RandomInstr(n);
+		}
+		return n;
+	}
+	from = &corpus[Random() % ncorpus];
+	n = from->n;
+	memcpy(program, from->words, n * sizeof(int));
+	for (count = 1 + Random() % 4; count > 0; count--)
+	{
+		at = n > 0 ? Random() % n : 0;
+		switch (Random() % 5)
+		{
+		case 0:
+			if (n > 0)
+				program[at] ^= 1u << Random() % 32;
+			break;
+		case 1:
+			if (n > 0)
+				program[at] = RandomInstr(n);
+			break;
+		case 2:
+			if (n < textWords)
+			{
+				memmove(&program[at + 1], &program[at], (n - at) * sizeof(int));
+				program[at] = RandomInstr(++n);
+			}
+			break;
+		case 3:
+			if (n > 0)
+			{
+				memmove(&program[at], &program[at + 1], (n - at - 1) * sizeof(int));
+				n--;
+			}
+			break;
+		default:
+			/* Splice in a run of another program */
+			from = &corpus[Random() % ncorpus];
+			if (from->n > 0)
+			{
+				i = Random() % from->n;
+				for (k = 0; k < 8 && i + k < from->n && at + k < textWords; k++)
+				{
+					program[at + k] = from->words[i + k];
+				}
+				if (at + k > n)
+					n = at + k;
+			}
+			break;
+		}
+	}
+	return n;
+}
+
+/*
+ *  Write the n words of program to dir as fail-number.dump.
+ */
+static void SaveInput(const char *dir, int number, const unsigned int *program, int n)
+{
+	char path[4096];
+	FILE *out;
+
+	snprintf(path, sizeof(path), "%s/fail-%d.dump", dir, number);
+	out = fopen(path, "wb");
+	if (out == NULL || fwrite(program, sizeof(int), n, out) != (size_t)n || fclose(out) != 0)
+	{
+		fprintf(stderr, "Can't write %s\n", path);
+		exit(1);
+	}
+	printf("Wrote %s\n", path);
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned long inputs = 100000, budget = DEFAULT_BUDGET, k;
+	int printingRegisters = 0, printingMemory = 0, failures = 0, n, argIndex;
+	const char *dir = ".", *problem;
+	unsigned int *program;
+	double start;
+
+	seed = time(NULL);
+	for (argIndex = 1; argIndex < argc && argv[argIndex][0] == '-'; argIndex++)
+	{
+		if (strcmp(argv[argIndex], "-r") == 0)
+			printingRegisters = 1;
+		else if (strcmp(argv[argIndex], "-m") == 0)
+			printingMemory = 1;
+		else if (argIndex + 1 == argc)
+			break;
+		else if (strcmp(argv[argIndex], "-n") == 0)
+			inputs = strtoul(argv[++argIndex], NULL, 0);
+		else if (strcmp(argv[argIndex], "-b") == 0)
+			budget = strtoul(argv[++argIndex], NULL, 0);
+		else if (strcmp(argv[argIndex], "-s") == 0)
+			seed = strtoull(argv[++argIndex], NULL, 0);
+		else if (strcmp(argv[argIndex], "-o") == 0)
+			dir = argv[++argIndex];
+		else
+			break;
+	}
+	if (argIndex < argc && argv[argIndex][0] == '-')
+	{
+		fprintf(stderr, "Usage: fuzz [-n inputs] [-b budget] [-s seed] [-o dir] [-r] [-m] [program...]\n");
+		exit(1);
+	}
+	if (budget == 0)
+	{
+		fprintf(stderr, "The budget must be at least one instruction.\n");
+		exit(1);
+	}
+	printf("Seed %llu\n", seed);
+	seed |= 1;
+
+	MakePool(budget, printingRegisters, printingMemory);
+	for (; argIndex < argc; argIndex++)
+	{
+		AddProgram(argv[argIndex]);
+	}
+	program = calloc(textWords + 1, sizeof(int));
+	if (program == NULL)
+	{
+		fprintf(stderr, "Out of memory.\n");
+		exit(1);
+	}
+
+	start = Now();
+	for (k = 0; k < inputs; k++)
+	{
+		n = NextInput(program);
+		/* Most end, as programs do, rather than running on through the zeros */
+		if (n < textWords && Random() % 8 != 0)
+		{
+			program[n++] = 0xFFFFFFFF;
+		}
+		problem = Check(program, n);
+		if (problem != NULL)
+		{
+			printf("Engines disagree on %s\n", problem);
+			SaveInput(dir, failures++, program, n);
+		}
+	}
+	printf("%lu inputs, %d disagreements, %.0f inputs/s\n", inputs, failures, inputs / (Now() - start));
+	return failures == 0 ? 0 : 1;
+}
+
+#endif
@@ -0,0 +1,164 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "computer.h"
+#include "threaded.h"
+#undef mips /* gcc already has a def for mips */
+
+/*
+	Multi-hart simulation.
+
+	A hart is a core: its own pc, registers and engine, made with
+	NewHart(), over the memory of the machine the program was loaded
+	into. Every hart starts at the program's entry point, so a program
+	tells them apart by registers set up before the run.
+
+	Harts synchronize with ll and sc. ll remembers the word it read, and
+	sc stores only if the word still holds that value, with a
+	compare-and-swap, so a hart can never lose another's update. An
+	intervening store of the same value goes unnoticed, which is enough
+	for the counters, locks and lists programs build from ll/sc.
+
+	With a quantum the harts take turns on the calling thread, each
+	running about that many instructions at a time, stopping at the end
+	of a block. The interleaving, and so the result, is the same on
+	every run. Without one each hart gets a host thread and they all run
+	at once, which is faster but interleaves however the host does.
+*/
+
+typedef struct
+{
+	pthread_mutex_t lock;
+	pthread_cond_t changed;
+	int go; /* 0 until every thread exists, then 1, or -1 if one could not be made */
+} Start;
+
+typedef struct
+{
+	Start *start;
+	Computer *hart;
+	int compiling;
+	int status;
+} HartThread;
+
+static void *RunHart(void *arg)
+{
+	HartThread *h = arg;
+	int go;
+
+	pthread_mutex_lock(&h->start->lock);
+	while (h->start->go == 0)
+	{
+		pthread_cond_wait(&h->start->changed, &h->start->lock);
+	}
+	go = h->start->go;
+	pthread_mutex_unlock(&h->start->lock);
+	h->status = go > 0 ? StepThreaded(h->hart, h->compiling, 0) : SIM_NO_MEMORY;
+	return NULL;
+}
+
+/*
+ *  Let the threads go, or send them home if go is -1.
+ */
+static void Release(Start *start, int go)
+{
+	pthread_mutex_lock(&start->lock);
+	start->go = go;
+	pthread_cond_broadcast(&start->changed);
+	pthread_mutex_unlock(&start->lock);
+}
+
+/*
+ *  Run the n harts in harts, which must share one memory, each from the
+ *  entry point under its own limits, with the threaded engine
+ *  and no tracing, taking turns of quantum instructions, or all at once
+ *  on host threads if quantum is 0. When they have all stopped, prints
+ *  each one's final state to its own out in order, and puts its status
+ *  in status. Returns SIM_NO_MEMORY if there was no memory to run them,
+ *  else SIM_OK.
+ */
+int SimulateHarts(Computer **harts, int n, unsigned long quantum, int compiling, int *status)
+{
+	HartThread *threads;
+	pthread_t *ids;
+	Start start;
+	int k, running, started;
+
+	for (k = 0; k < n; k++)
+	{
+		ResetBlocks(harts[k]);
+		JitReset(harts[k]->engine);
+		harts[k]->pc = harts[k]->entry;
+		harts[k]->linked = 0;
+		StartLimits(harts[k]);
+		status[k] = SIM_PAUSED;
+	}
+
+	if (quantum > 0)
+	{
+		do
+		{
+			running = 0;
+			for (k = 0; k < n; k++)
+			{
+				if (status[k] == SIM_PAUSED)
+				{
+					status[k] = StepThreaded(harts[k], compiling, quantum);
+					running |= status[k] == SIM_PAUSED;
+				}
+			}
+		} while (running);
+	}
+	else
+	{
+		/* No hart starts until they all can, since one may wait on another */
+		threads = calloc(n, sizeof(HartThread));
+		ids = calloc(n, sizeof(pthread_t));
+		if (threads == NULL || ids == NULL)
+		{
+			free(threads);
+			free(ids);
+			return SIM_NO_MEMORY;
+		}
+		pthread_mutex_init(&start.lock, NULL);
+		pthread_cond_init(&start.changed, NULL);
+		start.go = 0;
+		for (started = 0; started < n; started++)
+		{
+			threads[started].start = &start;
+			threads[started].hart = harts[started];
+			threads[started].compiling = compiling;
+			if (pthread_create(&ids[started], NULL, RunHart, &threads[started]) != 0)
+			{
+				break;
+			}
+		}
+		Release(&start, started == n ? 1 : -1);
+		for (k = 0; k < started; k++)
+		{
+			pthread_join(ids[k], NULL);
+		}
+		for (k = 0; k < n; k++)
+		{
+			status[k] = started == n ? threads[k].status : SIM_NO_MEMORY;
+		}
+		pthread_cond_destroy(&start.changed);
+		pthread_mutex_destroy(&start.lock);
+		free(threads);
+		free(ids);
+		if (started < n)
+		{
+			return SIM_NO_MEMORY;
+		}
+	}
+
+	for (k = 0; k < n; k++)
+	{
+		if (status[k] != SIM_NO_MEMORY)
+		{
+			PrintSummary(harts[k]);
+		}
+	}
+	return SIM_OK;
+}
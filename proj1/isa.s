@@ -0,0 +1,37 @@
+# One of each instruction added to the decoder, with branches both taken
+# and not taken, and a call through jalr.
+#
+
+		.text
+		addi	$t0,$0,-7
+		addiu	$t1,$0,3
+		slti	$t2,$t0,-6	# 1
+		sltiu	$t3,$t0,5	# 0, -7 is huge unsigned
+		xori	$t4,$t1,0xff	# 0xfc
+		sra	$t5,$t0,1	# -4
+		sllv	$t6,$t1,$t1	# 24
+		srlv	$t7,$t0,$t1	# 0x1fffffff
+		srav	$s0,$t0,$t1	# -1
+		nor	$s1,$t1,$0	# ~3
+		xor	$s2,$t0,$t1	# -6
+		blez	$t0,L1		# taken
+		addiu	$s3,$0,1
+L1:
+		bltz	$t1,L2		# not taken
+		addiu	$s4,$0,1
+L2:
+		bgez	$t1,L3		# taken
+		addiu	$s5,$0,1
+L3:
+		bgtz	$t0,L4		# not taken
+		addiu	$s6,$0,1
+L4:
+		lui	$s7,0x0040
+		ori	$s7,$s7,0x0060
+		jalr	$s7
+		syscall		#unsupported instruction, terminate
+		nop
+
+Answer:
+		addiu	$v0,$0,42
+		jr	$ra
@@ -0,0 +1,500 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <signal.h>
+#include <pthread.h>
+#include <ucontext.h>
+#include <sys/mman.h>
+#include "computer.h"
+#include "threaded.h"
+
+/*
+	x86-64 translator for hot blocks of the threaded engine.
+
+	Generated code is called as code(reg, memory, x) under the System V
+	ABI, so rdi holds the simulated register file, rsi mips.memory and
+	rdx the JitExit. Every simulated register access is one load or
+	store off rdi; eax and ecx are the only scratch registers.
+
+	lw and sw inline the bounds and alignment check from Mem(). A failed
+	check leaves through a stub that stores the address and returns the
+	number of instructions completed before it.
+
+	On guarded memory (see GuardMemory()) only the alignment is checked.
+	An address outside the data segment makes the host fault on the
+	load or store itself, and the SIGSEGV handler finds it among the
+	engine's sites and resumes at its stub, so the block leaves exactly
+	as if the check had failed. x86 does not fault on a misaligned
+	access, so that test stays.
+
+	Anything that is not one of the instructions Execute() supports
+	makes JitCompile() give up, and the block stays interpreted.
+*/
+
+#define JIT_BUFFER_SIZE (1 << 20)
+
+/* Longest encoding of any single op, including its fault stub */
+#define MAX_OP_BYTES 64
+
+/* Longest block compiled; longer ones stay interpreted */
+#define MAX_BLOCK_OPS 1024
+
+/* Most unchecked loads and stores the buffer can hold */
+#define MAX_SITES (JIT_BUFFER_SIZE / 16)
+
+__thread Engine *jitEngine;
+
+static pthread_once_t handlerOnce = PTHREAD_ONCE_INIT;
+
+/*
+ *  Resume a load or store of native code on guarded memory that
+ *  faulted at its stub. Any other fault is not ours, and is taken
+ *  again with the default action.
+ */
+static void OnFault(int sig, siginfo_t *info, void *context)
+{
+	ucontext_t *uc = context;
+	unsigned char *rip = (unsigned char *)uc->uc_mcontext.gregs[REG_RIP];
+	Engine *e = jitEngine;
+	unsigned int at;
+	int lo, hi, mid;
+
+	(void)info;
+	if (e != NULL && rip >= e->jitBuffer && rip < e->jitCur)
+	{
+		at = rip - e->jitBuffer;
+		lo = 0;
+		hi = e->nsites - 1;
+		while (lo <= hi)
+		{
+			mid = (lo + hi) / 2;
+			if (e->sites[mid].at == at)
+			{
+				uc->uc_mcontext.gregs[REG_RIP] = (greg_t)(e->jitBuffer + e->sites[mid].stub);
+				return;
+			}
+			if (e->sites[mid].at < at)
+				lo = mid + 1;
+			else
+				hi = mid - 1;
+		}
+	}
+	signal(sig, SIG_DFL);
+}
+
+static void InstallHandler(void)
+{
+	struct sigaction sa;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_sigaction = OnFault;
+	sa.sa_flags = SA_SIGINFO;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGSEGV, &sa, NULL);
+}
+
+static void Emit1(Engine *e, int b)
+{
+	*e->jitCur++ = b;
+}
+
+static void Emit4(Engine *e, int w)
+{
+	memcpy(e->jitCur, &w, 4);
+	e->jitCur += 4;
+}
+
+/* mov eax, [rdi + 4*r] */
+static void LoadEax(Engine *e, int r)
+{
+	Emit1(e, 0x8B);
+	Emit1(e, 0x87);
+	Emit4(e, 4 * r);
+}
+
+/* mov [rdi + 4*r], eax */
+static void StoreEax(Engine *e, int r)
+{
+	Emit1(e, 0x89);
+	Emit1(e, 0x87);
+	Emit4(e, 4 * r);
+}
+
+/* mov dword [rdi + 4*r], imm */
+static void StoreImm(Engine *e, int r, int imm)
+{
+	Emit1(e, 0xC7);
+	Emit1(e, 0x87);
+	Emit4(e, 4 * r);
+	Emit4(e, imm);
+}
+
+/* <op> eax, [rdi + 4*r] */
+static void AluEax(Engine *e, int opcode, int r)
+{
+	Emit1(e, opcode);
+	Emit1(e, 0x87);
+	Emit4(e, 4 * r);
+}
+
+/* mov ecx, [rdi + 4*r] */
+static void LoadEcx(Engine *e, int r)
+{
+	Emit1(e, 0x8B);
+	Emit1(e, 0x8F);
+	Emit4(e, 4 * r);
+}
+
+/* setcc al; movzx eax, al; mov [rdi + 4*r], eax */
+static void StoreFlag(Engine *e, int cc, int r)
+{
+	Emit1(e, 0x0F);
+	Emit1(e, cc);
+	Emit1(e, 0xC0);
+	Emit1(e, 0x0F);
+	Emit1(e, 0xB6);
+	Emit1(e, 0xC0);
+	StoreEax(e, r);
+}
+
+/*
+ *  Store the pc a branch at pc goes to in [rdx]: pc + 4 + op->imm, or
+ *  pc + 4 if the flags satisfy the condition code notTaken, the cmov
+ *  opcode of the opposite of the branch's condition.
+ */
+static void BranchExit(Engine *e, Op *op, int pc, int notTaken)
+{
+	Emit1(e, 0xB8); /* mov eax, taken */
+	Emit4(e, pc + 4 + op->imm);
+	Emit1(e, 0xB9); /* mov ecx, fall-through */
+	Emit4(e, pc + 4);
+	Emit1(e, 0x0F); /* cmov<notTaken> eax, ecx */
+	Emit1(e, notTaken);
+	Emit1(e, 0xC1);
+	Emit1(e, 0x89); /* mov [rdx], eax */
+	Emit1(e, 0x02);
+}
+
+/* Return count from the generated function */
+static void Return(Engine *e, int count)
+{
+	Emit1(e, 0xB8); /* mov eax, count */
+	Emit4(e, count);
+	Emit1(e, 0xC3); /* ret */
+}
+
+/*
+ *  Check the address in eax the way Mem() does, leaving its offset in
+ *  the data segment in ecx. Returns where the rel32 jumps to the fault
+ *  stub must be patched; on guarded memory there is only the second.
+ */
+static void CheckAddress(Engine *e, unsigned char **fixups)
+{
+	Emit1(e, 0x89); /* mov ecx, eax */
+	Emit1(e, 0xC1);
+	Emit1(e, 0x81); /* sub ecx, dataBase */
+	Emit1(e, 0xE9);
+	Emit4(e, e->dataBase);
+	fixups[0] = NULL;
+	if (!e->guarded)
+	{
+		Emit1(e, 0x81); /* cmp ecx, dataBytes - 1 */
+		Emit1(e, 0xF9);
+		Emit4(e, e->dataBytes - 1);
+		Emit1(e, 0x0F); /* ja fault */
+		Emit1(e, 0x87);
+		fixups[0] = e->jitCur;
+		Emit4(e, 0);
+	}
+	Emit1(e, 0xA8); /* test al, 3 */
+	Emit1(e, 0x03);
+	Emit1(e, 0x0F); /* jnz fault */
+	Emit1(e, 0x85);
+	fixups[1] = e->jitCur;
+	Emit4(e, 0);
+}
+
+/*
+ *  On guarded memory, note the load or store about to be emitted; its
+ *  stub is filled in once that is. Returns its site, or -1.
+ */
+static int Site(Engine *e)
+{
+	if (!e->guarded)
+	{
+		return -1;
+	}
+	e->sites[e->nsites].at = e->jitCur - e->jitBuffer;
+	return e->nsites++;
+}
+
+/*
+ *  Return native code for b, or NULL if it cannot be translated.
+ */
+JitCode JitCompile(Engine *e, Block *b)
+{
+	unsigned char *start, *fixups[MAX_BLOCK_OPS][2];
+	int faults[MAX_BLOCK_OPS], sites[MAX_BLOCK_OPS];
+	int nfaults = 0, ended = 0;
+	int k, pc, disp;
+	Op *op;
+
+	if (e->jitBuffer == NULL)
+	{
+		e->jitBuffer = mmap(NULL, JIT_BUFFER_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+												MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (e->jitBuffer == MAP_FAILED)
+		{
+			e->jitBuffer = NULL;
+			return NULL;
+		}
+		e->jitCur = e->jitBuffer;
+		e->jitLimit = e->jitBuffer + JIT_BUFFER_SIZE;
+	}
+	if (e->guarded && e->sites == NULL)
+	{
+		e->sites = MapTable(MAX_SITES * sizeof(*e->sites));
+		if (e->sites == NULL)
+		{
+			return NULL;
+		}
+		pthread_once(&handlerOnce, InstallHandler);
+	}
+
+	if (b->count > MAX_BLOCK_OPS)
+	{
+		return NULL;
+	}
+	for (k = 0; k < b->count; k++)
+	{
+		/* ll and sc are rare enough to leave to the handlers, as is HI/LO timing */
+		if (b->ops[k].kind == K_UNSUPPORTED || b->ops[k].kind == K_TRANSLATE ||
+				b->ops[k].kind == K_LL || b->ops[k].kind == K_SC || IsMulDiv(b->ops[k].kind))
+		{
+			return NULL;
+		}
+	}
+	if (e->jitLimit - e->jitCur < (b->count + 1) * MAX_OP_BYTES ||
+			(e->guarded && e->nsites + b->count > MAX_SITES))
+	{
+		return NULL;
+	}
+
+	start = e->jitCur;
+	for (k = 0; k < b->count; k++)
+	{
+		op = &b->ops[k];
+		pc = b->pc + 4 * k;
+		switch (op->kind)
+		{
+		case K_ADDU:
+			LoadEax(e, op->rs);
+			AluEax(e, 0x03, op->rt); /* add */
+			StoreEax(e, op->rd);
+			break;
+		case K_SUBU:
+			LoadEax(e, op->rs);
+			AluEax(e, 0x2B, op->rt); /* sub */
+			StoreEax(e, op->rd);
+			break;
+		case K_AND:
+			LoadEax(e, op->rs);
+			AluEax(e, 0x23, op->rt); /* and */
+			StoreEax(e, op->rd);
+			break;
+		case K_OR:
+			LoadEax(e, op->rs);
+			AluEax(e, 0x0B, op->rt); /* or */
+			StoreEax(e, op->rd);
+			break;
+		case K_XOR:
+			LoadEax(e, op->rs);
+			AluEax(e, 0x33, op->rt); /* xor */
+			StoreEax(e, op->rd);
+			break;
+		case K_NOR:
+			LoadEax(e, op->rs);
+			AluEax(e, 0x0B, op->rt); /* or */
+			Emit1(e, 0xF7);					/* not eax */
+			Emit1(e, 0xD0);
+			StoreEax(e, op->rd);
+			break;
+		case K_SLT:
+			LoadEax(e, op->rs);
+			AluEax(e, 0x3B, op->rt); /* cmp */
+			StoreFlag(e, 0x9C, op->rd); /* setl */
+			break;
+		case K_SLTI:
+		case K_SLTIU:
+			LoadEax(e, op->rs);
+			Emit1(e, 0x3D); /* cmp eax, imm */
+			Emit4(e, op->imm);
+			StoreFlag(e, op->kind == K_SLTI ? 0x9C : 0x92, op->rd); /* setl / setb */
+			break;
+		case K_SLL:
+			LoadEax(e, op->rt);
+			Emit1(e, 0xC1); /* shl eax, shamt */
+			Emit1(e, 0xE0);
+			Emit1(e, op->imm);
+			StoreEax(e, op->rd);
+			break;
+		case K_SRL:
+		case K_SRA:
+			/* Execute shifts the signed register, so srl is sar too */
+			LoadEax(e, op->rt);
+			Emit1(e, 0xC1); /* sar eax, shamt */
+			Emit1(e, 0xF8);
+			Emit1(e, op->imm);
+			StoreEax(e, op->rd);
+			break;
+		case K_SLLV:
+		case K_SRLV:
+		case K_SRAV:
+			/* x86 takes the shift count mod 32, as MIPS does */
+			LoadEcx(e, op->rs);
+			LoadEax(e, op->rt);
+			Emit1(e, 0xD3); /* shl / shr / sar eax, cl */
+			Emit1(e, op->kind == K_SLLV ? 0xE0 : op->kind == K_SRLV ? 0xE8 : 0xF8);
+			StoreEax(e, op->rd);
+			break;
+		case K_ADDIU:
+		case K_ADDI:
+		case K_ANDI:
+		case K_ORI:
+		case K_XORI:
+			LoadEax(e, op->rs);
+			Emit1(e, op->kind == K_ANDI ? 0x25 : op->kind == K_ORI ? 0x0D : op->kind == K_XORI ? 0x35 : 0x05);
+			Emit4(e, op->imm);
+			StoreEax(e, op->rd);
+			break;
+		case K_LUI:
+			StoreImm(e, op->rd, (unsigned int)op->imm << 16);
+			break;
+		case K_LW:
+			LoadEax(e, op->rs);
+			Emit1(e, 0x05); /* add eax, imm */
+			Emit4(e, op->imm);
+			CheckAddress(e, fixups[nfaults]);
+			sites[nfaults] = Site(e);
+			faults[nfaults++] = k;
+			Emit1(e, 0x8B); /* mov eax, [rsi + rcx + dataBase - TEXT_BASE] */
+			Emit1(e, 0x84);
+			Emit1(e, 0x0E);
+			Emit4(e, e->dataBase - TEXT_BASE);
+			StoreEax(e, op->rd);
+			break;
+		case K_SW:
+			LoadEax(e, op->rs);
+			Emit1(e, 0x05); /* add eax, imm */
+			Emit4(e, op->imm);
+			CheckAddress(e, fixups[nfaults]);
+			/* The value goes through r8d so the stub still finds the address in eax */
+			Emit1(e, 0x44); /* mov r8d, [rdi + 4*rt] */
+			Emit1(e, 0x8B);
+			Emit1(e, 0x87);
+			Emit4(e, 4 * op->rt);
+			sites[nfaults] = Site(e);
+			faults[nfaults++] = k;
+			Emit1(e, 0x44); /* mov [rsi + rcx + dataBase - TEXT_BASE], r8d */
+			Emit1(e, 0x89);
+			Emit1(e, 0x84);
+			Emit1(e, 0x0E);
+			Emit4(e, e->dataBase - TEXT_BASE);
+			break;
+		case K_BEQ:
+		case K_BNE:
+			LoadEax(e, op->rs);
+			AluEax(e, 0x3B, op->rt); /* cmp */
+			BranchExit(e, op, pc, op->kind == K_BEQ ? 0x45 : 0x44); /* cmovne / cmove */
+			ended = 1;
+			break;
+		case K_BLEZ:
+		case K_BGTZ:
+		case K_BLTZ:
+		case K_BGEZ:
+			Emit1(e, 0x83); /* cmp dword [rdi + 4*rs], 0 */
+			Emit1(e, 0xBF);
+			Emit4(e, 4 * op->rs);
+			Emit1(e, 0);
+			/* cmovg / cmovle / cmovge / cmovl */
+			BranchExit(e, op, pc, op->kind == K_BLEZ ? 0x4F : op->kind == K_BGTZ ? 0x4E : op->kind == K_BLTZ ? 0x4D : 0x4C);
+			ended = 1;
+			break;
+		case K_JAL:
+			StoreImm(e, 31, pc + 4);
+			/* fall through */
+		case K_J:
+			Emit1(e, 0xC7); /* mov dword [rdx], target */
+			Emit1(e, 0x02);
+			Emit4(e, op->imm);
+			ended = 1;
+			break;
+		case K_JR:
+		case K_JALR:
+			/* The target is read before jalr links, in case rd is rs */
+			LoadEax(e, op->rs);
+			if (op->kind == K_JALR)
+			{
+				StoreImm(e, op->rd, pc + 4);
+			}
+			Emit1(e, 0x89); /* mov [rdx], eax */
+			Emit1(e, 0x02);
+			ended = 1;
+			break;
+		}
+	}
+	if (!ended)
+	{
+		/* The block ran off the end of the text segment */
+		Emit1(e, 0xC7); /* mov dword [rdx], end */
+		Emit1(e, 0x02);
+		Emit4(e, b->end);
+	}
+	Return(e, b->count);
+
+	/* Fault stubs: record the address, report how far the block got */
+	for (k = 0; k < nfaults; k++)
+	{
+		if (fixups[k][0] != NULL)
+		{
+			disp = e->jitCur - (fixups[k][0] + 4);
+			memcpy(fixups[k][0], &disp, 4);
+		}
+		if (sites[k] >= 0)
+		{
+			e->sites[sites[k]].stub = e->jitCur - e->jitBuffer;
+		}
+		disp = e->jitCur - (fixups[k][1] + 4);
+		memcpy(fixups[k][1], &disp, 4);
+		Emit1(e, 0x89); /* mov [rdx + 4], eax */
+		Emit1(e, 0x42);
+		Emit1(e, 0x04);
+		Return(e, faults[k]);
+	}
+
+	return (JitCode)start;
+}
+
+/*
+ *  Throw away all generated code.
+ */
+void JitReset(Engine *e)
+{
+	e->jitCur = e->jitBuffer;
+	e->nsites = 0;
+}
+
+/*
+ *  Give the code buffer back.
+ */
+void JitFree(Engine *e)
+{
+	if (e->jitBuffer != NULL)
+	{
+		munmap(e->jitBuffer, JIT_BUFFER_SIZE);
+		e->jitBuffer = NULL;
+	}
+	UnmapTable(e->sites, MAX_SITES * sizeof(*e->sites));
+	e->sites = NULL;
+	e->nsites = 0;
+}
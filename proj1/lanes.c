@@ -0,0 +1,339 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include "computer.h"
+#include "threaded.h"
+#undef mips /* gcc already has a def for mips */
+
+/*
+	Lockstep lane engine.
+
+	Runs up to MAXLANES machines loaded with the same program, typically
+	differing only in their starting registers, as lanes of one
+	simulation. The registers are kept as structure-of-arrays, one
+	vector of MAXLANES words per register, so an ALU instruction is a
+	single vector operation for every lane. The block runner is built
+	for AVX-512, AVX2 and plain x86-64, and the best one for the host is
+	picked when the program starts.
+
+	Lanes that are at the same pc run together under a mask. When a
+	branch splits them, the group with the lowest pc runs first, which
+	brings forward branches and loop exits back together; lanes that
+	stay split for SPLIT_LIMIT blocks in a row are finished one at a
+	time instead. Loads and stores go lane by lane, since every lane has
+	its own memory.
+
+	A lane leaves the vector loop as soon as it stops: at a Memory
+	Access Exception, an ll, sc or unsupported instruction, a pc outside
+	the text or a limit, with its state written back as it was before
+	the instruction. ContinueThreaded() then finishes it, so the messages
+	and final state it prints are exactly the threaded engine's.
+*/
+
+/* Blocks a group can run short of all the lanes before going scalar */
+#define SPLIT_LIMIT 256
+
+typedef unsigned int LaneVec __attribute__((vector_size(MAXLANES * sizeof(unsigned int))));
+typedef int SignedLaneVec __attribute__((vector_size(MAXLANES * sizeof(int))));
+typedef unsigned long CountVec __attribute__((vector_size(MAXLANES * sizeof(unsigned long))));
+typedef long SignedCountVec __attribute__((vector_size(MAXLANES * sizeof(long))));
+
+typedef struct
+{
+	LaneVec reg[32]; /* reg[r][lane] */
+	SignedLaneVec pc;
+	CountVec retired;
+	CountVec checkAt;
+	unsigned int live; /* lanes still in the vector loop */
+} Lanes;
+
+/* Write value into the lanes of m of r, leaving the others alone */
+#define BLEND(old, value, m) ((old) = ((value) & (m)) | ((old) & ~(m)))
+#define SET(r, value) BLEND(l->reg[r], value, m)
+
+/*
+ *  Take lane k out of the vector loop at pc, writing its state back.
+ */
+static void Leave(Lanes *l, Computer **lanes, int k, int pc, unsigned long retired)
+{
+	int r;
+
+	for (r = 0; r < 32; r++)
+	{
+		lanes[k]->registers[r] = l->reg[r][k];
+	}
+	lanes[k]->pc = pc;
+	lanes[k]->retired = retired;
+	l->live &= ~(1u << k);
+}
+
+/*
+ *  Run the lanes of *mask, all at the start of block b, through it.
+ *  The mask comes by pointer, since a vector argument this wide draws
+ *  an ABI note from GCC.
+ */
+static inline __attribute__((always_inline)) void RunBlock(Lanes *l, Computer **lanes, Block *b,
+																													 const LaneVec *mask)
+{
+	LaneVec m = *mask;
+	SignedLaneVec taken, target;
+	int pc = b->pc, addr, i, k;
+	Op *op;
+
+	for (i = 0, op = b->ops; i < b->count; i++, op++, pc += 4)
+	{
+		switch (op->kind)
+		{
+		case K_ADDU:
+			SET(op->rd, l->reg[op->rs] + l->reg[op->rt]);
+			break;
+		case K_SUBU:
+			SET(op->rd, l->reg[op->rs] - l->reg[op->rt]);
+			break;
+		case K_AND:
+			SET(op->rd, l->reg[op->rs] & l->reg[op->rt]);
+			break;
+		case K_OR:
+			SET(op->rd, l->reg[op->rs] | l->reg[op->rt]);
+			break;
+		case K_SLT:
+			SET(op->rd, (LaneVec)((SignedLaneVec)l->reg[op->rs] < (SignedLaneVec)l->reg[op->rt]) & 1);
+			break;
+		case K_XOR:
+			SET(op->rd, l->reg[op->rs] ^ l->reg[op->rt]);
+			break;
+		case K_NOR:
+			SET(op->rd, ~(l->reg[op->rs] | l->reg[op->rt]));
+			break;
+		case K_SLL:
+			SET(op->rd, l->reg[op->rt] << op->imm);
+			break;
+		case K_SRL:
+		case K_SRA:
+			SET(op->rd, (LaneVec)((SignedLaneVec)l->reg[op->rt] >> op->imm));
+			break;
+		case K_SLLV:
+			SET(op->rd, l->reg[op->rt] << (l->reg[op->rs] & 31));
+			break;
+		case K_SRLV:
+			SET(op->rd, l->reg[op->rt] >> (l->reg[op->rs] & 31));
+			break;
+		case K_SRAV:
+			SET(op->rd, (LaneVec)((SignedLaneVec)l->reg[op->rt] >> (SignedLaneVec)(l->reg[op->rs] & 31)));
+			break;
+		case K_ADDIU:
+		case K_ADDI:
+			SET(op->rd, l->reg[op->rs] + (unsigned int)op->imm);
+			break;
+		case K_XORI:
+			SET(op->rd, l->reg[op->rs] ^ (unsigned int)op->imm);
+			break;
+		case K_SLTI:
+			SET(op->rd, (LaneVec)((SignedLaneVec)l->reg[op->rs] < op->imm) & 1);
+			break;
+		case K_SLTIU:
+			SET(op->rd, (LaneVec)(l->reg[op->rs] < (unsigned int)op->imm) & 1);
+			break;
+		case K_ANDI:
+			SET(op->rd, l->reg[op->rs] & (unsigned int)op->imm);
+			break;
+		case K_ORI:
+			SET(op->rd, l->reg[op->rs] | (unsigned int)op->imm);
+			break;
+		case K_LUI:
+			SET(op->rd, (LaneVec){0} + ((unsigned int)op->imm << 16));
+			break;
+		case K_LW:
+		case K_SW:
+			/* Every lane has its own memory, so these go one lane at a time */
+			for (k = 0; k < MAXLANES; k++)
+			{
+				if (m[k] == 0)
+					continue;
+				addr = l->reg[op->rs][k] + op->imm;
+				if (BAD_DATA_ADDR(lanes[k], addr))
+				{
+					Leave(l, lanes, k, pc, l->retired[k] + i);
+					m[k] = 0;
+				}
+				else if (op->kind == K_LW)
+					l->reg[op->rd][k] = lanes[k]->memory[(unsigned int)(addr - TEXT_BASE) / 4];
+				else
+					lanes[k]->memory[(unsigned int)(addr - TEXT_BASE) / 4] = l->reg[op->rt][k];
+			}
+			break;
+		case K_BEQ:
+		case K_BNE:
+			taken = (SignedLaneVec)l->reg[op->rs] == (SignedLaneVec)l->reg[op->rt];
+			if (op->kind == K_BNE)
+				taken = ~taken;
+			BLEND(l->pc, pc + 4 + (taken & op->imm), (SignedLaneVec)m);
+			break;
+		case K_BLEZ:
+		case K_BGTZ:
+		case K_BLTZ:
+		case K_BGEZ:
+			taken = op->kind == K_BLEZ		? (SignedLaneVec)l->reg[op->rs] <= 0
+							: op->kind == K_BGTZ	? (SignedLaneVec)l->reg[op->rs] > 0
+							: op->kind == K_BLTZ	? (SignedLaneVec)l->reg[op->rs] < 0
+																		: (SignedLaneVec)l->reg[op->rs] >= 0;
+			BLEND(l->pc, pc + 4 + (taken & op->imm), (SignedLaneVec)m);
+			break;
+		case K_JAL:
+			SET(31, (LaneVec){0} + (unsigned int)(pc + 4));
+			/* fall through */
+		case K_J:
+			BLEND(l->pc, (SignedLaneVec){0} + op->imm, (SignedLaneVec)m);
+			break;
+		case K_JR:
+			BLEND(l->pc, (SignedLaneVec)l->reg[op->rs], (SignedLaneVec)m);
+			break;
+		case K_JALR:
+			target = (SignedLaneVec)l->reg[op->rs];
+			SET(op->rd, (LaneVec){0} + (unsigned int)(pc + 4));
+			BLEND(l->pc, target, (SignedLaneVec)m);
+			break;
+		default: /* K_LL, K_SC, the multiply/divide unit, K_UNSUPPORTED */
+			for (k = 0; k < MAXLANES; k++)
+			{
+				if (m[k] != 0)
+					Leave(l, lanes, k, pc, l->retired[k] + i);
+			}
+			return;
+		}
+	}
+	if (!EndsBlock(b->ops[b->count - 1].kind))
+		BLEND(l->pc, (SignedLaneVec){0} + b->end, (SignedLaneVec)m);
+	l->retired += __builtin_convertvector((SignedLaneVec)m, SignedCountVec) & b->count;
+}
+
+/*
+ *  Run n <= MAXLANES lanes in the vector loop until every one has left
+ *  it. Returns 0 if there was no memory for a block.
+ */
+__attribute__((target_clones("avx512f", "avx2", "default")))
+static int RunLanes(Lanes *l, Computer **lanes, int n)
+{
+	SignedLaneVec live;
+	LaneVec m;
+	CountVec due;
+	unsigned int mask;
+	int pc, k, split = 0;
+	Block *b;
+
+	while (l->live != 0)
+	{
+		/* The group of lanes at the lowest pc goes next */
+		for (k = 0; k < MAXLANES; k++)
+		{
+			live[k] = l->live & 1u << k ? -1 : 0;
+		}
+		pc = INT_MAX;
+		for (k = 0; k < MAXLANES; k++)
+		{
+			pc = live[k] && l->pc[k] < pc ? l->pc[k] : pc;
+		}
+		m = (LaneVec)(live & (l->pc == pc));
+		mask = 0;
+		for (k = 0; k < MAXLANES; k++)
+		{
+			mask |= (m[k] & 1) << k;
+		}
+
+		/* Lanes due to look at their limits do so between blocks */
+		due = (CountVec)(l->retired >= l->checkAt) & __builtin_convertvector((SignedLaneVec)m, CountVec);
+		for (k = 0; k < n; k++)
+		{
+			if (due[k] == 0)
+				continue;
+			lanes[k]->retired = l->retired[k];
+			if (CheckLimits(lanes[k], &l->checkAt[k]) != SIM_OK)
+			{
+				Leave(l, lanes, k, pc, l->retired[k]);
+				mask &= ~(1u << k);
+				m[k] = 0;
+			}
+		}
+		if (mask == 0)
+		{
+			continue;
+		}
+
+		split = mask == l->live ? 0 : split + 1;
+		if (split > SPLIT_LIMIT || pc % 4 != 0 || (unsigned int)(pc - TEXT_BASE) / 4 >= (unsigned int)lanes[0]->textWords)
+		{
+			/* Split for too long, or running outside the text: one at a time */
+			for (k = 0; k < n; k++)
+			{
+				if (mask & 1u << k || (split > SPLIT_LIMIT && l->live & 1u << k))
+					Leave(l, lanes, k, l->pc[k], l->retired[k]);
+			}
+			continue;
+		}
+
+		b = BlockAt(lanes[0], pc);
+		if (b == NULL)
+		{
+			return 0;
+		}
+		RunBlock(l, lanes, b, &m);
+	}
+	return 1;
+}
+
+/*
+ *  Run the n machines in lanes, which must all hold the same program,
+ *  together from the entry point. Each one ends up as if it had
+ *  been run alone with SimulateThreaded() and no tracing, printing its
+ *  final state to its own out, and its status is put in status. Lanes
+ *  are run MAXLANES at a time. Returns SIM_NO_MEMORY if there was no
+ *  memory to run them, else SIM_OK.
+ */
+int SimulateLanes(Computer **lanes, int n, int *status)
+{
+	Lanes *l;
+	int k, r, group;
+
+	l = aligned_alloc(sizeof(LaneVec), sizeof(Lanes));
+	if (l == NULL)
+	{
+		return SIM_NO_MEMORY;
+	}
+	for (group = 0; group < n; group += MAXLANES, lanes += MAXLANES, status += MAXLANES)
+	{
+		memset(l, 0, sizeof(*l));
+		for (k = 0; k < MAXLANES && group + k < n; k++)
+		{
+			for (r = 0; r < 32; r++)
+			{
+				l->reg[r][k] = lanes[k]->registers[r];
+			}
+			l->pc[k] = lanes[k]->pc = lanes[k]->entry;
+			l->checkAt[k] = StartLimits(lanes[k]);
+			/* Lanes share the first one's blocks, so the text must be the same */
+			if (lanes[k]->textWords == lanes[0]->textWords && lanes[k]->dataWords == lanes[0]->dataWords &&
+					lanes[k]->entry == lanes[0]->entry &&
+					memcmp(lanes[k]->memory, lanes[0]->memory, lanes[0]->textWords * sizeof(int)) == 0)
+				l->live |= 1u << k;
+		}
+
+		/* Lanes finish on their own blocks, which may be another program's */
+		for (k = 0; k < MAXLANES && group + k < n; k++)
+		{
+			ResetBlocks(lanes[k]);
+			JitReset(lanes[k]->engine);
+		}
+		if (!RunLanes(l, lanes, k))
+		{
+			free(l);
+			return SIM_NO_MEMORY;
+		}
+		for (k = 0; k < MAXLANES && group + k < n; k++)
+		{
+			status[k] = ContinueThreaded(lanes[k], 0, 0);
+		}
+	}
+	free(l);
+	return SIM_OK;
+}
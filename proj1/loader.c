@@ -0,0 +1,412 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "computer.h"
+#undef mips /* gcc already has a def for mips */
+
+/*
+	Program loader.
+
+	A program file is mapped, not read, and its words go straight into
+	memory from the mapping. Four formats are accepted, and told apart
+	by looking at the file:
+
+	- A big-endian MIPS32 ELF executable. Each PT_LOAD segment goes at
+	  its address, which must be in memory (use sim -M to make the data
+	  segment reach it), and the rest of it past the file's bytes stays
+	  zero. The program starts at e_entry, which must be in the text.
+	  $gp is set from the .reginfo segment, or else the _gp symbol, and
+	  $sp from the __stack symbol if there is one.
+	- Text, one word per line in hex, optionally after 0x, as MARS and
+	  SPIM dump it. A file is text if its first line is such a word.
+	- Raw little-endian words, the format of the .dump files here.
+	- Raw big-endian words, as a MIPS toolchain writes them. Raw files
+	  are taken as big-endian only if more of their words decode to
+	  instructions Simulate() knows that way round.
+
+	Big-endian words are swapped 32 bytes at a time with a vector
+	shuffle, and each hex word is converted eight digits at once in a
+	64-bit register, so loading costs little more than the copy.
+*/
+
+typedef unsigned char Bytes __attribute__((vector_size(32)));
+
+/* The parts of the ELF format used here */
+#define EM_MIPS 8
+#define ET_EXEC 2
+#define PT_LOAD 1
+#define PT_MIPS_REGINFO 0x70000000
+#define SHT_SYMTAB 2
+#define EHDR_SIZE 52
+#define PHDR_SIZE 32
+#define SHDR_SIZE 40
+#define SYM_SIZE 16
+
+/*
+ *  True if w is an instruction Simulate() knows, with the shift amount
+ *  of an R-format word zero unless it is a shift. Swapped words often
+ *  have a known funct in their low byte, but seldom a zero shift too.
+ */
+static int Plausible(unsigned int w)
+{
+	int kind = InstrKind(w);
+
+	return kind != K_UNSUPPORTED &&
+				 (w >> 26 != 0 || (w >> 6 & 31) == 0 || kind == K_SLL || kind == K_SRL || kind == K_SRA);
+}
+
+/*
+ *  True if the n raw words at p are more likely big-endian.
+ */
+static int BigEndian(const unsigned char *p, size_t n)
+{
+	size_t little = 0, big = 0, k;
+	unsigned int w;
+
+	for (k = 0; k < n; k++, p += 4)
+	{
+		memcpy(&w, p, 4);
+		little += Plausible(w);
+		big += Plausible(__builtin_bswap32(w));
+	}
+	return big > little;
+}
+
+/*
+ *  Copy n big-endian words from p to memory in host order.
+ */
+__attribute__((target_clones("avx2", "default")))
+static void SwapWords(int *memory, const unsigned char *p, size_t n)
+{
+	const Bytes order = {3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12,
+											 19, 18, 17, 16, 23, 22, 21, 20, 27, 26, 25, 24, 31, 30, 29, 28};
+	Bytes v;
+	size_t k = 0;
+	unsigned int w;
+
+	for (; k + 8 <= n; k += 8)
+	{
+		memcpy(&v, p + 4 * k, sizeof(v));
+		v = __builtin_shuffle(v, order);
+		memcpy(memory + k, &v, sizeof(v));
+	}
+	for (; k < n; k++)
+	{
+		memcpy(&w, p + 4 * k, 4);
+		memory[k] = __builtin_bswap32(w);
+	}
+}
+
+/* Big-endian fields of an ELF file */
+static unsigned int Half(const unsigned char *p)
+{
+	return p[0] << 8 | p[1];
+}
+
+static unsigned int Word(const unsigned char *p)
+{
+	return (unsigned int)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+/*
+ *  True if the n bytes at offset lie within the size bytes of a file.
+ */
+static int InFile(size_t size, unsigned int offset, unsigned int n)
+{
+	return offset <= size && n <= size - offset;
+}
+
+/*
+ *  Return the value of the symbol name in the symbol table of the ELF
+ *  file of size bytes at p, in *value. Returns 0 if there is none.
+ */
+static int Symbol(const unsigned char *p, size_t size, const char *name, unsigned int *value)
+{
+	unsigned int shoff = Word(p + 32), shnum = Half(p + 48), k, i;
+	const unsigned char *sh, *link, *sym;
+	size_t length = strlen(name);
+
+	if (Half(p + 46) != SHDR_SIZE || !InFile(size, shoff, shnum * SHDR_SIZE))
+	{
+		return 0;
+	}
+	for (k = 0; k < shnum; k++)
+	{
+		sh = p + shoff + k * SHDR_SIZE;
+		if (Word(sh + 4) != SHT_SYMTAB || Word(sh + 24) >= shnum ||
+				!InFile(size, Word(sh + 16), Word(sh + 20)))
+		{
+			continue;
+		}
+		link = p + shoff + Word(sh + 24) * SHDR_SIZE;
+		if (!InFile(size, Word(link + 16), Word(link + 20)) || Word(link + 20) <= length)
+		{
+			continue;
+		}
+		for (i = 0; i + SYM_SIZE <= Word(sh + 20); i += SYM_SIZE)
+		{
+			sym = p + Word(sh + 16) + i;
+			if (Word(sym) < Word(link + 20) - length &&
+					memcmp(p + Word(link + 16) + Word(sym), name, length + 1) == 0)
+			{
+				*value = Word(sym + 4);
+				return 1;
+			}
+		}
+	}
+	return 0;
+}
+
+/*
+ *  Load the ELF executable of size bytes at p into mips.
+ */
+static int LoadElf(Computer *mips, const unsigned char *p, size_t size)
+{
+	unsigned int phoff, phnum, vaddr, offset, filesz, memsz, k, tail, value;
+	unsigned long end = TEXT_BASE + MEMORY_BYTES(mips);
+	const unsigned char *ph;
+	int gp = 0;
+
+	if (size < EHDR_SIZE || p[4] != 1 || p[5] != 2 || Half(p + 16) != ET_EXEC ||
+			Half(p + 18) != EM_MIPS || Half(p + 42) != PHDR_SIZE)
+	{
+		return SIM_BAD_PROGRAM;
+	}
+	phoff = Word(p + 28);
+	phnum = Half(p + 44);
+	if (!InFile(size, phoff, phnum * PHDR_SIZE))
+	{
+		return SIM_BAD_PROGRAM;
+	}
+	for (k = 0; k < phnum; k++)
+	{
+		ph = p + phoff + k * PHDR_SIZE;
+		offset = Word(ph + 4);
+		vaddr = Word(ph + 8);
+		filesz = Word(ph + 16);
+		memsz = Word(ph + 20);
+		if (Word(ph) == PT_MIPS_REGINFO && InFile(size, offset, 24))
+		{
+			mips->registers[28] = Word(p + offset + 20);
+			gp = 1;
+		}
+		if (Word(ph) != PT_LOAD || memsz == 0)
+		{
+			continue;
+		}
+		if (!InFile(size, offset, filesz) || filesz > memsz || vaddr % 4 != 0)
+		{
+			return SIM_BAD_PROGRAM;
+		}
+		if (vaddr < TEXT_BASE || vaddr > end || memsz > end - vaddr)
+		{
+			return SIM_TOO_BIG;
+		}
+		/* The memory past filesz is already zero */
+		SwapWords(mips->memory + (vaddr - TEXT_BASE) / 4, p + offset, filesz / 4);
+		tail = filesz % 4;
+		if (tail != 0)
+		{
+			value = 0;
+			memcpy(&value, p + offset + filesz - tail, tail);
+			mips->memory[(vaddr - TEXT_BASE) / 4 + filesz / 4] = __builtin_bswap32(value);
+		}
+	}
+
+	mips->entry = Word(p + 24);
+	if (mips->entry % 4 != 0 || (unsigned int)(mips->entry - TEXT_BASE) / 4 >= (unsigned int)mips->textWords)
+	{
+		return SIM_TOO_BIG;
+	}
+	if (!gp && Symbol(p, size, "_gp", &value))
+	{
+		mips->registers[28] = value;
+	}
+	if (Symbol(p, size, "__stack", &value))
+	{
+		mips->registers[29] = value;
+	}
+	return SIM_OK;
+}
+
+/*
+ *  Convert the eight hex digits at p into *word. Returns 0 if they are
+ *  not all hex digits.
+ */
+static int HexWord(const unsigned char *p, unsigned int *word)
+{
+	unsigned long long x, lower, digit, letter, value;
+
+	/* Bytes of x hold the digits, the first in the lowest */
+	memcpy(&x, p, 8);
+	lower = x | 0x2020202020202020ULL;
+	/* 0x80 in each byte that is in '0'..'9', or in 'a'..'f' */
+	digit = ((x | 0x8080808080808080ULL) - 0x3030303030303030ULL) &
+					~((x | 0x8080808080808080ULL) - 0x3A3A3A3A3A3A3A3AULL) & 0x8080808080808080ULL;
+	letter = ((lower | 0x8080808080808080ULL) - 0x6161616161616161ULL) &
+					 ~((lower | 0x8080808080808080ULL) - 0x6767676767676767ULL) & 0x8080808080808080ULL;
+	if ((digit | letter) != 0x8080808080808080ULL || (x & 0x8080808080808080ULL) != 0)
+	{
+		return 0;
+	}
+	/* Digits are their low nibble, letters that plus 9 */
+	value = (x & 0x0F0F0F0F0F0F0F0FULL) + (letter >> 7) * 9;
+
+	/* Pack the nibbles into bytes, then the bytes into the word */
+	value = (value & 0x000F000F000F000FULL) << 4 | (value & 0x0F000F000F000F00ULL) >> 8;
+	value = (value | value >> 8) & 0x0000FFFF0000FFFFULL;
+	value = (value | value >> 16) & 0xFFFFFFFFULL;
+	*word = __builtin_bswap32(value);
+	return 1;
+}
+
+static int Space(int c)
+{
+	return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+/*
+ *  Parse the hex word starting at *at, before end, moving *at past it.
+ *  Returns 0 if there is not one there.
+ */
+static int NextHex(const unsigned char **at, const unsigned char *end, unsigned int *word)
+{
+	const unsigned char *p = *at;
+
+	if (end - p >= 2 && p[0] == '0' && (p[1] == 'x' || p[1] == 'X'))
+	{
+		p += 2;
+	}
+	if (end - p < 8 || !HexWord(p, word) || (end - p > 8 && !Space(p[8])))
+	{
+		return 0;
+	}
+	*at = p + 8;
+	return 1;
+}
+
+/*
+ *  Load the hex text from p to end. Returns the words loaded, or -1 if
+ *  the text is not all hex words.
+ */
+static long LoadText(Computer *mips, const unsigned char *p, const unsigned char *end)
+{
+	unsigned int word;
+	long k = 0;
+
+	for (;;)
+	{
+		while (p < end && Space(*p))
+		{
+			p++;
+		}
+		if (p == end)
+		{
+			return k;
+		}
+		if (!NextHex(&p, end, &word))
+		{
+			return -1;
+		}
+		if (k < mips->textWords)
+		{
+			mips->memory[k] = word;
+		}
+		k++;
+	}
+}
+
+/*
+ *  Load the size bytes at p into the text segment of mips.
+ */
+static int LoadImage(Computer *mips, const unsigned char *p, size_t size)
+{
+	const unsigned char *at = p, *end = p + size;
+	unsigned int word;
+	long k;
+	size_t n = size / 4;
+
+	if (size >= 4 && memcmp(p, "\177ELF", 4) == 0)
+	{
+		return LoadElf(mips, p, size);
+	}
+	while (at < end && Space(*at))
+	{
+		at++;
+	}
+	if (at < end && NextHex(&at, end, &word))
+	{
+		k = LoadText(mips, p, end);
+		if (k < 0)
+		{
+			return SIM_BAD_PROGRAM;
+		}
+		return k > mips->textWords ? SIM_TOO_BIG : SIM_OK;
+	}
+
+	/* Raw words; anything past the last whole one is ignored */
+	if (n > (size_t)mips->textWords)
+	{
+		return SIM_TOO_BIG;
+	}
+	if (BigEndian(p, n))
+	{
+		SwapWords(mips->memory, p, n);
+	}
+	else
+	{
+		memcpy(mips->memory, p, 4 * n);
+	}
+	return SIM_OK;
+}
+
+/*
+ *  Load the program in filein, which must be at its start, into mips,
+ *  whose memory must read as zero, setting where it starts and any
+ *  registers the file gives. Returns SIM_TOO_BIG if it does not fit,
+ *  SIM_BAD_PROGRAM if it is not in a format the loader knows, and
+ *  SIM_NO_MEMORY if there was no room to read it.
+ */
+int LoadProgram(Computer *mips, FILE *filein)
+{
+	struct stat st;
+	unsigned char *buffer = NULL, *bigger;
+	size_t size = 0, room = 0, got;
+	void *map;
+	int status;
+
+	if (fstat(fileno(filein), &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0)
+	{
+		map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(filein), 0);
+		if (map != MAP_FAILED)
+		{
+			status = LoadImage(mips, map, st.st_size);
+			munmap(map, st.st_size);
+			return status;
+		}
+	}
+
+	/* Pipes and the like are read in */
+	do
+	{
+		if (size == room)
+		{
+			room = 2 * room + 65536;
+			bigger = realloc(buffer, room);
+			if (bigger == NULL)
+			{
+				free(buffer);
+				return SIM_NO_MEMORY;
+			}
+			buffer = bigger;
+		}
+		got = fread(buffer + size, 1, room - size, filein);
+		size += got;
+	} while (got > 0);
+	status = LoadImage(mips, buffer, size);
+	free(buffer);
+	return status;
+}
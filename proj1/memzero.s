@@ -0,0 +1,14 @@
+# Stores words, some of them zero over earlier nonzero ones, so the
+# nonzero memory that -m prints shrinks as well as grows.
+#
+
+		.text
+		lui	$t0,0x0040
+		ori	$t0,$t0,0x2000
+		addiu	$t1,$0,5
+		sw	$t1,8($t0)
+		sw	$t1,0($t0)
+		sw	$0,8($t0)
+		sw	$t1,4($t0)
+		sw	$0,0($t0)
+		syscall		#unsupported instruction, terminate
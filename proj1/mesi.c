@@ -0,0 +1,433 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include "computer.h"
+#undef mips /* gcc already has a def for mips */
+
+/*
+	Cache-coherence model.
+
+	Each machine attached to a Coherence gets a private, set-associative
+	L1 data cache with LRU replacement, kept coherent with the others by
+	snooping MESI over one bus. The model only keeps time: the data
+	still lives in the shared memory, and every lw, sw, ll and sc calls
+	CacheAccess() with its address before touching it. Instruction
+	fetches are not modelled.
+
+	A read miss takes the line Exclusive from memory if no other cache
+	has it, and otherwise Shared, supplied by the other cache, which
+	writes it back first if it was Modified. A write to a Shared line
+	broadcasts an upgrade, and a write miss a read-for-ownership; both
+	invalidate every other copy.
+
+	Misses are classed by why the line was missing: never held (cold),
+	evicted (capacity or conflict), or invalidated by another core's
+	write (coherence). An invalidation is false sharing when the victim
+	had not touched the word that was written, only others in its line;
+	those are what a better data layout would remove. The counts are
+	kept per core and per line, and PrintCoherence() reports them with
+	the lines that had the most coherence traffic.
+
+	The bus is a mutex, so harts running free on host threads see the
+	accesses in some order, as a real bus would; with a quantum the
+	order, and so the report, is the same on every run.
+*/
+
+/* Cycles charged to an access, for the estimate in the report */
+#define HIT_CYCLES 1
+#define UPGRADE_CYCLES 10
+#define TRANSFER_CYCLES 40 /* line supplied by another cache */
+#define MEMORY_CYCLES 100	/* line read from memory */
+
+/* Lines listed in the report */
+#define HOTSPOTS 10
+
+enum
+{
+	INVALID,
+	SHARED,
+	EXCLUSIVE,
+	MODIFIED
+};
+
+/* Why a core does not hold a line */
+enum
+{
+	NEVER_HELD,
+	EVICTED,
+	INVALIDATED
+};
+
+typedef struct
+{
+	int line;							/* line number, (addr - 0x00400000) / line size */
+	int state;						/* INVALID .. MODIFIED */
+	unsigned long used;		/* access count at the last use, for LRU */
+	unsigned int touched; /* words this core used since it got the line */
+} Way;
+
+typedef struct
+{
+	unsigned long reads, writes, hits;
+	unsigned long coldMisses, capacityMisses, coherenceMisses;
+	unsigned long upgrades, transfers, writebacks, invalidations;
+	unsigned long cycles;
+} CoreStats;
+
+struct L1
+{
+	Coherence *bus;
+	Computer *mips;
+	Way *ways;		/* sets * ways, set by set */
+	char *lost;		/* NEVER_HELD .. INVALIDATED, per line */
+	unsigned long clock;
+	CoreStats stats;
+};
+
+typedef struct
+{
+	unsigned long invalidations, falseSharing, coherenceMisses;
+} LineStats;
+
+typedef struct
+{
+	int line;
+	LineStats stats;
+} Hotspot;
+
+struct Coherence
+{
+	pthread_mutex_t lock;
+	int sets, ways, lineBytes, lines;
+	L1 **cores;
+	int ncores;
+	LineStats *lineStats;
+	unsigned long transactions; /* bus reads, read-for-ownerships and upgrades */
+};
+
+/*
+ *  Return a coherence model for L1s of sets sets of ways lines of
+ *  lineBytes bytes each over the memory of mips and its harts, or NULL
+ *  if there is no memory for it or the shape is unusable: lineBytes
+ *  must be a power of two from 4 to 128.
+ */
+Coherence *NewCoherence(Computer *mips, int sets, int ways, int lineBytes)
+{
+	Coherence *bus;
+
+	if (sets < 1 || ways < 1 || lineBytes < 4 || lineBytes > 128 ||
+			(lineBytes & (lineBytes - 1)) != 0)
+	{
+		return NULL;
+	}
+	bus = calloc(1, sizeof(Coherence));
+	if (bus == NULL)
+	{
+		return NULL;
+	}
+	bus->sets = sets;
+	bus->ways = ways;
+	bus->lineBytes = lineBytes;
+	bus->lines = (MEMORY_BYTES(mips) + lineBytes - 1) / lineBytes;
+	bus->lineStats = calloc(bus->lines, sizeof(LineStats));
+	if (bus->lineStats == NULL)
+	{
+		free(bus);
+		return NULL;
+	}
+	pthread_mutex_init(&bus->lock, NULL);
+	return bus;
+}
+
+/*
+ *  Give mips a private L1 on bus, cold. Returns SIM_NO_MEMORY if there
+ *  is no memory for it, else SIM_OK.
+ */
+int AttachL1(Coherence *bus, Computer *mips)
+{
+	L1 *c, **cores;
+
+	c = calloc(1, sizeof(L1));
+	if (c == NULL)
+	{
+		return SIM_NO_MEMORY;
+	}
+	c->ways = calloc((size_t)bus->sets * bus->ways, sizeof(Way));
+	c->lost = calloc(bus->lines, 1);
+	cores = realloc(bus->cores, (bus->ncores + 1) * sizeof(L1 *));
+	if (c->ways == NULL || c->lost == NULL || cores == NULL)
+	{
+		free(c->ways);
+		free(c->lost);
+		free(c);
+		if (cores != NULL)
+			bus->cores = cores;
+		return SIM_NO_MEMORY;
+	}
+	bus->cores = cores;
+	bus->cores[bus->ncores++] = c;
+	c->bus = bus;
+	c->mips = mips;
+	mips->l1 = c;
+	return SIM_OK;
+}
+
+/*
+ *  Return c's way holding line, or NULL if it is not valid in c.
+ */
+static Way *Lookup(L1 *c, int line)
+{
+	Way *w = &c->ways[(line % c->bus->sets) * c->bus->ways];
+	int k;
+
+	for (k = 0; k < c->bus->ways; k++, w++)
+	{
+		if (w->state != INVALID && w->line == line)
+		{
+			return w;
+		}
+	}
+	return NULL;
+}
+
+/*
+ *  Make room for line in c, writing back the line it replaces, and
+ *  return the way to fill.
+ */
+static Way *Victim(L1 *c, int line)
+{
+	Way *set = &c->ways[(line % c->bus->sets) * c->bus->ways], *w = set;
+	int k;
+
+	for (k = 1; k < c->bus->ways && w->state != INVALID; k++)
+	{
+		if (set[k].state == INVALID || set[k].used < w->used)
+		{
+			w = &set[k];
+		}
+	}
+	if (w->state != INVALID)
+	{
+		if (w->state == MODIFIED)
+		{
+			c->stats.writebacks++;
+		}
+		c->lost[w->line] = EVICTED;
+	}
+	return w;
+}
+
+/*
+ *  Take line away from every cache but c, because c is writing word of
+ *  it. Returns how many copies there were.
+ */
+static int InvalidateOthers(L1 *c, int line, int word)
+{
+	Coherence *bus = c->bus;
+	Way *w;
+	int k, copies = 0;
+
+	for (k = 0; k < bus->ncores; k++)
+	{
+		if (bus->cores[k] == c || (w = Lookup(bus->cores[k], line)) == NULL)
+		{
+			continue;
+		}
+		if (w->state == MODIFIED)
+		{
+			bus->cores[k]->stats.writebacks++;
+		}
+		if ((w->touched & 1u << word) == 0)
+		{
+			bus->lineStats[line].falseSharing++;
+		}
+		w->state = INVALID;
+		bus->cores[k]->lost[line] = INVALIDATED;
+		bus->cores[k]->stats.invalidations++;
+		bus->lineStats[line].invalidations++;
+		copies++;
+	}
+	return copies;
+}
+
+/*
+ *  Demote every other copy of line to Shared for a read by c. Returns
+ *  how many copies there were.
+ */
+static int ShareOthers(L1 *c, int line)
+{
+	Coherence *bus = c->bus;
+	Way *w;
+	int k, copies = 0;
+
+	for (k = 0; k < bus->ncores; k++)
+	{
+		if (bus->cores[k] == c || (w = Lookup(bus->cores[k], line)) == NULL)
+		{
+			continue;
+		}
+		if (w->state == MODIFIED)
+		{
+			bus->cores[k]->stats.writebacks++;
+		}
+		w->state = SHARED;
+		copies++;
+	}
+	return copies;
+}
+
+/*
+ *  Run a data access by mips to addr, a write if write is set, through
+ *  its L1. addr must be in memory and word-aligned.
+ */
+void CacheAccess(Computer *mips, int addr, int write)
+{
+	L1 *c = mips->l1;
+	Coherence *bus = c->bus;
+	int offset = addr - TEXT_BASE;
+	int line = offset / bus->lineBytes, word = offset % bus->lineBytes / 4;
+	Way *w;
+
+	pthread_mutex_lock(&bus->lock);
+	c->clock++;
+	if (write)
+		c->stats.writes++;
+	else
+		c->stats.reads++;
+
+	w = Lookup(c, line);
+	if (w != NULL)
+	{
+		c->stats.hits++;
+		c->stats.cycles += HIT_CYCLES;
+		if (write && w->state == SHARED)
+		{
+			/* Upgrade: nothing to transfer, but the others lose their copies */
+			InvalidateOthers(c, line, word);
+			bus->transactions++;
+			c->stats.upgrades++;
+			c->stats.cycles += UPGRADE_CYCLES;
+		}
+		if (write)
+		{
+			w->state = MODIFIED;
+		}
+	}
+	else
+	{
+		switch (c->lost[line])
+		{
+		case NEVER_HELD:
+			c->stats.coldMisses++;
+			break;
+		case EVICTED:
+			c->stats.capacityMisses++;
+			break;
+		default:
+			c->stats.coherenceMisses++;
+			bus->lineStats[line].coherenceMisses++;
+			break;
+		}
+		bus->transactions++;
+		w = Victim(c, line);
+		if (write ? InvalidateOthers(c, line, word) : ShareOthers(c, line))
+		{
+			c->stats.transfers++;
+			c->stats.cycles += TRANSFER_CYCLES;
+			w->state = write ? MODIFIED : SHARED;
+		}
+		else
+		{
+			c->stats.cycles += MEMORY_CYCLES;
+			w->state = write ? MODIFIED : EXCLUSIVE;
+		}
+		w->line = line;
+		w->touched = 0;
+	}
+	w->used = c->clock;
+	w->touched |= 1u << word;
+	pthread_mutex_unlock(&bus->lock);
+}
+
+static int ByTraffic(const void *a, const void *b)
+{
+	const Hotspot *x = a, *y = b;
+	unsigned long tx = x->stats.invalidations + x->stats.coherenceMisses;
+	unsigned long ty = y->stats.invalidations + y->stats.coherenceMisses;
+
+	return tx != ty ? (tx < ty ? 1 : -1) : x->line - y->line;
+}
+
+/*
+ *  Print what every core's L1 did and the lines with the most
+ *  coherence traffic to out. Returns SIM_NO_MEMORY if there was no
+ *  memory to rank the lines, else SIM_OK.
+ */
+int PrintCoherence(Coherence *bus, FILE *out)
+{
+	CoreStats *s;
+	Hotspot *spots;
+	int k, n = 0;
+
+	fprintf(out, "L1: %d sets, %d ways, %d-byte lines\n", bus->sets, bus->ways, bus->lineBytes);
+	for (k = 0; k < bus->ncores; k++)
+	{
+		s = &bus->cores[k]->stats;
+		fprintf(out, "Core %d: %lu reads, %lu writes, %lu hits, %lu misses "
+								 "(%lu cold, %lu capacity, %lu coherence)\n",
+						k, s->reads, s->writes, s->hits,
+						s->coldMisses + s->capacityMisses + s->coherenceMisses,
+						s->coldMisses, s->capacityMisses, s->coherenceMisses);
+		fprintf(out, "        %lu upgrades, %lu cache-to-cache transfers, %lu writebacks, "
+								 "%lu invalidations received, %lu cycles\n",
+						s->upgrades, s->transfers, s->writebacks, s->invalidations, s->cycles);
+	}
+	fprintf(out, "Bus transactions: %lu\n", bus->transactions);
+
+	spots = malloc(bus->lines * sizeof(Hotspot));
+	if (spots == NULL)
+	{
+		return SIM_NO_MEMORY;
+	}
+	for (k = 0; k < bus->lines; k++)
+	{
+		if (bus->lineStats[k].invalidations + bus->lineStats[k].coherenceMisses > 0)
+		{
+			spots[n].line = k;
+			spots[n++].stats = bus->lineStats[k];
+		}
+	}
+	qsort(spots, n, sizeof(Hotspot), ByTraffic);
+	fprintf(out, "Coherence hotspots\nLINE\t  INVALIDATIONS\tFALSE SHARING\tCOHERENCE MISSES\n");
+	for (k = 0; k < n && k < HOTSPOTS; k++)
+	{
+		fprintf(out, "%8.8x  %lu\t\t%lu\t\t%lu\n", TEXT_BASE + spots[k].line * bus->lineBytes,
+						spots[k].stats.invalidations, spots[k].stats.falseSharing,
+						spots[k].stats.coherenceMisses);
+	}
+	free(spots);
+	return SIM_OK;
+}
+
+/*
+ *  Free bus and every L1 on it, detaching them from their machines.
+ */
+void FreeCoherence(Coherence *bus)
+{
+	int k;
+
+	if (bus != NULL)
+	{
+		for (k = 0; k < bus->ncores; k++)
+		{
+			bus->cores[k]->mips->l1 = NULL;
+			free(bus->cores[k]->ways);
+			free(bus->cores[k]->lost);
+			free(bus->cores[k]);
+		}
+		pthread_mutex_destroy(&bus->lock);
+		free(bus->cores);
+		free(bus->lineStats);
+		free(bus);
+	}
+}
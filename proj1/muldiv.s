@@ -0,0 +1,27 @@
+# Each multiply and divide, read back from HI and LO at once, two
+# instructions later and after mthi/mtlo, so with sim -L 4,12 the run
+# stalls 3 + 1 + 11 + 11 = 26 cycles.
+#
+
+		.text
+		addi	$t0,$0,-6
+		addiu	$t1,$0,4
+		mult	$t0,$t1
+		mflo	$t2		# -24, stalls 3
+		mfhi	$t3		# -1
+		multu	$t0,$t1
+		addiu	$t4,$0,1
+		addiu	$t4,$t4,1
+		mflo	$t5		# 0xffffffe8, stalls 1
+		mfhi	$t6		# 3
+		div	$t0,$t1
+		mflo	$t7		# -1, stalls 11
+		mfhi	$s0		# -2
+		divu	$t0,$t1
+		mflo	$s1		# 0x3ffffffe, stalls 11
+		mfhi	$s2		# 2
+		mthi	$t1
+		mtlo	$t0
+		mfhi	$s3		# 4
+		mflo	$s4		# -6
+		syscall		#unsupported instruction, terminate
@@ -0,0 +1,285 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include "computer.h"
+#undef mips /* gcc already has a def for mips */
+
+/*
+	Machine pools.
+
+	A pool hands out machines that all start from one loaded program.
+	The program's memory is written once to an anonymous file, and each
+	machine maps that file copy-on-write over its memory array, so it
+	shares the image's pages until it stores to one. Giving a machine
+	back maps the image over it again: the kernel drops the pages the
+	run copied and nothing else is touched, so a reset costs time in
+	proportion to the pages the run wrote, not the size of memory.
+
+	Nothing ever stores into the text segment, so the decodings and
+	translations a machine builds stay good from one run to the next.
+
+	Only the image's nonzero pages are written or copied anywhere; the
+	rest of a large memory stays unallocated in every machine. If there
+	is no anonymous file, machines copy the image back instead.
+*/
+
+struct Pool
+{
+	pthread_mutex_t lock;
+	Computer *image; /* the program as loaded, with its settings */
+	size_t bytes;		 /* its memory, in whole pages */
+	int fd;					 /* the memory image, or -1 to copy it */
+	Computer **idle; /* machines ready to hand out */
+	int nidle, size;
+};
+
+/*
+ *  Put mips back the way the image was loaded.
+ */
+static int ResetComputer(Pool *pool, Computer *mips)
+{
+	Computer *image = pool->image;
+
+	if (pool->fd >= 0)
+	{
+		if (mmap(mips->memory, pool->bytes, PROT_READ | PROT_WRITE,
+						 MAP_PRIVATE | MAP_FIXED, pool->fd, 0) == MAP_FAILED)
+		{
+			return SIM_NO_MEMORY;
+		}
+	}
+	else
+	{
+		memcpy(mips->memory, image->memory, MEMORY_BYTES(image));
+	}
+	/* The trace is bound to the last run's output; the next run makes its own */
+	FreeTrace(mips);
+	memcpy(mips->registers, image->registers, sizeof(mips->registers));
+	mips->hi = image->hi;
+	mips->lo = image->lo;
+	mips->pc = image->pc;
+	mips->entry = image->entry;
+	mips->printingRegisters = image->printingRegisters;
+	mips->printingMemory = image->printingMemory;
+	mips->interactive = image->interactive;
+	mips->debugging = image->debugging;
+	mips->out = image->out;
+	mips->budget = image->budget;
+	mips->timeLimit = image->timeLimit;
+	mips->mulLatency = image->mulLatency;
+	mips->divLatency = image->divLatency;
+	mips->retired = 0;
+	mips->linked = 0;
+	return SIM_OK;
+}
+
+/*
+ *  Return a new machine reset to the image, or NULL if there is no
+ *  memory for one.
+ */
+static Computer *MakeComputer(Pool *pool)
+{
+	Computer *mips = NewComputer();
+
+	if (mips != NULL && (mips->textWords != pool->image->textWords ||
+											 mips->dataWords != pool->image->dataWords) &&
+			SetMemorySize(mips, pool->image->textWords, pool->image->dataWords) != SIM_OK)
+	{
+		FreeComputer(mips);
+		return NULL;
+	}
+	if (mips != NULL && pool->image->guarded &&
+			GuardMemory(mips, pool->image->hugePages) != SIM_OK)
+	{
+		FreeComputer(mips);
+		return NULL;
+	}
+	if (mips != NULL && ResetComputer(pool, mips) != SIM_OK)
+	{
+		FreeComputer(mips);
+		return NULL;
+	}
+	return mips;
+}
+
+/*
+ *  Add mips to the idle machines. Returns 0 if there is no room.
+ */
+static int Park(Pool *pool, Computer *mips)
+{
+	Computer **idle;
+	int ok = 1;
+
+	pthread_mutex_lock(&pool->lock);
+	if (pool->nidle == pool->size)
+	{
+		idle = realloc(pool->idle, (2 * pool->size + 4) * sizeof(Computer *));
+		if (idle != NULL)
+		{
+			pool->idle = idle;
+			pool->size = 2 * pool->size + 4;
+		}
+		ok = idle != NULL;
+	}
+	if (ok)
+	{
+		pool->idle[pool->nidle++] = mips;
+	}
+	pthread_mutex_unlock(&pool->lock);
+	return ok;
+}
+
+/*
+ *  Copy the pages of image's memory that are not all zero into to, and
+ *  into fd if it is not -1. Returns 0 if fd could not be written.
+ */
+static int CopyPages(Computer *image, int *to, int fd, size_t page)
+{
+	const char *from = (const char *)image->memory;
+	size_t bytes = MEMORY_BYTES(image), at, n, k;
+
+	for (at = 0; at < bytes; at += n)
+	{
+		n = bytes - at < page ? bytes - at : page;
+		for (k = 0; k < n && from[at + k] == 0; k++)
+			;
+		if (k == n)
+		{
+			continue;
+		}
+		memcpy((char *)to + at, from + at, n);
+		if (fd >= 0 && pwrite(fd, from + at, n, at) != (ssize_t)n)
+		{
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/*
+ *  Return a pool of machines starting from the program loaded in
+ *  image, with n of them made up front, or NULL if there is no memory
+ *  for it. The pool keeps its own copy of image.
+ */
+Pool *NewPool(Computer *image, int n)
+{
+	Pool *pool = calloc(1, sizeof(Pool));
+	long page = sysconf(_SC_PAGESIZE);
+	Computer *mips;
+	int k;
+
+	if (pool == NULL)
+	{
+		return NULL;
+	}
+	pthread_mutex_init(&pool->lock, NULL);
+	pool->image = malloc(sizeof(Computer));
+	if (pool->image == NULL)
+	{
+		free(pool);
+		return NULL;
+	}
+	memcpy(pool->image, image, sizeof(Computer));
+	pool->image->engine = NULL;
+	pool->image->trace = NULL;
+	pool->image->l1 = NULL;
+	pool->image->parent = NULL;
+	pool->image->decoded = NULL;
+	pool->image->decodedVals = NULL;
+	pool->image->decodedValid = NULL;
+	pool->image->nonzero = NULL;
+	if (page <= 0)
+	{
+		page = 4096;
+	}
+	pool->bytes = (MEMORY_BYTES(image) + page - 1) / page * page;
+	pool->image->memory = MapTable(pool->bytes);
+	if (pool->image->memory == NULL)
+	{
+		free(pool->image);
+		free(pool);
+		return NULL;
+	}
+
+	pool->fd = memfd_create("mips-image", MFD_CLOEXEC);
+	if (pool->fd >= 0 && ftruncate(pool->fd, pool->bytes) != 0)
+	{
+		close(pool->fd);
+		pool->fd = -1;
+	}
+	if (!CopyPages(image, pool->image->memory, pool->fd, page))
+	{
+		close(pool->fd);
+		pool->fd = -1;
+	}
+
+	for (k = 0; k < n; k++)
+	{
+		mips = MakeComputer(pool);
+		if (mips == NULL || !Park(pool, mips))
+		{
+			if (mips != NULL)
+				FreeComputer(mips);
+			FreePool(pool);
+			return NULL;
+		}
+	}
+	return pool;
+}
+
+/*
+ *  Return a machine with the pool's program loaded and the settings it
+ *  was loaded with, making one if none is idle. NULL if there is no
+ *  memory for one. Give it back with GiveComputer().
+ */
+Computer *TakeComputer(Pool *pool)
+{
+	Computer *mips = NULL;
+
+	pthread_mutex_lock(&pool->lock);
+	if (pool->nidle > 0)
+	{
+		mips = pool->idle[--pool->nidle];
+	}
+	pthread_mutex_unlock(&pool->lock);
+	return mips != NULL ? mips : MakeComputer(pool);
+}
+
+/*
+ *  Reset mips and keep it for the next TakeComputer().
+ */
+void GiveComputer(Pool *pool, Computer *mips)
+{
+	if (ResetComputer(pool, mips) != SIM_OK || !Park(pool, mips))
+	{
+		FreeComputer(mips);
+	}
+}
+
+/*
+ *  Free pool and its machines. Every machine taken must have been
+ *  given back.
+ */
+void FreePool(Pool *pool)
+{
+	if (pool != NULL)
+	{
+		while (pool->nidle > 0)
+		{
+			FreeComputer(pool->idle[--pool->nidle]);
+		}
+		if (pool->fd >= 0)
+		{
+			close(pool->fd);
+		}
+		pthread_mutex_destroy(&pool->lock);
+		free(pool->idle);
+		UnmapTable(pool->image->memory, pool->bytes);
+		free(pool->image);
+		free(pool);
+	}
+}
@@ -0,0 +1,124 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "computer.h"
+#undef mips /* gcc already has a def for mips */
+
+/*
+	Binary trace renderer.
+
+	Usage: render [-r] [-m] trace.bin
+
+	Turns a trace written by sim -b back into the text sim prints with
+	the same -r and -m options, on a machine of the memory size the
+	trace was made with. Registers and the data segment start as the
+	trace says the program was loaded, and the text segment starts out
+	zero; TraceReplay() puts each record's
+	instruction word back at its pc and applies the changes it lists,
+	so the text is formatted from the same machine state as in sim.
+*/
+
+static int ReadRecord(FILE *in, TraceRecord *r)
+{
+	return fread(r, sizeof(*r), 1, in) == 1;
+}
+
+int main(int argc, char *argv[])
+{
+	Computer *mips;
+	FILE *in, *empty;
+	TraceRecord rec, next;
+	char magic[8];
+	int segments[2], pair[2], status;
+	int printingRegisters = 0, printingMemory = 0;
+	int argIndex;
+
+	for (argIndex = 1; argIndex < argc && argv[argIndex][0] == '-'; argIndex++)
+	{
+		if (strcmp(argv[argIndex], "-r") == 0)
+			printingRegisters = 1;
+		else if (strcmp(argv[argIndex], "-m") == 0)
+			printingMemory = 1;
+		else
+			break;
+	}
+	if (argIndex != argc - 1)
+	{
+		fprintf(stderr, "Usage: render [-r] [-m] trace.bin\n");
+		exit(1);
+	}
+	in = fopen(argv[argIndex], "rb");
+	if (in == NULL)
+	{
+		fprintf(stderr, "Can't open file: %s\n", argv[argIndex]);
+		exit(1);
+	}
+	if (fread(magic, 8, 1, in) != 1 || memcmp(magic, TRACE_MAGIC, 8) != 0 ||
+			fread(segments, sizeof(segments), 1, in) != 1)
+	{
+		fprintf(stderr, "Not a binary trace: %s\n", argv[argIndex]);
+		exit(1);
+	}
+
+	/* Start from an empty program, so only traced words are in memory */
+	empty = fopen("/dev/null", "r");
+	if (empty == NULL)
+	{
+		fprintf(stderr, "Can't open file: /dev/null\n");
+		exit(1);
+	}
+	mips = NewComputer();
+	status = mips != NULL ? SetMemorySize(mips, segments[0], segments[1]) : SIM_NO_MEMORY;
+	if (status == SIM_TOO_BIG)
+	{
+		fprintf(stderr, "Bad memory size in trace: %s\n", argv[argIndex]);
+		exit(1);
+	}
+	if (status != SIM_OK || InitComputer(mips, empty, printingRegisters, printingMemory, 0, 0) != SIM_OK ||
+			TraceReset(mips) != SIM_OK)
+	{
+		fprintf(stderr, "Out of memory.\n");
+		exit(1);
+	}
+	fclose(empty);
+	if (fread(mips->registers, sizeof(mips->registers), 1, in) != 1 ||
+			fread(&mips->hi, sizeof(int), 1, in) != 1 || fread(&mips->lo, sizeof(int), 1, in) != 1)
+	{
+		fprintf(stderr, "Not a binary trace: %s\n", argv[argIndex]);
+		exit(1);
+	}
+	while (fread(pair, sizeof(pair), 1, in) == 1 && pair[0] != 0)
+	{
+		if (BAD_DATA_ADDR(mips, pair[0]))
+		{
+			fprintf(stderr, "Bad data address in trace: %s\n", argv[argIndex]);
+			exit(1);
+		}
+		mips->memory[(pair[0] - TEXT_BASE) / 4] = pair[1];
+		MarkNonzero(mips, pair[0]);
+	}
+
+	if (!ReadRecord(in, &rec))
+	{
+		exit(0);
+	}
+	while (!TRACE_STOPS(rec.how) && ReadRecord(in, &next))
+	{
+		TraceReplay(mips, &rec, &next);
+		rec = next;
+	}
+	if (TRACE_STOPS(rec.how))
+	{
+		TraceReplay(mips, &rec, NULL);
+	}
+	else
+	{
+		TraceFlush(mips);
+		fprintf(stderr, "Trace ends in the middle of a step.\n");
+		exit(1);
+	}
+	TraceFlush(mips);
+	fclose(in);
+	FreeComputer(mips);
+	return 0;
+}
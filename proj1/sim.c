@@ -1,24 +1,228 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <dlfcn.h>
 #include "computer.h"
 
 #define TRUE 1
 #define FALSE 0
 
+/*
+ *  dlopen a translation made by aot and hand it to the threaded engine.
+ */
+static void LoadTranslation (Computer *mips, char *file) {
+    void *handle;
+    Translation run;
+    const unsigned int *text;
+    const int *words, *segments;
+
+    handle = dlopen (file, RTLD_NOW);
+    if (handle == NULL) {
+        fprintf (stderr, "Can't load translation: %s\n", dlerror ());
+        exit (1);
+    }
+    run = (Translation) dlsym (handle, "AotRun");
+    text = dlsym (handle, "AotText");
+    words = dlsym (handle, "AotTextWords");
+    segments = dlsym (handle, "AotSegments");
+    if (run == NULL || text == NULL || words == NULL || segments == NULL) {
+        fprintf (stderr, "Not a translation: %s\n", file);
+        exit (1);
+    }
+    if (!UseTranslation (mips, run, text, *words, segments)) {
+        fprintf (stderr, "Translation %s was made from a different program or memory size.\n", file);
+        exit (1);
+    }
+}
+
+/*
+ *  Parse the argument of -s, reg=value,value,..., into values[reg],
+ *  setting *regp to reg and returning how many values it lists.
+ */
+static int ParseSweep (char *arg, long *values[32], int *regp) {
+    char *p, *end;
+    int reg, n = 0;
+
+    reg = strtol (arg, &end, 10);
+    if (end == arg || *end != '=' || reg < 0 || reg > 31) {
+        fprintf (stderr, "Bad register sweep \"%s\", expected reg=value,value,...\n", arg);
+        exit (1);
+    }
+    *regp = reg;
+    free (values[reg]);
+    values[reg] = malloc ((strlen (end) / 2 + 1) * sizeof (long));
+    if (values[reg] == NULL) {
+        fprintf (stderr, "Out of memory.\n");
+        exit (1);
+    }
+    for (p = end + 1; ; p = end + 1) {
+        values[reg][n++] = strtol (p, &end, 0);
+        if (end == p || (*end != ',' && *end != '\0')) {
+            fprintf (stderr, "Bad register sweep \"%s\", expected reg=value,value,...\n", arg);
+            exit (1);
+        }
+        if (*end == '\0') {
+            return n;
+        }
+    }
+}
+
+/*
+ *  Run one copy of the program in mips for each set of register values
+ *  in a sweep of lanes, side by side, and print how each one ended.
+ */
+static int RunSweep (Computer *mips, long *values[32], int *counts, int lanes) {
+    Computer **machines;
+    Pool *pool;
+    char **text;
+    size_t *size;
+    int *status;
+    int k, reg, result = SIM_OK;
+
+    pool = NewPool (mips, 0);
+    machines = calloc (lanes, sizeof (Computer *));
+    text = calloc (lanes, sizeof (char *));
+    size = calloc (lanes, sizeof (size_t));
+    status = calloc (lanes, sizeof (int));
+    if (pool == NULL || machines == NULL || text == NULL || size == NULL || status == NULL) {
+        return SIM_NO_MEMORY;
+    }
+    for (k = 0; k < lanes; k++) {
+        machines[k] = TakeComputer (pool);
+        if (machines[k] == NULL) {
+            return SIM_NO_MEMORY;
+        }
+        for (reg = 0; reg < 32; reg++) {
+            if (values[reg] != NULL) {
+                machines[k]->registers[reg] = values[reg][counts[reg] == 1 ? 0 : k];
+            }
+        }
+        machines[k]->out = open_memstream (&text[k], &size[k]);
+        if (machines[k]->out == NULL) {
+            return SIM_NO_MEMORY;
+        }
+    }
+    if (SimulateLanes (machines, lanes, status) != SIM_OK) {
+        return SIM_NO_MEMORY;
+    }
+    for (k = 0; k < lanes; k++) {
+        fclose (machines[k]->out);
+        printf ("Lane %d:", k + 1);
+        for (reg = 0; reg < 32; reg++) {
+            if (values[reg] != NULL) {
+                printf (" $%d=%ld", reg, values[reg][counts[reg] == 1 ? 0 : k]);
+            }
+        }
+        printf ("\n");
+        fwrite (text[k], 1, size[k], stdout);
+        free (text[k]);
+        if (status[k] == SIM_NO_MEMORY) {
+            result = SIM_NO_MEMORY;
+        }
+        machines[k]->out = stdout;
+        GiveComputer (pool, machines[k]);
+    }
+    FreePool (pool);
+    free (machines);
+    free (text);
+    free (size);
+    free (status);
+    return result;
+}
+
+/*
+ *  Run the program in mips on harts cores over its memory, hart k
+ *  starting with $26 = k and $27 = harts, and print how each one ended.
+ *  With a bus, every hart gets an L1 on it.
+ */
+static int RunHarts (Computer *mips, int harts, unsigned long quantum, int compiling, Coherence *bus) {
+    Computer **cores;
+    char **text;
+    size_t *size;
+    int *status;
+    int k, result;
+
+    cores = calloc (harts, sizeof (Computer *));
+    text = calloc (harts, sizeof (char *));
+    size = calloc (harts, sizeof (size_t));
+    status = calloc (harts, sizeof (int));
+    if (cores == NULL || text == NULL || size == NULL || status == NULL) {
+        return SIM_NO_MEMORY;
+    }
+    for (k = 0; k < harts; k++) {
+        cores[k] = k == 0 ? mips : NewHart (mips);
+        if (cores[k] == NULL) {
+            return SIM_NO_MEMORY;
+        }
+        if (bus != NULL && AttachL1 (bus, cores[k]) != SIM_OK) {
+            return SIM_NO_MEMORY;
+        }
+        cores[k]->registers[26] = k;
+        cores[k]->registers[27] = harts;
+        cores[k]->out = open_memstream (&text[k], &size[k]);
+        if (cores[k]->out == NULL) {
+            return SIM_NO_MEMORY;
+        }
+    }
+    result = SimulateHarts (cores, harts, quantum, compiling, status);
+    for (k = 0; k < harts; k++) {
+        fclose (cores[k]->out);
+        printf ("Hart %d:\n", k);
+        fwrite (text[k], 1, size[k], stdout);
+        free (text[k]);
+        if (status[k] == SIM_NO_MEMORY) {
+            result = SIM_NO_MEMORY;
+        }
+        cores[k]->out = stdout;
+        if (k > 0) {
+            FreeComputer (cores[k]);
+        }
+    }
+    free (cores);
+    free (text);
+    free (size);
+    free (status);
+    return result;
+}
+
 int main (int argc, char *argv[]) {
     int argIndex;
     int printingRegisters = FALSE;
     int printingMemory = FALSE;
     int debugging = FALSE;
     int interactive = FALSE;
-    FILE *filein;
+    int threaded = FALSE;
+    int compiling = FALSE;
+    int quiet = FALSE;
+    char *translationFile = NULL;
+    char *cacheDir = NULL;
+    char *traceFile = NULL;
+    char *saveFile = NULL, *restoreFile = NULL;
+    unsigned long saveAt = ULONG_MAX;
+    int savePc = -1;
+    long *sweep[32] = {NULL};
+    int counts[32] = {0};
+    int lanes = 0, reg, n;
+    int harts = 0;
+    unsigned long quantum = 0;
+    char *end;
+    int sets = 0, ways = 0, lineBytes = 0;
+    int textWords = MAXNUMINSTRS, dataWords = MAXNUMDATA;
+    int guard = 0;
+    int mulLatency = -1, divLatency = -1;
+    char extra;
+    Coherence *bus = NULL;
+    FILE *filein, *traceOut = NULL;
+    Computer *mips;
+    int status;
 
     if (argc < 2) {
         fprintf (stderr, "Not enough arguments.\n");
         exit (1);
     }
     for (argIndex=1; argIndex<argc && argv[argIndex][0]=='-'; argIndex++) {
-        /* Argument is an option, we hope one of -r, -m, -i, -d. */
+        /* Argument is an option, we hope one of -r, -m, -i, -d, -f, -j, -q, -a, -c, -b, -s, -p, -l, -L, -M, -g, -G, -S, -R. */
         switch (argv[argIndex][1]) {
             case 'r':
             printingRegisters = TRUE;
@@ -32,28 +236,337 @@ int main (int argc, char *argv[]) {
             case 'd':
             debugging = TRUE;
             break;
+            case 'f':
+            threaded = TRUE;
+            break;
+            case 'j':
+            threaded = TRUE;
+            compiling = TRUE;
+            break;
+            case 'q':
+            threaded = TRUE;
+            quiet = TRUE;
+            break;
+            case 'a':
+            if (argIndex+1 == argc) {
+                fprintf (stderr, "No translation given for -a.\n");
+                exit (1);
+            }
+            threaded = TRUE;
+            translationFile = argv[++argIndex];
+            break;
+            case 'c':
+            if (argIndex+1 == argc) {
+                fprintf (stderr, "No cache directory given for -c.\n");
+                exit (1);
+            }
+            threaded = TRUE;
+            cacheDir = argv[++argIndex];
+            break;
+            case 'b':
+            if (argIndex+1 == argc) {
+                fprintf (stderr, "No trace file given for -b.\n");
+                exit (1);
+            }
+            threaded = TRUE;
+            traceFile = argv[++argIndex];
+            break;
+            case 's':
+            if (argIndex+1 == argc) {
+                fprintf (stderr, "No register sweep given for -s.\n");
+                exit (1);
+            }
+            argIndex++;
+            n = ParseSweep (argv[argIndex], sweep, &reg);
+            counts[reg] = n;
+            if (lanes > 1 && counts[reg] > 1 && counts[reg] != lanes) {
+                fprintf (stderr, "Every -s must give the same number of values, or one.\n");
+                exit (1);
+            }
+            if (counts[reg] > lanes) {
+                lanes = counts[reg];
+            }
+            break;
+            case 'p':
+            if (argIndex+1 == argc) {
+                fprintf (stderr, "No hart count given for -p.\n");
+                exit (1);
+            }
+            argIndex++;
+            harts = strtol (argv[argIndex], &end, 10);
+            if (*end == ',') {
+                quantum = strtoul (end + 1, &end, 10);
+            }
+            if (harts < 1 || *end != '\0') {
+                fprintf (stderr, "Bad hart count \"%s\", expected harts[,quantum]\n", argv[argIndex]);
+                exit (1);
+            }
+            break;
+            case 'l':
+            if (argIndex+1 == argc) {
+                fprintf (stderr, "No cache shape given for -l.\n");
+                exit (1);
+            }
+            argIndex++;
+            if (sscanf (argv[argIndex], "%d,%d,%d%c", &sets, &ways, &lineBytes, &extra) != 3) {
+                fprintf (stderr, "Bad cache shape \"%s\", expected sets,ways,lineBytes\n", argv[argIndex]);
+                exit (1);
+            }
+            break;
+            case 'L':
+            if (argIndex+1 == argc) {
+                fprintf (stderr, "No latencies given for -L.\n");
+                exit (1);
+            }
+            argIndex++;
+            if (sscanf (argv[argIndex], "%d,%d%c", &mulLatency, &divLatency, &extra) != 2 ||
+                mulLatency < 0 || divLatency < 0) {
+                fprintf (stderr, "Bad latencies \"%s\", expected mul,div\n", argv[argIndex]);
+                exit (1);
+            }
+            break;
+            case 'g':
+            guard = 1;
+            break;
+            case 'G':
+            guard = 2;
+            break;
+            case 'M':
+            if (argIndex+1 == argc) {
+                fprintf (stderr, "No memory size given for -M.\n");
+                exit (1);
+            }
+            argIndex++;
+            if (sscanf (argv[argIndex], "%d,%d%c", &textWords, &dataWords, &extra) != 2 ||
+                textWords <= 0 || dataWords <= 0) {
+                fprintf (stderr, "Bad memory size \"%s\", expected text,data\n", argv[argIndex]);
+                exit (1);
+            }
+            break;
+            case 'S':
+            if (argIndex+1 == argc) {
+                fprintf (stderr, "No checkpoint given for -S.\n");
+                exit (1);
+            }
+            argIndex++;
+            /* Stop after a number of instructions, or at @pc */
+            if (argv[argIndex][0] == '@') {
+                savePc = strtoul (argv[argIndex] + 1, &end, 0);
+                n = end != argv[argIndex] + 1;
+            } else {
+                saveAt = strtoul (argv[argIndex], &end, 10);
+                n = end != argv[argIndex];
+            }
+            if (!n || *end != ',' || end[1] == '\0') {
+                fprintf (stderr, "Bad checkpoint \"%s\", expected count,file or @pc,file\n", argv[argIndex]);
+                exit (1);
+            }
+            saveFile = end + 1;
+            break;
+            case 'R':
+            if (argIndex+1 == argc) {
+                fprintf (stderr, "No checkpoint given for -R.\n");
+                exit (1);
+            }
+            restoreFile = argv[++argIndex];
+            break;
             default:
             fprintf (stderr, "Invalid option \"%s\".\n", argv[argIndex]);
-            fprintf (stderr, "Correct options are -r, -m, -i, -d.\n");
+            fprintf (stderr, "Correct options are -r, -m, -i, -d, -f, -j, -q, -a file.so, -c dir, -b file, -s reg=values, -p harts[,quantum], -l sets,ways,lineBytes, -L mul,div, -M text,data, -g, -G, -S count,file, -S @pc,file, -R file.\n");
             exit (1);
         }
     }
-    if (argIndex == argc) {
+    if (argIndex == argc && restoreFile == NULL) {
         fprintf (stderr, "No file name given.\n");
         exit (1);
-    } else if (argIndex < argc-1) {
+    } else if (argIndex < argc - (restoreFile == NULL)) {
         fprintf (stderr, "Too many arguments.\n");
         exit (1);
     }
-    
-    filein = fopen (argv[argIndex], "r");
-    if (filein == NULL) {
-        fprintf (stderr, "Can't open file: %s\n", argv[argIndex]);
+    if ((saveFile != NULL || restoreFile != NULL) && (interactive || lanes > 1 || harts > 0)) {
+        fprintf (stderr, "-S and -R can't be used with -i, -p or a register sweep.\n");
+        exit (1);
+    }
+    if (saveFile != NULL && traceFile != NULL) {
+        fprintf (stderr, "-S can't be used with -b.\n");
         exit (1);
     }
     
-    InitComputer (filein, printingRegisters, printingMemory,
-	debugging, interactive);
-    Simulate ();
+    /* A restored machine needs no program: its text is in the checkpoint */
+    filein = NULL;
+    if (restoreFile == NULL) {
+        filein = fopen (argv[argIndex], "r");
+        if (filein == NULL) {
+            fprintf (stderr, "Can't open file: %s\n", argv[argIndex]);
+            exit (1);
+        }
+    }
+    
+    mips = NewComputer ();
+    if (mips == NULL) {
+        fprintf (stderr, "Out of memory.\n");
+        exit (1);
+    }
+    status = SetMemorySize (mips, textWords, dataWords);
+    if (status == SIM_TOO_BIG) {
+        fprintf (stderr, "Memory of %d text and %d data words too big.\n", textWords, dataWords);
+        exit (1);
+    } else if (status != SIM_OK) {
+        fprintf (stderr, "Out of memory.\n");
+        exit (1);
+    }
+    if (guard) {
+        /* Let the host catch the JIT's bad addresses, on huge pages with -G */
+        status = GuardMemory (mips, guard == 2);
+        if (status == SIM_TOO_BIG) {
+            fprintf (stderr, "Guarded memory must end on a page boundary.\n");
+            exit (1);
+        } else if (status != SIM_OK) {
+            fprintf (stderr, "Out of memory.\n");
+            exit (1);
+        }
+    }
+    if (restoreFile != NULL) {
+        status = RestoreCheckpoint (mips, restoreFile);
+        if (status == SIM_FILE_ERROR) {
+            fprintf (stderr, "Can't read checkpoint: %s\n", restoreFile);
+            exit (1);
+        } else if (status == SIM_BAD_CHECKPOINT) {
+            fprintf (stderr, "Not a checkpoint: %s\n", restoreFile);
+            exit (1);
+        } else if (status == SIM_TOO_BIG) {
+            fprintf (stderr, guard ? "Guarded memory must end on a page boundary.\n" : "Memory of checkpoint too big.\n");
+            exit (1);
+        } else if (status != SIM_OK) {
+            fprintf (stderr, "Out of memory.\n");
+            exit (1);
+        }
+        /* Print what the checkpoint was saved with, and whatever is asked for now */
+        mips->printingRegisters |= printingRegisters;
+        mips->printingMemory |= printingMemory;
+        mips->debugging = debugging;
+    } else {
+        status = InitComputer (mips, filein, printingRegisters, printingMemory,
+        debugging, interactive);
+        if (status == SIM_TOO_BIG) {
+            fprintf (stderr, "Program too big.\n");
+            exit (1);
+        } else if (status == SIM_BAD_PROGRAM) {
+            fprintf (stderr, "Not a program: %s\n", argv[argIndex]);
+            exit (1);
+        } else if (status != SIM_OK) {
+            fprintf (stderr, "Out of memory.\n");
+            exit (1);
+        }
+        fclose (filein);
+    }
+    if (mulLatency >= 0) {
+        /* Time the multiply/divide unit, also over a checkpoint's own timing */
+        mips->mulLatency = mulLatency;
+        mips->divLatency = divLatency;
+    }
+    if (sets > 0) {
+        if (lanes > 1) {
+            fprintf (stderr, "-l can't be used with a register sweep.\n");
+            exit (1);
+        }
+        bus = NewCoherence (mips, sets, ways, lineBytes);
+        if (bus == NULL) {
+            fprintf (stderr, "Can't model %d sets of %d ways of %d-byte lines.\n", sets, ways, lineBytes);
+            exit (1);
+        }
+    }
+    if (lanes > 1) {
+        /* Several values: one quiet run per value, side by side */
+        status = RunSweep (mips, sweep, counts, lanes);
+        FreeComputer (mips);
+        if (status == SIM_NO_MEMORY) {
+            fprintf (stderr, "Out of memory.\n");
+            exit (1);
+        }
+        return 0;
+    }
+    for (reg = 0; reg < 32; reg++) {
+        if (sweep[reg] != NULL) {
+            mips->registers[reg] = sweep[reg][0];
+        }
+    }
+    if (harts > 0) {
+        /* Several cores over one memory, untraced like -q */
+        status = RunHarts (mips, harts, quantum, compiling, bus);
+        if (bus != NULL && status != SIM_NO_MEMORY) {
+            status = PrintCoherence (bus, stdout);
+        }
+        FreeCoherence (bus);
+        FreeComputer (mips);
+        if (status == SIM_NO_MEMORY) {
+            fprintf (stderr, "Out of memory.\n");
+            exit (1);
+        }
+        return 0;
+    }
+    if (cacheDir != NULL) {
+        UseTranslationCache (mips, cacheDir);
+    }
+    if (translationFile != NULL) {
+        LoadTranslation (mips, translationFile);
+    }
+    if (traceFile != NULL) {
+        traceOut = fopen (traceFile, "wb");
+        if (traceOut == NULL) {
+            fprintf (stderr, "Can't open file: %s\n", traceFile);
+            exit (1);
+        }
+        status = TraceBinary (mips, traceOut);
+        quiet = FALSE;
+    } else if (threaded && !quiet) {
+        status = TraceAsync (mips);
+    } else {
+        status = SIM_OK;
+    }
+    if (status == SIM_OK && bus != NULL) {
+        status = AttachL1 (bus, mips);
+    }
+    if (status == SIM_OK && saveFile != NULL) {
+        /* Run quietly up to the checkpoint, save it and stop there */
+        status = PauseThreaded (mips, compiling, restoreFile != NULL, saveAt, savePc);
+        if (status == SIM_PAUSED) {
+            if (SaveCheckpoint (mips, saveFile) != SIM_OK) {
+                fprintf (stderr, "Can't write checkpoint: %s\n", saveFile);
+                exit (1);
+            }
+            printf ("Saved checkpoint after %lu instructions at pc %8.8x\n", mips->retired, mips->pc);
+            status = SIM_OK;
+        } else if (status != SIM_NO_MEMORY) {
+            PrintSummary (mips);
+            fprintf (stderr, "Program stopped before the checkpoint.\n");
+            exit (1);
+        }
+    } else if (status == SIM_OK && restoreFile != NULL) {
+        /* Carry on from the checkpoint, printing as from there on */
+        status = ContinueThreaded (mips, !quiet, compiling);
+    } else if (status == SIM_OK) {
+        if (threaded) {
+            status = SimulateThreaded (mips, !quiet, compiling);
+        } else {
+            status = Simulate (mips);
+        }
+    }
+    if (status != SIM_NO_MEMORY && saveFile == NULL && !quiet) {
+        /* Quiet runs report the stalls with the rest of the final state */
+        PrintInterlocks (mips);
+    }
+    if (traceOut != NULL) {
+        fclose (traceOut);
+    }
+    if (bus != NULL && status != SIM_NO_MEMORY) {
+        status = PrintCoherence (bus, stdout);
+    }
+    FreeCoherence (bus);
+    FreeComputer (mips);
+    if (status == SIM_NO_MEMORY) {
+        fprintf (stderr, "Out of memory.\n");
+        exit (1);
+    }
     return 0;
 }
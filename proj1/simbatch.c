@@ -0,0 +1,538 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "computer.h"
+#undef mips /* gcc already has a def for mips */
+
+/*
+	Batch runner.
+
+	Usage: simbatch [-j threads] [-n budget] [-t seconds] manifest
+
+	Each line of the manifest names a job: a .dump file, any of the sim
+	options -r, -m, -f, -j and -q, and the file holding the output the
+	job should print, or - to only run it. Blank lines and lines
+	starting with # are skipped. For example
+
+		sample.dump sample.output
+		sample.dump -q -j sample.final
+
+	Every job runs on a machine of its own, and its output is checked
+	against the expected file as it is printed, so nothing is written
+	anywhere. Each .dump is loaded once, into a pool; a job takes a
+	machine from its program's pool and gives it back, reset, when it
+	is done, so jobs re-running a program do not load it again. The
+	jobs are dealt out to the workers' deques in turn; a worker takes
+	its next job from the bottom of its own deque and, when that is
+	empty, steals from the top of the others', so one slow program
+	does not hold up the ones queued behind it.
+
+	-n stops each job after that many instructions and -t after that
+	many seconds. The report lists the jobs in manifest order, like
+	Grader.sh, and simbatch exits 0 only if every job is correct.
+*/
+
+#define MAXLINE 4096
+
+typedef struct
+{
+	/* From the manifest */
+	char *dump;
+	char *flags;
+	char *expected; /* NULL for - */
+	int printingRegisters, printingMemory;
+	int threaded, compiling, quiet;
+	Pool *pool; /* machines running dump, shared by the jobs that run it */
+
+	/* Filled in by RunJob() */
+	int status;
+	const char *missing; /* a file that could not be read, or NULL */
+	long mismatch; /* first byte that differs from expected, or -1 */
+	size_t printed, wanted;
+	unsigned long retired;
+	double seconds;
+} Job;
+
+/* The work one worker has left; jobs are indices into the job array */
+typedef struct
+{
+	pthread_mutex_t lock;
+	int *jobs;
+	int top, bottom; /* jobs[top..bottom-1] are waiting */
+} Deque;
+
+/* Where a job's output goes: compared with the expected bytes as it comes */
+typedef struct
+{
+	const char *want;
+	size_t wanted;
+	size_t printed;
+	long mismatch;
+} Checker;
+
+static Job *jobs;
+static int njobs;
+static Deque *deques;
+static int nworkers;
+static unsigned long budget;
+static double timeLimit;
+
+static double Now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static ssize_t CheckWrite(void *cookie, const char *buf, size_t size)
+{
+	Checker *c = cookie;
+	size_t k;
+
+	if (c->mismatch < 0 && c->want != NULL)
+	{
+		for (k = 0; k < size; k++)
+		{
+			if (c->printed + k >= c->wanted || buf[k] != c->want[c->printed + k])
+			{
+				c->mismatch = c->printed + k;
+				break;
+			}
+		}
+	}
+	c->printed += size;
+	return size;
+}
+
+/*
+ *  Map file into memory, setting *size. Returns NULL if it can't be
+ *  read; an empty file maps to a pointer that is never read.
+ */
+static const char *MapFile(const char *file, size_t *size)
+{
+	struct stat st;
+	void *map;
+	int fd;
+
+	fd = open(file, O_RDONLY);
+	if (fd < 0)
+	{
+		return NULL;
+	}
+	if (fstat(fd, &st) != 0)
+	{
+		close(fd);
+		return NULL;
+	}
+	*size = st.st_size;
+	if (*size == 0)
+	{
+		close(fd);
+		return "";
+	}
+	map = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	return map == MAP_FAILED ? NULL : map;
+}
+
+/*
+ *  Run job on a machine of its own and record how it went.
+ */
+static void RunJob(Job *job)
+{
+	cookie_io_functions_t io = {NULL, CheckWrite, NULL, NULL};
+	Checker check = {NULL, 0, 0, -1};
+	Computer *mips;
+	FILE *out;
+	double start = Now();
+
+	if (job->missing != NULL || job->status != SIM_OK)
+	{
+		return;
+	}
+	if (job->expected != NULL)
+	{
+		check.want = MapFile(job->expected, &check.wanted);
+		if (check.want == NULL)
+		{
+			job->missing = job->expected;
+			return;
+		}
+	}
+	out = fopencookie(&check, "w", io);
+	mips = TakeComputer(job->pool);
+	if (out == NULL || mips == NULL)
+	{
+		job->status = SIM_NO_MEMORY;
+		if (mips != NULL)
+			GiveComputer(job->pool, mips);
+		if (out != NULL)
+			fclose(out);
+		goto unmap;
+	}
+	mips->printingRegisters = job->printingRegisters;
+	mips->printingMemory = job->printingMemory;
+	mips->out = out;
+	mips->budget = budget;
+	mips->timeLimit = timeLimit;
+	if (job->threaded)
+		job->status = SimulateThreaded(mips, !job->quiet, job->compiling);
+	else
+		job->status = Simulate(mips);
+	job->retired = mips->retired;
+	GiveComputer(job->pool, mips);
+	fclose(out);
+	job->printed = check.printed;
+	job->wanted = check.wanted;
+	job->mismatch = check.mismatch;
+
+unmap:
+	if (check.want != NULL && check.wanted > 0)
+	{
+		munmap((void *)check.want, check.wanted);
+	}
+	job->seconds = Now() - start;
+}
+
+/*
+ *  Take the job at the bottom of d, the end its owner works from.
+ *  Returns -1 if d is empty.
+ */
+static int PopBottom(Deque *d)
+{
+	int k = -1;
+
+	pthread_mutex_lock(&d->lock);
+	if (d->top < d->bottom)
+	{
+		k = d->jobs[--d->bottom];
+	}
+	pthread_mutex_unlock(&d->lock);
+	return k;
+}
+
+/*
+ *  Take the job at the top of d, the end other workers steal from.
+ *  Returns -1 if d is empty.
+ */
+static int StealTop(Deque *d)
+{
+	int k = -1;
+
+	pthread_mutex_lock(&d->lock);
+	if (d->top < d->bottom)
+	{
+		k = d->jobs[d->top++];
+	}
+	pthread_mutex_unlock(&d->lock);
+	return k;
+}
+
+/*
+ *  Run jobs from this worker's deque, then from the others', until
+ *  there are none left anywhere. No job makes new ones, so one pass
+ *  over the other deques that finds them all empty means we are done.
+ */
+static void *Worker(void *arg)
+{
+	int self = (int)(long)arg;
+	int k, i;
+
+	for (;;)
+	{
+		k = PopBottom(&deques[self]);
+		for (i = 1; k < 0 && i < nworkers; i++)
+		{
+			k = StealTop(&deques[(self + i) % nworkers]);
+		}
+		if (k < 0)
+		{
+			return NULL;
+		}
+		RunJob(&jobs[k]);
+	}
+}
+
+/*
+ *  Set the options of job from flag, one of the sim options allowed in
+ *  a manifest. Returns 0 if flag is not one of them.
+ */
+static int SetFlag(Job *job, const char *flag)
+{
+	if (flag[0] != '-' || flag[1] == '\0' || flag[2] != '\0')
+	{
+		return 0;
+	}
+	switch (flag[1])
+	{
+	case 'r':
+		job->printingRegisters = 1;
+		break;
+	case 'm':
+		job->printingMemory = 1;
+		break;
+	case 'f':
+		job->threaded = 1;
+		break;
+	case 'j':
+		job->threaded = 1;
+		job->compiling = 1;
+		break;
+	case 'q':
+		job->threaded = 1;
+		job->quiet = 1;
+		break;
+	default:
+		return 0;
+	}
+	return 1;
+}
+
+/*
+ *  Read the jobs listed in the manifest file.
+ */
+static void ReadManifest(const char *file)
+{
+	char line[MAXLINE], flags[MAXLINE];
+	char *words[MAXLINE / 2];
+	int lineno = 0, size = 0, n, k;
+	FILE *in;
+	Job *job;
+
+	in = fopen(file, "r");
+	if (in == NULL)
+	{
+		fprintf(stderr, "Can't open file: %s\n", file);
+		exit(1);
+	}
+	while (fgets(line, sizeof(line), in) != NULL)
+	{
+		lineno++;
+		n = 0;
+		for (words[n] = strtok(line, " \t\r\n"); words[n] != NULL; words[n] = strtok(NULL, " \t\r\n"))
+		{
+			n++;
+		}
+		if (n == 0 || words[0][0] == '#')
+		{
+			continue;
+		}
+		if (n < 2)
+		{
+			fprintf(stderr, "%s:%d: expected a .dump file, options and an output file.\n", file, lineno);
+			exit(1);
+		}
+		if (njobs == size)
+		{
+			size = size ? 2 * size : 64;
+			jobs = realloc(jobs, size * sizeof(Job));
+			if (jobs == NULL)
+			{
+				fprintf(stderr, "Out of memory.\n");
+				exit(1);
+			}
+		}
+		job = &jobs[njobs++];
+		memset(job, 0, sizeof(*job));
+		flags[0] = '\0';
+		for (k = 1; k < n - 1; k++)
+		{
+			if (!SetFlag(job, words[k]))
+			{
+				fprintf(stderr, "%s:%d: invalid option \"%s\".\n", file, lineno, words[k]);
+				fprintf(stderr, "Correct options are -r, -m, -f, -j, -q.\n");
+				exit(1);
+			}
+			strcat(flags, " ");
+			strcat(flags, words[k]);
+		}
+		job->dump = strdup(words[0]);
+		job->flags = strdup(flags);
+		job->expected = strcmp(words[n - 1], "-") == 0 ? NULL : strdup(words[n - 1]);
+		if (job->dump == NULL || job->flags == NULL ||
+				(job->expected == NULL && strcmp(words[n - 1], "-") != 0))
+		{
+			fprintf(stderr, "Out of memory.\n");
+			exit(1);
+		}
+	}
+	fclose(in);
+}
+
+/*
+ *  Load each program the jobs run into a pool of its own, once.
+ */
+static void LoadPrograms(void)
+{
+	Computer *image;
+	FILE *filein;
+	int k, i;
+
+	image = NewComputer();
+	if (image == NULL)
+	{
+		fprintf(stderr, "Out of memory.\n");
+		exit(1);
+	}
+	for (k = 0; k < njobs; k++)
+	{
+		for (i = 0; i < k && strcmp(jobs[i].dump, jobs[k].dump) != 0; i++)
+			;
+		if (i < k)
+		{
+			jobs[k].pool = jobs[i].pool;
+			jobs[k].missing = jobs[i].missing;
+			jobs[k].status = jobs[i].status;
+			continue;
+		}
+		filein = fopen(jobs[k].dump, "r");
+		if (filein == NULL)
+		{
+			jobs[k].missing = jobs[k].dump;
+			continue;
+		}
+		jobs[k].status = InitComputer(image, filein, 0, 0, 0, 0);
+		fclose(filein);
+		if (jobs[k].status == SIM_OK)
+		{
+			jobs[k].pool = NewPool(image, 0);
+			if (jobs[k].pool == NULL)
+			{
+				fprintf(stderr, "Out of memory.\n");
+				exit(1);
+			}
+		}
+	}
+	FreeComputer(image);
+}
+
+/*
+ *  Print how job k went. Returns 1 if it is correct.
+ */
+static int Report(int k)
+{
+	Job *job = &jobs[k];
+
+	printf("Test %d (%s%s): ", k + 1, job->dump, job->flags);
+	if (job->missing != NULL)
+	{
+		printf("INCORRECT, can't open %s.\n", job->missing);
+		return 0;
+	}
+	switch (job->status)
+	{
+	case SIM_TOO_BIG:
+		printf("INCORRECT, program too big.\n");
+		return 0;
+	case SIM_BAD_PROGRAM:
+		printf("INCORRECT, not a program.\n");
+		return 0;
+	case SIM_NO_MEMORY:
+		printf("INCORRECT, out of memory.\n");
+		return 0;
+	case SIM_BUDGET:
+		printf("INCORRECT, used its budget, %lu instructions (%.3f s).\n", job->retired, job->seconds);
+		return 0;
+	case SIM_TIMEOUT:
+		printf("INCORRECT, timed out after %lu instructions (%.3f s).\n", job->retired, job->seconds);
+		return 0;
+	}
+	if (job->expected == NULL)
+	{
+		printf("ran, %lu instructions (%.3f s).\n", job->retired, job->seconds);
+		return 1;
+	}
+	if (job->mismatch >= 0 || job->printed != job->wanted)
+	{
+		printf("INCORRECT, output differs at byte %ld (%lu instructions, %.3f s).\n",
+					 job->mismatch >= 0 ? job->mismatch : (long)(job->printed < job->wanted ? job->printed : job->wanted),
+					 job->retired, job->seconds);
+		return 0;
+	}
+	printf("correct, %lu instructions (%.3f s).\n", job->retired, job->seconds);
+	return 1;
+}
+
+int main(int argc, char *argv[])
+{
+	pthread_t *threads;
+	int argIndex, k, correct = 0;
+	double start;
+
+	nworkers = sysconf(_SC_NPROCESSORS_ONLN);
+	for (argIndex = 1; argIndex < argc - 1 && argv[argIndex][0] == '-'; argIndex += 2)
+	{
+		if (strcmp(argv[argIndex], "-j") == 0)
+			nworkers = atoi(argv[argIndex + 1]);
+		else if (strcmp(argv[argIndex], "-n") == 0)
+			budget = strtoul(argv[argIndex + 1], NULL, 0);
+		else if (strcmp(argv[argIndex], "-t") == 0)
+			timeLimit = atof(argv[argIndex + 1]);
+		else
+			break;
+	}
+	if (argIndex != argc - 1)
+	{
+		fprintf(stderr, "Usage: simbatch [-j threads] [-n budget] [-t seconds] manifest\n");
+		exit(1);
+	}
+	ReadManifest(argv[argIndex]);
+	LoadPrograms();
+	if (nworkers < 1)
+		nworkers = 1;
+	if (nworkers > njobs && njobs > 0)
+		nworkers = njobs;
+
+	/* Deal the jobs out in turn */
+	deques = calloc(nworkers, sizeof(Deque));
+	threads = calloc(nworkers, sizeof(pthread_t));
+	if (deques == NULL || threads == NULL)
+	{
+		fprintf(stderr, "Out of memory.\n");
+		exit(1);
+	}
+	for (k = 0; k < nworkers; k++)
+	{
+		pthread_mutex_init(&deques[k].lock, NULL);
+		deques[k].jobs = malloc((njobs / nworkers + 1) * sizeof(int));
+		if (deques[k].jobs == NULL)
+		{
+			fprintf(stderr, "Out of memory.\n");
+			exit(1);
+		}
+	}
+	/* Pushed last first, so each worker runs its own share in order */
+	for (k = njobs - 1; k >= 0; k--)
+	{
+		deques[k % nworkers].jobs[deques[k % nworkers].bottom++] = k;
+	}
+
+	start = Now();
+	for (k = 0; k < nworkers; k++)
+	{
+		if (pthread_create(&threads[k], NULL, Worker, (void *)(long)k) != 0)
+		{
+			fprintf(stderr, "Can't start worker thread.\n");
+			exit(1);
+		}
+	}
+	for (k = 0; k < nworkers; k++)
+	{
+		pthread_join(threads[k], NULL);
+	}
+
+	for (k = 0; k < njobs; k++)
+	{
+		correct += Report(k);
+	}
+	printf("Total correct: %d/%d (%d workers, %.3f s)\n", correct, njobs, nworkers, Now() - start);
+	return correct == njobs ? 0 : 1;
+}
@@ -0,0 +1,18 @@
+# Multiplies $a0 by $a1 into $v0 by repeated addition, taking its inputs
+# from the registers, for register sweeps: sim -s 4=... -s 5=... sweep.dump
+#
+
+		.text
+		jal	Mystery
+		syscall		#unsupported instruction, terminate
+
+
+Mystery:
+		addiu	$v0,$0,0
+Loop:
+		beq	$a0,$0,Done
+		addu	$v0,$v0,$a1
+		addiu	$a0,$a0,-1
+		j Loop
+Done:	
+		jr		$ra
@@ -29,7 +29,7 @@
 	lui	$s0, 0x0001
 
 	jal	Mystery
-	addi	$0,$0,0
+	syscall
 
 Mystery:
 	addiu	$v0,$0,0
@@ -28,4 +28,4 @@ jr $ra
 
 End:
 addiu $sp, $sp, 8
-addi $t3, $zero, 100
\ No newline at end of file
+syscall
\ No newline at end of file
@@ -51,4 +51,4 @@ jr $ra
 
 EndTheFun:
 addiu $sp, $sp, 20
-addi $s0, $t1, 1
\ No newline at end of file
+syscall
\ No newline at end of file
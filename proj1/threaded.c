@@ -0,0 +1,839 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include "computer.h"
+#include "threaded.h"
+#undef mips /* gcc already has a def for mips */
+
+/*
+	Threaded-code engine.
+
+	Each text word is translated once into an Op whose kind selects a
+	single handler. A handler does the work of Execute, UpdatePC, Mem
+	and RegWrite together and then jumps straight to the handler of the
+	next instruction (computed goto), so there is no per-stage switch.
+
+	When nothing is traced, text is further grouped into basic blocks
+	that end at the first control-flow instruction UpdatePC knows about
+	(the branches, j, jal, jr and jalr). A block's handlers run back to
+	back, and each block remembers the block it last went to, so the
+	outer loop only runs once per block. A translation loaded with
+	UseTranslation() takes over whenever a block it covers is entered.
+	With compiling set, blocks that run JIT_THRESHOLD times are handed
+	to the JIT in jit.c, and from then on run as native code.
+
+	The results must match Simulate() exactly, including its quirks;
+	those are folded into the Op by Translate() so the handlers stay
+	simple. Simulate() remains the reference path.
+*/
+
+/* Block entries before a block is compiled */
+#define JIT_THRESHOLD 16
+
+/*
+ *  Give mips its engine state.
+ */
+int NewEngine(Computer *mips)
+{
+	Engine *e = calloc(1, sizeof(Engine));
+
+	if (e == NULL)
+	{
+		return SIM_NO_MEMORY;
+	}
+	mips->engine = e;
+	e->words = mips->textWords;
+	e->dataBase = DATA_BASE(mips);
+	e->dataBytes = 4u * mips->dataWords;
+	e->guarded = mips->guarded;
+	e->ops = MapTable(e->words * sizeof(Op));
+	e->blocks = MapTable(e->words * sizeof(Block *));
+	if (e->ops == NULL || e->blocks == NULL)
+	{
+		FreeEngine(mips);
+		return SIM_NO_MEMORY;
+	}
+	return SIM_OK;
+}
+
+void FreeEngine(Computer *mips)
+{
+	Engine *e = mips->engine;
+
+	if (e != NULL)
+	{
+		if (e->ops != NULL && e->blocks != NULL)
+		{
+			ResetBlocks(mips);
+		}
+		JitFree(e);
+		UnmapTable(e->ops, e->words * sizeof(Op));
+		UnmapTable(e->blocks, e->words * sizeof(Block *));
+		free(e);
+		mips->engine = NULL;
+	}
+}
+
+/*
+ *  Fill in op from the decoded instruction at pc.
+ */
+void Translate(Computer *mips, Op *op, int pc)
+{
+	RegVals rv;
+	DecodedInstr *d = FetchDecoded(mips, pc, &rv);
+
+	op->kind = d->kind;
+	op->rd = op->rs = op->rt = op->imm = 0;
+
+	if (d->type == R)
+	{
+		op->rd = d->regs.r.rd;
+		op->rs = d->regs.r.rs;
+		op->rt = d->regs.r.rt;
+		op->imm = d->regs.r.shamt;
+	}
+	else if (d->type == I)
+	{
+		op->rd = d->regs.i.rt;
+		op->rs = d->regs.i.rs;
+		op->rt = d->regs.i.rt;
+		op->imm = d->regs.i.addr_or_immed;
+	}
+	else
+	{
+		op->imm = d->regs.j.target;
+	}
+
+	switch (op->kind)
+	{
+	case K_JR:
+		/* UpdatePC always returns through $31 */
+		op->rs = 31;
+		break;
+	case K_BEQ:
+		/* UpdatePC only follows forward branches */
+		op->imm = op->imm > 0 ? 4 * op->imm : 0;
+		break;
+	case K_BNE:
+		/* Execute returns the unscaled offset for bne */
+		op->imm = op->imm > 0 ? op->imm : 0;
+		break;
+	case K_BLEZ:
+	case K_BGTZ:
+	case K_BLTZ:
+	case K_BGEZ:
+		op->imm = 4 * op->imm;
+		break;
+	case K_XORI:
+		op->imm &= 0xFFFF;
+		break;
+	}
+}
+
+/*
+ *  Return the Op for pc. Words outside the text segment are translated
+ *  afresh every time, as Simulate() decodes them.
+ */
+static Op *OpAt(Computer *mips, int pc)
+{
+	Engine *e = mips->engine;
+	unsigned int k = (unsigned int)(pc - TEXT_BASE) / 4;
+
+	if (k < (unsigned int)e->words)
+	{
+		return &e->ops[k];
+	}
+	Translate(mips, &e->outside, pc);
+	return &e->outside;
+}
+
+/*
+ *  True for the ops that end a basic block.
+ */
+int EndsBlock(int kind)
+{
+	return IsBranch(kind) || kind == K_J || kind == K_JAL || kind == K_JR ||
+				 kind == K_JALR || kind == K_UNSUPPORTED;
+}
+
+/*
+ *  True for the conditional branches, whose op->imm is the offset from
+ *  pc + 4 when taken.
+ */
+int IsBranch(int kind)
+{
+	return kind == K_BEQ || kind == K_BNE || kind == K_BLEZ || kind == K_BGTZ ||
+				 kind == K_BLTZ || kind == K_BGEZ;
+}
+
+/*
+ *  True for the ops of the multiply/divide unit. MulDiv() times them
+ *  by the retired count, so only the handlers run them.
+ */
+int IsMulDiv(int kind)
+{
+	return kind >= K_MULT && kind <= K_MTLO;
+}
+
+/*
+ *  Return the one-instruction block at pc, in the engine's scratch
+ *  block.
+ */
+static Block *Single(Computer *mips, int pc)
+{
+	Block *b = &mips->engine->scratch.b;
+
+	Translate(mips, &b->ops[0], pc);
+	b->ops[1].kind = K_END;
+	b->pc = pc;
+	b->count = 1;
+	b->end = pc + 4;
+	b->hits = 0;
+	b->code = NULL;
+	b->next[0] = b->next[1] = NULL;
+	return b;
+}
+
+/*
+ *  Return the block starting at pc, building it on first use. Code
+ *  outside the text segment, and the odd pc that bne's unscaled offset
+ *  can produce, get a one-instruction block that is rebuilt every time
+ *  and never linked to.
+ */
+Block *BlockAt(Computer *mips, int pc)
+{
+	Engine *e = mips->engine;
+	unsigned int k = (unsigned int)(pc - TEXT_BASE) / 4;
+	int n;
+
+	if (k >= (unsigned int)e->words || pc % 4 != 0)
+	{
+		return Single(mips, pc);
+	}
+	if (e->blocks[k] != NULL)
+	{
+		return e->blocks[k];
+	}
+
+	n = 0;
+	do
+	{
+		if (e->ops[k + n].kind == K_TRANSLATE)
+		{
+			Translate(mips, &e->ops[k + n], pc + 4 * n);
+		}
+		n++;
+	} while (k + n < (unsigned int)e->words && !EndsBlock(e->ops[k + n - 1].kind));
+
+	return NewBlock(mips, pc, n);
+}
+
+/*
+ *  Make the block of the n already translated ops starting at pc, a
+ *  word-aligned address in the text segment, and enter it in blocks.
+ *  Returns NULL if there is no memory for it.
+ */
+Block *NewBlock(Computer *mips, int pc, int n)
+{
+	Engine *e = mips->engine;
+	unsigned int k = (unsigned int)(pc - TEXT_BASE) / 4;
+	Block *b;
+
+	b = malloc(sizeof(Block) + (n + 1) * sizeof(Op));
+	if (b == NULL)
+	{
+		return NULL;
+	}
+	memcpy(b->ops, &e->ops[k], n * sizeof(Op));
+	b->ops[n].kind = K_END;
+	b->pc = pc;
+	b->count = n;
+	b->end = pc + 4 * n;
+	b->hits = 0;
+	b->code = NULL;
+	b->next[0] = b->next[1] = NULL;
+	e->blocks[k] = b;
+	return b;
+}
+
+/*
+ *  Return the block at pc, adding pc to starts the first time it is
+ *  seen, or NULL if pc cannot start a cached block.
+ */
+static Block *Reach(Computer *mips, int pc, int *starts, int *n, char *seen)
+{
+	unsigned int k = (unsigned int)(pc - TEXT_BASE) / 4;
+
+	if (k >= (unsigned int)mips->engine->words || pc % 4 != 0)
+	{
+		return NULL;
+	}
+	if (!seen[k])
+	{
+		seen[k] = 1;
+		starts[(*n)++] = pc;
+	}
+	return BlockAt(mips, pc);
+}
+
+/*
+ *  Link b to s, one of the blocks it can go to.
+ */
+static void Link(Block *b, Block *s)
+{
+	if (b != NULL && s != NULL)
+	{
+		b->next[s->pc != b->end] = s;
+	}
+}
+
+/*
+ *  Build every block reachable from the entry point through branches,
+ *  jumps and jal return sites, and link each one to the successors it
+ *  names directly. Fills starts with their addresses and returns how
+ *  many there are. Blocks reached only through jr are still built when
+ *  first executed. Returns -1 if there is no memory for them.
+ */
+int FindBlocks(Computer *mips, int *starts)
+{
+	char *seen = MapTable(mips->engine->words);
+	int n = 0, done;
+	int pc;
+	Block *b;
+	Op *last;
+
+	if (seen == NULL)
+	{
+		return -1;
+	}
+	Reach(mips, mips->entry, starts, &n, seen);
+	for (done = 0; done < n; done++)
+	{
+		b = mips->engine->blocks[(starts[done] - TEXT_BASE) / 4];
+		if (b == NULL)
+		{
+			UnmapTable(seen, mips->engine->words);
+			return -1;
+		}
+		last = &b->ops[b->count - 1];
+		pc = b->end - 4;
+		if (IsBranch(last->kind))
+		{
+			Link(b, Reach(mips, pc + 4 + last->imm, starts, &n, seen));
+			Link(b, Reach(mips, pc + 4, starts, &n, seen));
+		}
+		else if (last->kind == K_J || last->kind == K_JAL)
+		{
+			Link(b, Reach(mips, last->imm, starts, &n, seen));
+			if (last->kind == K_JAL)
+			{
+				Reach(mips, pc + 4, starts, &n, seen); /* where jr will come back to */
+			}
+		}
+		else if (last->kind == K_JALR)
+		{
+			Reach(mips, pc + 4, starts, &n, seen);
+		}
+		else if (!EndsBlock(last->kind))
+		{
+			Link(b, Reach(mips, b->end, starts, &n, seen));
+		}
+	}
+	UnmapTable(seen, mips->engine->words);
+	return n;
+}
+
+/*
+ *  Forget every translated op and block. Words never translated are
+ *  left alone, so that their pages of the tables stay unused.
+ */
+void ResetBlocks(Computer *mips)
+{
+	Engine *e = mips->engine;
+	int k;
+
+	for (k = 0; k < e->words; k++)
+	{
+		if (e->ops[k].kind != K_TRANSLATE)
+		{
+			e->ops[k].kind = K_TRANSLATE;
+		}
+		if (e->blocks[k] != NULL)
+		{
+			free(e->blocks[k]);
+			e->blocks[k] = NULL;
+		}
+	}
+}
+
+/*
+ *  Keep the translated form of each program in dir between runs.
+ */
+void UseTranslationCache(Computer *mips, const char *dir)
+{
+	mips->engine->cacheDir = dir;
+}
+
+/*
+ *  Run untraced simulations through fn, an ahead-of-time translation
+ *  made by the aot tool, wherever it covers the pc. text and words are
+ *  the program fn was made from, and segments the text and data sizes
+ *  of the machine; returns 0 without using fn if that is not the
+ *  program that was loaded or mips has other sizes.
+ */
+int UseTranslation(Computer *mips, Translation fn, const unsigned int *text, int words,
+									 const int *segments)
+{
+	if (segments[0] != mips->textWords || segments[1] != mips->dataWords ||
+			words > mips->textWords ||
+			memcmp(text, mips->memory, words * sizeof(int)) != 0)
+	{
+		return 0;
+	}
+	for (; words < mips->textWords; words++)
+	{
+		if (mips->memory[words] != 0)
+		{
+			return 0;
+		}
+	}
+	mips->engine->translation = fn;
+	return 1;
+}
+
+/* Data segment checks against the bounds Run() keeps at hand */
+#define OUTSIDE_DATA(addr) \
+	((unsigned int)(addr) - dataBase >= dataBytes || (addr) % 4 != 0)
+
+/*
+ *  Report why the program stopped, the way Simulate() does.
+ */
+static int MemException(Computer *mips, int pc, int addr, int tracing)
+{
+	mips->pc = pc;
+	if (tracing)
+		TraceException(mips, pc, addr);
+	else
+		fprintf(mips->out, "Memory Access Exception at 0x%8.8x: address 0x%8.8x\n", pc, addr);
+	return SIM_MEMORY_EXCEPTION;
+}
+
+static int Unsupported(Computer *mips, int pc)
+{
+	mips->pc = pc;
+	fprintf(mips->out, "Unsupported instruction found. Terminating program\n");
+	return SIM_UNSUPPORTED;
+}
+
+/*
+ *  Print the state the program stopped in: the retired instruction
+ *  count, then the pc, every register and the nonzero data memory in
+ *  PrintInfo's format.
+ */
+void PrintSummary(Computer *mips)
+{
+	fprintf(mips->out, "Retired %lu instructions\n", mips->retired);
+	PrintInterlocks(mips);
+	mips->printingRegisters = 1;
+	mips->printingMemory = 1;
+	PrintInfo(mips, -1, -1);
+}
+
+/*
+ *  Every handler is emitted twice: a traced copy that finishes through
+ *  TraceInfo, and a quiet copy that runs inside a block. Quiet handlers
+ *  fall through to the next op of the block; the ones that end a block
+ *  go back to the chaining code instead.
+ */
+#define DISPATCH_QUIET() goto *quiet[(++op)->kind]
+#define CHAIN_QUIET() goto chain
+
+#define EMIT(name, next, ...) \
+	T_##name:                   \
+	{                           \
+		__VA_ARGS__               \
+	}                           \
+	goto traced_next;           \
+	Q_##name:                   \
+	{                           \
+		__VA_ARGS__               \
+	}                           \
+	next();
+
+#define HANDLER(name, ...) EMIT(name, DISPATCH_QUIET, __VA_ARGS__)
+#define BRANCH_HANDLER(name, ...) EMIT(name, CHAIN_QUIET, __VA_ARGS__)
+
+/* Run op on the multiply/divide unit, retiring after those before it */
+#define MUL_DIV(kind) \
+	MulDiv(mips, kind, reg[op->rs], reg[op->rt], mips->retired + (tracing ? 0 : op - b->ops))
+
+/* Count the ops of the current block that completed before op */
+#define RETIRE_PARTIAL() \
+	if (!tracing)          \
+		mips->retired += op - b->ops;
+
+#define LABELS(p)                                                             \
+	{                                                                           \
+		&&p##TRANSLATE, &&p##ADDU, &&p##SUBU, &&p##AND, &&p##OR, &&p##SLT,        \
+				&&p##SLL, &&p##SRL, &&p##JR, &&p##ADDIU, &&p##ANDI, &&p##ORI,         \
+				&&p##LUI, &&p##BEQ, &&p##BNE, &&p##BGTZ, &&p##LW, &&p##SW, &&p##J,    \
+				&&p##JAL, &&p##LL, &&p##SC, &&p##ADDI, &&p##SLTI, &&p##SLTIU,         \
+				&&p##XORI, &&p##SRA, &&p##SLLV, &&p##SRLV, &&p##SRAV, &&p##NOR,       \
+				&&p##XOR, &&p##BLEZ, &&p##BLTZ, &&p##BGEZ, &&p##JALR, &&p##MULT,      \
+				&&p##MULTU, &&p##DIV, &&p##DIVU, &&p##MFHI, &&p##MFLO, &&p##MTHI,     \
+				&&p##MTLO, &&p##UNSUPPORTED, &&p##END                                 \
+	}
+
+/*
+ *  Check the limits when mips->retired reaches *checkAt, keeping
+ *  *checkAt no later than the end of the slice. Returns SIM_PAUSED at
+ *  the end of the slice if the limits are not up.
+ */
+static int CheckSlice(Computer *mips, unsigned long *checkAt, unsigned long sliceEnd)
+{
+	int status = CheckLimits(mips, checkAt);
+
+	if (status != SIM_OK)
+	{
+		/* *checkAt is only moved on while the limits are not up */
+		return status;
+	}
+	if (mips->retired >= sliceEnd)
+	{
+		return SIM_PAUSED;
+	}
+	if (*checkAt > sliceEnd)
+	{
+		*checkAt = sliceEnd;
+	}
+	return status;
+}
+
+/*
+ *  Run the program in mips with the threaded engine, from the start of
+ *  the text or, with resume set, from where mips is, keeping the blocks
+ *  it already has. With tracing set the output is identical to
+ *  Simulate(), but goes through the buffered writer in trace.c.
+ *  Otherwise execution goes a block at a time, using native code for
+ *  hot blocks if compiling is set. Returns why the program stopped.
+ *  Limits set in mips are checked between blocks, so a quiet run may
+ *  go a few instructions past its budget, and an ahead-of-time
+ *  translation, which can't be stopped, is only used without them.
+ *  Neither translated nor native code is used on a machine with an L1,
+ *  so that every access goes through it.
+ *  A nonzero slice stops an untraced run with SIM_PAUSED once it has
+ *  retired that many more instructions, at the end of a block.
+ */
+static int Run(Computer *mips, int tracing, int compiling, int resume, unsigned long slice)
+{
+	const void *traced[NUM_KINDS] = LABELS(T_);
+	const void *quiet[NUM_KINDS] = LABELS(Q_);
+	Engine *e = mips->engine;
+	unsigned int *reg = (unsigned int *)mips->registers;
+	int pc, addr, status;
+	int changedReg = -1, changedMem = -1;
+	unsigned long checkAt = ULONG_MAX, sliceEnd = ULONG_MAX;
+	unsigned int dataBase = e->dataBase, dataBytes = e->dataBytes;
+	Block *b = NULL, *nb;
+	JitExit x;
+	Op *op;
+	int k, n;
+
+	if (resume)
+	{
+		/* Carry on counting towards the limits the run started with */
+		pc = mips->pc;
+		if (slice != 0 && mips->retired + slice > mips->retired)
+		{
+			sliceEnd = mips->retired + slice;
+		}
+		status = CheckSlice(mips, &checkAt, sliceEnd);
+		if (status != SIM_OK)
+		{
+			goto stop;
+		}
+	}
+	else
+	{
+		ResetBlocks(mips);
+		if (e->cacheDir != NULL && !LoadCache(mips, e->cacheDir))
+		{
+			SaveCache(mips, e->cacheDir);
+		}
+		JitReset(e);
+		pc = mips->pc = mips->entry;
+		checkAt = StartLimits(mips);
+	}
+	if (tracing)
+	{
+		status = TraceReset(mips);
+		if (status != SIM_OK)
+		{
+			return status;
+		}
+	}
+	else
+	{
+		b = BlockAt(mips, pc);
+		if (b == NULL)
+		{
+			return SIM_NO_MEMORY;
+		}
+		goto enter;
+	}
+
+traced_dispatch:
+	if (mips->retired >= checkAt && (status = CheckSlice(mips, &checkAt, sliceEnd)) != SIM_OK)
+	{
+		goto stop;
+	}
+	op = OpAt(mips, pc);
+	mips->pc = pc;
+	if (!TraceStep(mips, pc))
+	{
+		status = SIM_UNSUPPORTED;
+		goto stop;
+	}
+	changedReg = -1;
+	changedMem = -1;
+	goto *traced[op->kind];
+
+traced_next:
+	mips->pc = pc;
+	mips->retired++;
+	TraceInfo(mips, changedReg, changedMem);
+	goto traced_dispatch;
+
+chain:
+	/*
+	 *  Follow the link for the way b left if it still leads to pc, and
+	 *  otherwise look the block up and remember it for next time.
+	 */
+	mips->retired += b->count;
+	if (mips->retired >= checkAt && (status = CheckSlice(mips, &checkAt, sliceEnd)) != SIM_OK)
+	{
+		mips->pc = pc;
+		goto stop;
+	}
+	k = pc != b->end;
+	nb = b->next[k];
+	if (nb == NULL || nb->pc != pc)
+	{
+		nb = BlockAt(mips, pc);
+		if (nb == NULL)
+		{
+			status = SIM_NO_MEMORY;
+			goto stop;
+		}
+		if (b != &e->scratch.b && nb != &e->scratch.b)
+		{
+			b->next[k] = nb;
+		}
+	}
+	b = nb;
+
+enter:
+	if (e->stopping)
+	{
+		if (mips->retired >= e->stopAt || pc == e->stopPc)
+		{
+			mips->pc = pc;
+			status = SIM_PAUSED;
+			goto stop;
+		}
+		/* Go through a block that reaches the stop one instruction at a time */
+		if (mips->retired + b->count > e->stopAt || (unsigned int)(e->stopPc - pc) < 4u * b->count)
+		{
+			b = Single(mips, pc);
+		}
+	}
+	if (e->translation != NULL && b != &e->scratch.b && checkAt == ULONG_MAX && mips->l1 == NULL &&
+			!e->stopping)
+	{
+		/* Run translated code until it reaches a pc it does not cover */
+		if (e->translation(reg, mips->memory, &pc, &addr, &mips->retired))
+		{
+			status = MemException(mips, pc, addr, tracing);
+			goto stop;
+		}
+		if (pc != b->pc)
+		{
+			b = BlockAt(mips, pc);
+			if (b == NULL)
+			{
+				status = SIM_NO_MEMORY;
+				goto stop;
+			}
+		}
+	}
+	if (compiling && mips->l1 == NULL && b->code == NULL && b != &e->scratch.b &&
+			++b->hits == JIT_THRESHOLD)
+	{
+		b->code = JitCompile(e, b);
+	}
+	if (b->code != NULL && mips->l1 == NULL)
+	{
+		jitEngine = e;
+		n = b->code(reg, mips->memory, &x);
+		jitEngine = NULL;
+		if (n < b->count)
+		{
+			mips->retired += n;
+			status = MemException(mips, b->pc + 4 * n + 4, x.addr, tracing);
+			goto stop;
+		}
+		pc = x.pc;
+		goto chain;
+	}
+	op = b->ops;
+	goto *quiet[op->kind];
+
+T_TRANSLATE:
+	Translate(mips, op, pc);
+	goto *traced[op->kind];
+Q_TRANSLATE:
+	Translate(mips, op, pc);
+	goto *quiet[op->kind];
+T_END:
+	goto traced_next;
+Q_END:
+	goto chain;
+
+	HANDLER(ADDU, reg[op->rd] = reg[op->rs] + reg[op->rt]; changedReg = op->rd; pc += 4;)
+	HANDLER(SUBU, reg[op->rd] = reg[op->rs] - reg[op->rt]; changedReg = op->rd; pc += 4;)
+	HANDLER(AND, reg[op->rd] = reg[op->rs] & reg[op->rt]; changedReg = op->rd; pc += 4;)
+	HANDLER(OR, reg[op->rd] = reg[op->rs] | reg[op->rt]; changedReg = op->rd; pc += 4;)
+	HANDLER(SLT, reg[op->rd] = (int)reg[op->rs] < (int)reg[op->rt]; changedReg = op->rd; pc += 4;)
+	HANDLER(SLL, reg[op->rd] = reg[op->rt] << op->imm; changedReg = op->rd; pc += 4;)
+	HANDLER(SRL, reg[op->rd] = (int)reg[op->rt] >> op->imm; changedReg = op->rd; pc += 4;)
+	BRANCH_HANDLER(JR, pc = reg[op->rs];)
+	HANDLER(ADDIU, reg[op->rd] = reg[op->rs] + op->imm; changedReg = op->rd; pc += 4;)
+	HANDLER(ANDI, reg[op->rd] = reg[op->rs] & op->imm; changedReg = op->rd; pc += 4;)
+	HANDLER(ORI, reg[op->rd] = reg[op->rs] | op->imm; changedReg = op->rd; pc += 4;)
+	HANDLER(LUI, reg[op->rd] = (unsigned int)op->imm << 16; changedReg = op->rd; pc += 4;)
+	BRANCH_HANDLER(BEQ, pc += 4; if (reg[op->rs] == reg[op->rt]) pc += op->imm;)
+	BRANCH_HANDLER(BNE, pc += 4; if (reg[op->rs] != reg[op->rt]) pc += op->imm;)
+	BRANCH_HANDLER(BGTZ, pc += 4; if ((int)reg[op->rs] > 0) pc += op->imm;)
+	HANDLER(LW, addr = reg[op->rs] + op->imm; pc += 4;
+					if (OUTSIDE_DATA(addr)) { RETIRE_PARTIAL() status = MemException(mips, pc, addr, tracing); goto stop; }
+					if (mips->l1 != NULL) CacheAccess(mips, addr, 0);
+					reg[op->rd] = mips->memory[(addr - TEXT_BASE) / 4]; changedReg = op->rd;)
+	HANDLER(SW, addr = reg[op->rs] + op->imm; pc += 4;
+					if (OUTSIDE_DATA(addr)) { RETIRE_PARTIAL() status = MemException(mips, pc, addr, tracing); goto stop; }
+					if (mips->l1 != NULL) CacheAccess(mips, addr, 1);
+					mips->memory[(addr - TEXT_BASE) / 4] = reg[op->rt]; changedMem = addr;)
+	BRANCH_HANDLER(J, pc = op->imm;)
+	BRANCH_HANDLER(JAL, reg[31] = pc + 4; pc = op->imm; changedReg = 31;)
+	HANDLER(LL, addr = reg[op->rs] + op->imm; pc += 4;
+					if (OUTSIDE_DATA(addr)) { RETIRE_PARTIAL() status = MemException(mips, pc, addr, tracing); goto stop; }
+					if (mips->l1 != NULL) CacheAccess(mips, addr, 0);
+					reg[op->rd] = __atomic_load_n(&mips->memory[(addr - TEXT_BASE) / 4], __ATOMIC_SEQ_CST); changedReg = op->rd;
+					mips->linked = 1; mips->linkAddr = addr; mips->linkValue = reg[op->rd];)
+	HANDLER(SC, addr = reg[op->rs] + op->imm; pc += 4;
+					if (OUTSIDE_DATA(addr)) { RETIRE_PARTIAL() status = MemException(mips, pc, addr, tracing); goto stop; }
+					k = mips->linkValue;
+					reg[op->rd] = mips->linked && mips->linkAddr == addr &&
+												__atomic_compare_exchange_n(&mips->memory[(addr - TEXT_BASE) / 4], &k, reg[op->rt], 0,
+																										__ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+					if (reg[op->rd]) changedMem = addr;
+					if (mips->l1 != NULL) CacheAccess(mips, addr, reg[op->rd]);
+					mips->linked = 0; changedReg = op->rd;)
+	HANDLER(ADDI, reg[op->rd] = reg[op->rs] + op->imm; changedReg = op->rd; pc += 4;)
+	HANDLER(SLTI, reg[op->rd] = (int)reg[op->rs] < op->imm; changedReg = op->rd; pc += 4;)
+	HANDLER(SLTIU, reg[op->rd] = reg[op->rs] < (unsigned int)op->imm; changedReg = op->rd; pc += 4;)
+	HANDLER(XORI, reg[op->rd] = reg[op->rs] ^ op->imm; changedReg = op->rd; pc += 4;)
+	HANDLER(SRA, reg[op->rd] = (int)reg[op->rt] >> op->imm; changedReg = op->rd; pc += 4;)
+	HANDLER(SLLV, reg[op->rd] = reg[op->rt] << (reg[op->rs] & 31); changedReg = op->rd; pc += 4;)
+	HANDLER(SRLV, reg[op->rd] = reg[op->rt] >> (reg[op->rs] & 31); changedReg = op->rd; pc += 4;)
+	HANDLER(SRAV, reg[op->rd] = (int)reg[op->rt] >> (reg[op->rs] & 31); changedReg = op->rd; pc += 4;)
+	HANDLER(NOR, reg[op->rd] = ~(reg[op->rs] | reg[op->rt]); changedReg = op->rd; pc += 4;)
+	HANDLER(XOR, reg[op->rd] = reg[op->rs] ^ reg[op->rt]; changedReg = op->rd; pc += 4;)
+	BRANCH_HANDLER(BLEZ, pc += 4; if ((int)reg[op->rs] <= 0) pc += op->imm;)
+	BRANCH_HANDLER(BLTZ, pc += 4; if ((int)reg[op->rs] < 0) pc += op->imm;)
+	BRANCH_HANDLER(BGEZ, pc += 4; if ((int)reg[op->rs] >= 0) pc += op->imm;)
+	BRANCH_HANDLER(JALR, addr = reg[op->rs]; reg[op->rd] = pc + 4; pc = addr; changedReg = op->rd;)
+	HANDLER(MULT, MUL_DIV(K_MULT); changedReg = HILO_REG; pc += 4;)
+	HANDLER(MULTU, MUL_DIV(K_MULTU); changedReg = HILO_REG; pc += 4;)
+	HANDLER(DIV, MUL_DIV(K_DIV); changedReg = HILO_REG; pc += 4;)
+	HANDLER(DIVU, MUL_DIV(K_DIVU); changedReg = HILO_REG; pc += 4;)
+	HANDLER(MFHI, reg[op->rd] = MUL_DIV(K_MFHI); changedReg = op->rd; pc += 4;)
+	HANDLER(MFLO, reg[op->rd] = MUL_DIV(K_MFLO); changedReg = op->rd; pc += 4;)
+	HANDLER(MTHI, MUL_DIV(K_MTHI); changedReg = HILO_REG; pc += 4;)
+	HANDLER(MTLO, MUL_DIV(K_MTLO); changedReg = HILO_REG; pc += 4;)
+	BRANCH_HANDLER(UNSUPPORTED, RETIRE_PARTIAL() status = Unsupported(mips, pc); goto stop;)
+
+stop:
+	if (tracing)
+	{
+		TraceFlush(mips);
+	}
+	return status;
+}
+
+/*
+ *  Run the simulation with the threaded engine; see Run(). Untraced,
+ *  nothing is printed until the program stops, when PrintSummary()
+ *  reports the final state.
+ */
+int SimulateThreaded(Computer *mips, int tracing, int compiling)
+{
+	int status;
+
+	if (mips->interactive)
+	{
+		return Simulate(mips);
+	}
+	status = Run(mips, tracing, compiling, 0, 0);
+	if (!tracing && status != SIM_NO_MEMORY)
+	{
+		PrintSummary(mips);
+	}
+	return status;
+}
+
+/*
+ *  Carry on from the pc, registers and memory mips is in, counting on
+ *  from mips->retired under the limits of the run that got it there.
+ *  Traced, prints what Simulate() would from that point on; untraced,
+ *  prints the final state like SimulateThreaded().
+ */
+int ContinueThreaded(Computer *mips, int tracing, int compiling)
+{
+	int status = Run(mips, tracing, compiling, 1, 0);
+
+	if (!tracing && status != SIM_NO_MEMORY)
+	{
+		PrintSummary(mips);
+	}
+	return status;
+}
+
+/*
+ *  Like ContinueThreaded(), but stop with SIM_PAUSED after about slice
+ *  more instructions (0 for no end), and print nothing.
+ */
+int StepThreaded(Computer *mips, int compiling, unsigned long slice)
+{
+	return Run(mips, 0, compiling, 1, slice);
+}
+
+/*
+ *  Run untraced, printing nothing, from the entry point or, with resume
+ *  set, from where mips is, until count instructions have retired in
+ *  all or the pc reaches pc (-1 for neither), and return SIM_PAUSED
+ *  with mips in exactly the state it has at that point. Any other
+ *  status is why the program stopped first.
+ */
+int PauseThreaded(Computer *mips, int compiling, int resume, unsigned long count, int pc)
+{
+	Engine *e = mips->engine;
+	int status;
+
+	e->stopping = 1;
+	e->stopAt = count;
+	e->stopPc = pc;
+	status = Run(mips, 0, compiling, resume, 0);
+	e->stopping = 0;
+	return status;
+}
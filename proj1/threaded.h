@@ -0,0 +1,95 @@
+/*
+	Internal interface between the threaded-code engine, the JIT, the
+	translation cache and the aot tool.
+*/
+
+typedef struct
+{
+	int kind;
+	int rd;	 /* destination register (rd for R-format, rt for I-format) */
+	int rs;
+	int rt;
+	int imm; /* immediate, shift amount, taken-branch offset or jump target */
+} Op;
+
+/*
+	How native code left a block: the next pc, or the address that
+	caused a Memory Access Exception.
+*/
+typedef struct
+{
+	int pc;
+	int addr;
+} JitExit;
+
+/*
+	Native code for a block. Returns the number of instructions that
+	completed; anything less than the block's count means the next one
+	faulted on x->addr.
+*/
+typedef int (*JitCode)(unsigned int *reg, int *memory, JitExit *x);
+
+typedef struct Block
+{
+	int pc;		/* address of the first instruction */
+	int count; /* number of instructions, for retired accounting */
+	int end;	 /* fall-through address */
+	int hits;	/* times entered, to find hot blocks */
+	JitCode code; /* native translation, once the block is hot */
+	struct Block *next[2]; /* last successor seen: fall-through, other */
+	Op ops[];	/* count ops followed by a terminator */
+} Block;
+
+/*
+	Threaded engine state of one Computer.
+*/
+typedef struct Engine
+{
+	Op *ops;			 /* translated text, indexed like Fetch */
+	Block **blocks; /* block starting at each text word */
+	int words;		 /* text words the tables cover */
+	unsigned int dataBase, dataBytes; /* the data segment, for the JIT */
+	int guarded;									/* memory is guarded, see GuardMemory() */
+	Op outside;									/* translation of a word outside the text */
+
+	/* One-instruction block for code outside the text segment */
+	struct
+	{
+		Block b;
+		Op ops[2];
+	} scratch;
+
+	/* Where PauseThreaded() stops the run, with stopping set */
+	int stopping, stopPc;
+	unsigned long stopAt;
+
+	Translation translation; /* ahead-of-time translation, if any */
+	const char *cacheDir;		 /* on-disk translation cache, if any */
+
+	/* Native code buffer of the JIT */
+	unsigned char *jitBuffer, *jitCur, *jitLimit;
+
+	/* Unchecked loads and stores in it, in order, with their fault stubs */
+	struct GuardSite
+	{
+		unsigned int at, stub; /* offsets in jitBuffer */
+	} *sites;
+	int nsites;
+} Engine;
+
+/* The engine whose native code this thread is running, if any */
+extern __thread Engine *jitEngine;
+
+void Translate(Computer *, Op *, int pc);
+Block *BlockAt(Computer *, int pc);
+Block *NewBlock(Computer *, int pc, int n);
+int EndsBlock(int kind);
+int IsBranch(int kind);
+int IsMulDiv(int kind);
+int FindBlocks(Computer *, int *starts);
+void ResetBlocks(Computer *);
+int LoadCache(Computer *, const char *dir);
+void SaveCache(Computer *, const char *dir);
+JitCode JitCompile(Engine *, Block *);
+void JitReset(Engine *);
+void JitFree(Engine *);
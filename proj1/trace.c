@@ -0,0 +1,864 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include "computer.h"
+#undef mips /* gcc already has a def for mips */
+
+/*
+	Fast text trace writer.
+
+	Produces exactly what Simulate(), PrintInstruction() and PrintInfo()
+	print, but formats into one large buffer that goes out to the
+	machine's out stream when it fills up. Hex and decimal digits come
+	from lookup tables, and register names and mnemonics are
+	preformatted strings.
+
+	The "Executing instruction at" line and the disassembly never change
+	for a given text word (the text segment cannot be stored to), so
+	both are formatted the first time a pc is traced and then copied.
+
+	After TraceBinary() the same calls write one TraceRecord per step
+	instead, which the render tool turns back into the text.
+
+	Each Computer has its own Trace, made by the first call that needs
+	it; only the constant tables below are shared.
+
+	After TraceAsync() the records go through a single-producer,
+	single-consumer ring to a formatting thread instead. That thread
+	replays them on its own copy of the machine, exactly as render does,
+	so the simulation only waits for it when the ring is full.
+*/
+
+#define TRACE_BUFFER_SIZE (1 << 16)
+
+/* Longest line any of the Trace functions writes at once */
+#define MAX_LINE 256
+
+/* Ring of records on their way to the formatting thread */
+#define RING_SIZE (1 << 14)
+
+typedef struct Trace
+{
+	Computer *mips; /* the machine being traced */
+	Computer *view; /* the machine the text is formatted from */
+	FILE *out;
+	int binary, async, running;
+	TraceRecord pending; /* the step being traced, in binary or async mode */
+
+	char buffer[TRACE_BUFFER_SIZE];
+	int used;
+
+	/* Cached "Executing ..." and disassembly lines of the text segment */
+	int words;
+	char (*steps)[128];
+	unsigned char *stepLengths; /* 0 if not formatted yet */
+	char *stepSupported;
+
+	/* The ring; each side mostly reads its own cache line */
+	TraceRecord ring[RING_SIZE];
+	_Alignas(64) atomic_uint head; /* next record to format */
+	unsigned int tailSeen;
+	_Alignas(64) atomic_uint tail; /* next record to fill */
+	unsigned int headSeen;
+	_Alignas(64) atomic_int finished;
+	pthread_t formatter;
+	Computer shadow; /* the formatting thread's copy of the machine */
+	int *shadowMemory;
+	size_t shadowBytes;
+} Trace;
+
+/* Two hex digits for every byte value */
+static char hex[256][2];
+
+/* "0" .. "31", for register numbers */
+static char regNames[32][3];
+static int regNameLengths[32];
+
+static const char unsupportedMessage[] =
+		"Unsupported instruction found. Terminating program\n";
+
+/*
+ *  Write out everything buffered so far.
+ */
+static void WriteOut(Trace *t)
+{
+	fwrite(t->buffer, 1, t->used, t->out);
+	t->used = 0;
+}
+
+/*
+ *  Return room for at least MAX_LINE more characters.
+ */
+static char *Reserve(Trace *t)
+{
+	if (t->used > TRACE_BUFFER_SIZE - MAX_LINE)
+	{
+		WriteOut(t);
+	}
+	return t->buffer + t->used;
+}
+
+static char *Text(char *p, const char *s, int n)
+{
+	memcpy(p, s, n);
+	return p + n;
+}
+
+#define TEXT(p, s) Text(p, s, sizeof(s) - 1)
+
+/* %8.8x */
+static char *Hex8(char *p, unsigned int v)
+{
+	memcpy(p, hex[v >> 24], 2);
+	memcpy(p + 2, hex[(v >> 16) & 0xff], 2);
+	memcpy(p + 4, hex[(v >> 8) & 0xff], 2);
+	memcpy(p + 6, hex[v & 0xff], 2);
+	return p + 8;
+}
+
+/* %d */
+static char *Decimal(char *p, int v)
+{
+	char digits[12];
+	int n = 0;
+	unsigned int u = v;
+
+	if (v < 0)
+	{
+		*p++ = '-';
+		u = -u;
+	}
+	do
+	{
+		digits[n++] = '0' + u % 10;
+		u /= 10;
+	} while (u != 0);
+	while (n > 0)
+	{
+		*p++ = digits[--n];
+	}
+	return p;
+}
+
+/* $%d */
+static char *Reg(char *p, int r)
+{
+	*p++ = '$';
+	return Text(p, regNames[r], regNameLengths[r]);
+}
+
+/* r%2.2d */
+static char *RegIndex(char *p, int r)
+{
+	*p++ = 'r';
+	*p++ = '0' + r / 10;
+	*p++ = '0' + r % 10;
+	return p;
+}
+
+/* Word at addr of the machine being formatted, 0 outside as Fetch() */
+static unsigned int Word(Trace *t, int addr)
+{
+	unsigned int k = (unsigned int)(addr - TEXT_BASE) / 4;
+
+	return k < (unsigned int)(t->view->textWords + t->view->dataWords) ? t->view->memory[k] : 0;
+}
+
+/*
+ *  True if Simulate() executes instr rather than stopping at it.
+ */
+static int Supported(unsigned int instr)
+{
+	return InstrKind(instr) != K_UNSUPPORTED;
+}
+
+/*
+ *  Send the pending record, marked with how, to the binary trace or the
+ *  formatting thread.
+ */
+static void PutRecord(Trace *t, unsigned int how)
+{
+	unsigned int n;
+
+	t->pending.how = how;
+	if (t->binary)
+	{
+		memcpy(Reserve(t), &t->pending, sizeof(t->pending));
+		t->used += sizeof(t->pending);
+		return;
+	}
+
+	n = atomic_load_explicit(&t->tail, memory_order_relaxed);
+	while (n - t->headSeen == RING_SIZE)
+	{
+		t->headSeen = atomic_load_explicit(&t->head, memory_order_acquire);
+		if (n - t->headSeen == RING_SIZE)
+		{
+			sched_yield();
+		}
+	}
+	t->ring[n % RING_SIZE] = t->pending;
+	atomic_store_explicit(&t->tail, n + 1, memory_order_release);
+}
+
+/*
+ *  Take the next record off the ring, waiting for one if need be.
+ *  Returns 0 once the ring is empty and nothing more is coming.
+ */
+static int GetRecord(Trace *t, TraceRecord *r)
+{
+	unsigned int h = atomic_load_explicit(&t->head, memory_order_relaxed);
+	int done;
+
+	while (h == t->tailSeen)
+	{
+		done = atomic_load_explicit(&t->finished, memory_order_acquire);
+		t->tailSeen = atomic_load_explicit(&t->tail, memory_order_acquire);
+		if (h != t->tailSeen)
+		{
+			break;
+		}
+		if (done)
+		{
+			return 0;
+		}
+		sched_yield();
+	}
+	*r = t->ring[h % RING_SIZE];
+	atomic_store_explicit(&t->head, h + 1, memory_order_release);
+	return 1;
+}
+
+/*
+ *  Body of the formatting thread.
+ */
+static void *Format(void *arg)
+{
+	Trace *t = arg;
+	TraceRecord rec, next;
+
+	if (!GetRecord(t, &rec))
+	{
+		return NULL;
+	}
+	while (!TRACE_STOPS(rec.how) && GetRecord(t, &next))
+	{
+		TraceReplay(&t->shadow, &rec, &next);
+		rec = next;
+	}
+	if (TRACE_STOPS(rec.how))
+	{
+		TraceReplay(&t->shadow, &rec, NULL);
+	}
+	return NULL;
+}
+
+static pthread_once_t tablesOnce = PTHREAD_ONCE_INIT;
+
+static void MakeTables(void)
+{
+	static const char digits[] = "0123456789abcdef";
+	int k;
+
+	for (k = 0; k < 256; k++)
+	{
+		hex[k][0] = digits[k >> 4];
+		hex[k][1] = digits[k & 15];
+	}
+	for (k = 0; k < 32; k++)
+	{
+		regNameLengths[k] = sprintf(regNames[k], "%d", k);
+	}
+}
+
+/*
+ *  Return the Trace of mips, making it the first time, or NULL if there
+ *  is no memory for it.
+ */
+static Trace *TraceOf(Computer *mips)
+{
+	Trace *t = mips->trace;
+
+	if (t == NULL)
+	{
+		if (posix_memalign((void **)&t, 64, sizeof(Trace)) != 0)
+		{
+			return NULL;
+		}
+		memset(t, 0, sizeof(Trace));
+		t->mips = mips;
+		t->view = mips;
+		t->out = mips->out;
+		mips->trace = t;
+	}
+	return t;
+}
+
+static void UnmapSteps(Trace *t)
+{
+	UnmapTable(t->steps, t->words * sizeof(*t->steps));
+	UnmapTable(t->stepLengths, t->words);
+	UnmapTable(t->stepSupported, t->words);
+	t->steps = NULL;
+	t->stepLengths = NULL;
+	t->stepSupported = NULL;
+	t->words = 0;
+}
+
+/*
+ *  Give t cached lines for a text segment of words words, all
+ *  unformatted. Returns 0 if there is no memory for them.
+ */
+static int MapSteps(Trace *t, int words)
+{
+	if (t->words == words)
+	{
+		memset(t->stepLengths, 0, words);
+		return 1;
+	}
+	UnmapSteps(t);
+	t->steps = MapTable(words * sizeof(*t->steps));
+	t->stepLengths = MapTable(words);
+	t->stepSupported = MapTable(words);
+	t->words = words;
+	if (t->steps == NULL || t->stepLengths == NULL || t->stepSupported == NULL)
+	{
+		UnmapSteps(t);
+		return 0;
+	}
+	return 1;
+}
+
+/*
+ *  Copy the memory of mips to the formatting thread's copy, leaving the
+ *  pages that are zero unallocated. Returns 0 if there is no memory
+ *  for it.
+ */
+static int CopyShadow(Trace *t, Computer *mips)
+{
+	const char *from = (const char *)mips->memory;
+	size_t bytes = MEMORY_BYTES(mips), at, n, k;
+
+	UnmapTable(t->shadowMemory, t->shadowBytes);
+	t->shadowBytes = bytes;
+	t->shadowMemory = MapTable(bytes);
+	if (t->shadowMemory == NULL)
+	{
+		return 0;
+	}
+	for (at = 0; at < bytes; at += n)
+	{
+		n = bytes - at < 4096 ? bytes - at : 4096;
+		for (k = 0; k < n && from[at + k] == 0; k++)
+			;
+		if (k < n)
+		{
+			memcpy((char *)t->shadowMemory + at, from + at, n);
+		}
+	}
+	return 1;
+}
+
+/*
+ *  Write the starting registers, HI and LO of mips and the nonzero
+ *  words of its data segment to the binary trace, as the header
+ *  describes.
+ */
+static void WriteStart(Trace *t, Computer *mips)
+{
+	int k, pair[2];
+
+	memcpy(t->buffer + t->used, mips->registers, sizeof(mips->registers));
+	t->used += sizeof(mips->registers);
+	memcpy(t->buffer + t->used, &mips->hi, sizeof(int));
+	memcpy(t->buffer + t->used + sizeof(int), &mips->lo, sizeof(int));
+	t->used += 2 * sizeof(int);
+	for (k = 0; k < mips->dataWords; k++)
+	{
+		if (mips->memory[mips->textWords + k] != 0)
+		{
+			pair[0] = DATA_BASE(mips) + 4 * k;
+			pair[1] = mips->memory[mips->textWords + k];
+			memcpy(Reserve(t), pair, sizeof(pair));
+			t->used += sizeof(pair);
+		}
+	}
+	pair[0] = pair[1] = 0;
+	memcpy(Reserve(t), pair, sizeof(pair));
+	t->used += sizeof(pair);
+}
+
+/*
+ *  Prepare to trace the program loaded in mips, forgetting any cached
+ *  lines. Returns SIM_NO_MEMORY if there is no memory for the trace.
+ */
+int TraceReset(Computer *mips)
+{
+	Trace *t = TraceOf(mips);
+
+	if (t == NULL || !MapSteps(t, mips->textWords))
+	{
+		return SIM_NO_MEMORY;
+	}
+	pthread_once(&tablesOnce, MakeTables);
+	t->used = 0;
+	t->view = mips;
+	if (t->binary)
+	{
+		memcpy(t->buffer, TRACE_MAGIC, 8);
+		memcpy(t->buffer + 8, &mips->textWords, sizeof(int));
+		memcpy(t->buffer + 8 + sizeof(int), &mips->dataWords, sizeof(int));
+		t->used = 8 + 2 * sizeof(int);
+		WriteStart(t, mips);
+	}
+	else if (t->async)
+	{
+		if (!CopyShadow(t, mips))
+		{
+			return SIM_NO_MEMORY;
+		}
+		/* The copy formats through this same Trace, and decodes nothing */
+		t->shadow = *mips;
+		t->shadow.trace = t;
+		t->shadow.memory = t->shadowMemory;
+		t->shadow.decoded = NULL;
+		t->shadow.decodedVals = NULL;
+		t->shadow.decodedValid = NULL;
+		t->shadow.l1 = NULL;
+		t->shadow.nonzero = NULL;
+		if (t->shadow.printingMemory)
+		{
+			TrackNonzero(&t->shadow);
+		}
+		t->view = &t->shadow;
+		atomic_store(&t->head, 0);
+		atomic_store(&t->tail, 0);
+		atomic_store(&t->finished, 0);
+		t->headSeen = t->tailSeen = 0;
+		t->running = pthread_create(&t->formatter, NULL, Format, t) == 0;
+		if (!t->running)
+		{
+			UntrackNonzero(&t->shadow);
+			t->view = mips;
+		}
+	}
+	if (t->view == mips && !t->binary && mips->printingMemory)
+	{
+		/* Printing all of memory after every step then costs the nonzero words */
+		TrackNonzero(mips);
+	}
+	return SIM_OK;
+}
+
+/*
+ *  Write binary records to out from now on, starting with the next
+ *  TraceReset().
+ */
+int TraceBinary(Computer *mips, FILE *out)
+{
+	Trace *t = TraceOf(mips);
+
+	if (t == NULL)
+	{
+		return SIM_NO_MEMORY;
+	}
+	t->out = out;
+	t->binary = 1;
+	return SIM_OK;
+}
+
+/*
+ *  Format the text trace on its own thread from the next TraceReset()
+ *  on, if there is a processor to spare for it.
+ */
+int TraceAsync(Computer *mips)
+{
+	Trace *t = TraceOf(mips);
+
+	if (t == NULL)
+	{
+		return SIM_NO_MEMORY;
+	}
+	t->async = sysconf(_SC_NPROCESSORS_ONLN) > 1;
+	return SIM_OK;
+}
+
+/*
+ *  Wait for the formatting thread, if there is one, then write out
+ *  everything buffered so far.
+ */
+void TraceFlush(Computer *mips)
+{
+	Trace *t = mips->trace;
+
+	if (t->running)
+	{
+		atomic_store_explicit(&t->finished, 1, memory_order_release);
+		pthread_join(t->formatter, NULL);
+		t->running = 0;
+		UntrackNonzero(&t->shadow);
+		t->view = mips;
+	}
+	UntrackNonzero(mips);
+	WriteOut(t);
+	fflush(t->out);
+}
+
+void FreeTrace(Computer *mips)
+{
+	if (mips->trace != NULL)
+	{
+		UnmapSteps(mips->trace);
+		UntrackNonzero(&mips->trace->shadow);
+		UnmapTable(mips->trace->shadowMemory, mips->trace->shadowBytes);
+	}
+	free(mips->trace);
+	mips->trace = NULL;
+}
+
+/*
+ *  Format what Simulate() prints before executing the instruction at
+ *  pc into p: the "Executing" line and the disassembly, or the
+ *  unsupported instruction message. Sets *supported accordingly and
+ *  returns the end of the text.
+ */
+static char *FormatStep(Trace *t, char *p, int pc, int *supported)
+{
+	unsigned int instr = Word(t, pc);
+	const InstrInfo *info = &instrTable[InstrKind(instr)];
+	int rs = (instr >> 21) & 31, rt = (instr >> 16) & 31, rd = (instr >> 11) & 31;
+	int imm = (int)(instr << 16) >> 16;
+
+	p = TEXT(p, "Executing instruction at ");
+	p = Hex8(p, pc);
+	p = TEXT(p, ": ");
+	p = Hex8(p, instr);
+	*p++ = '\n';
+
+	*supported = Supported(instr);
+	if (!*supported)
+	{
+		return TEXT(p, unsupportedMessage);
+	}
+
+	p = Text(p, info->name, strlen(info->name));
+	*p++ = '\t';
+	switch (info->format)
+	{
+	case F_RD_RS_RT:
+		p = Reg(p, rd);
+		p = TEXT(p, ", ");
+		p = Reg(p, rs);
+		p = TEXT(p, ", ");
+		p = Reg(p, rt);
+		break;
+	case F_RD_RT_RS:
+		p = Reg(p, rd);
+		p = TEXT(p, ", ");
+		p = Reg(p, rt);
+		p = TEXT(p, ", ");
+		p = Reg(p, rs);
+		break;
+	case F_RD_RS_SHAMT:
+	case F_RD_RT_SHAMT:
+		p = Reg(p, rd);
+		p = TEXT(p, ", ");
+		p = Reg(p, info->format == F_RD_RS_SHAMT ? rs : rt);
+		p = TEXT(p, ", ");
+		p = Decimal(p, (instr >> 6) & 31);
+		break;
+	case F_RA:
+		p = Reg(p, 31);
+		break;
+	case F_RD_RS:
+		p = Reg(p, rd);
+		p = TEXT(p, ", ");
+		p = Reg(p, rs);
+		break;
+	case F_RT_RS_IMM:
+		p = Reg(p, rt);
+		p = TEXT(p, ", ");
+		p = Reg(p, rs);
+		p = TEXT(p, ", ");
+		p = Decimal(p, imm);
+		break;
+	case F_RS_RT_TARGET:
+	case F_RS_TARGET:
+		p = Reg(p, rs);
+		if (info->format == F_RS_RT_TARGET)
+		{
+			p = TEXT(p, ", ");
+			p = Reg(p, rt);
+		}
+		p = TEXT(p, ", 0x");
+		p = Hex8(p, pc + ((4 * imm) + 4));
+		break;
+	case F_MEMORY:
+		p = Reg(p, rt);
+		p = TEXT(p, ", ");
+		p = Decimal(p, imm);
+		*p++ = '(';
+		p = Reg(p, rs);
+		*p++ = ')';
+		break;
+	case F_TARGET:
+		/* Decode() takes the top four bits from the pc */
+		p = TEXT(p, "0x");
+		p = Hex8(p, (pc & 0xF0000000) | (instr & 0x03FFFFFF) << 2);
+		break;
+	case F_RS_RT:
+		p = Reg(p, rs);
+		p = TEXT(p, ", ");
+		p = Reg(p, rt);
+		break;
+	case F_RD:
+		p = Reg(p, rd);
+		break;
+	case F_RS:
+		p = Reg(p, rs);
+		break;
+	}
+	*p++ = '\n';
+	return p;
+}
+
+/*
+ *  Format the start of the step at pc. Returns whether the instruction
+ *  there is supported.
+ */
+static int StepText(Trace *t, int pc)
+{
+	unsigned int k = (unsigned int)(pc - TEXT_BASE) / 4;
+	char *p = Reserve(t);
+	int supported;
+
+	if (k >= (unsigned int)t->words || pc % 4 != 0)
+	{
+		t->used = FormatStep(t, p, pc, &supported) - t->buffer;
+		return supported;
+	}
+	if (t->stepLengths[k] == 0)
+	{
+		t->stepLengths[k] = FormatStep(t, t->steps[k], pc, &supported) - t->steps[k];
+		t->stepSupported[k] = supported;
+	}
+	memcpy(p, t->steps[k], t->stepLengths[k]);
+	t->used += t->stepLengths[k];
+	return t->stepSupported[k];
+}
+
+/*
+ *  Format what PrintInfo(changedReg, changedMem) prints.
+ */
+static void InfoText(Trace *t, int changedReg, int changedMem)
+{
+	char *p = Reserve(t);
+	int k, addr;
+
+	p = TEXT(p, "New pc = ");
+	p = Hex8(p, t->view->pc);
+	*p++ = '\n';
+	if (!t->view->printingRegisters && changedReg == -1)
+	{
+		p = TEXT(p, "No register was updated.\n");
+	}
+	else if (!t->view->printingRegisters && changedReg == HILO_REG)
+	{
+		p = TEXT(p, "Updated hi to ");
+		p = Hex8(p, t->view->hi);
+		p = TEXT(p, " and lo to ");
+		p = Hex8(p, t->view->lo);
+		*p++ = '\n';
+	}
+	else if (!t->view->printingRegisters)
+	{
+		p = TEXT(p, "Updated ");
+		p = RegIndex(p, changedReg);
+		p = TEXT(p, " to ");
+		p = Hex8(p, t->view->registers[changedReg]);
+		*p++ = '\n';
+	}
+	else
+	{
+		for (k = 0; k < 32; k++)
+		{
+			if (k % 8 == 0)
+			{
+				t->used = p - t->buffer;
+				p = Reserve(t);
+			}
+			p = RegIndex(p, k);
+			p = TEXT(p, ": ");
+			p = Hex8(p, t->view->registers[k]);
+			p = TEXT(p, "  ");
+			if ((k + 1) % 4 == 0)
+			{
+				*p++ = '\n';
+			}
+		}
+		p = TEXT(p, "hi: ");
+		p = Hex8(p, t->view->hi);
+		p = TEXT(p, "  lo: ");
+		p = Hex8(p, t->view->lo);
+		p = TEXT(p, "  \n");
+	}
+	t->used = p - t->buffer;
+	p = Reserve(t);
+	if (!t->view->printingMemory && changedMem == -1)
+	{
+		p = TEXT(p, "No memory location was updated.\n");
+	}
+	else if (!t->view->printingMemory)
+	{
+		p = TEXT(p, "Updated memory at address ");
+		p = Hex8(p, changedMem);
+		p = TEXT(p, " to ");
+		p = Hex8(p, Word(t, changedMem));
+		*p++ = '\n';
+	}
+	else
+	{
+		MarkNonzero(t->view, changedMem);
+		p = TEXT(p, "Nonzero memory\nADDR\t  CONTENTS\n");
+		for (addr = NextNonzero(t->view, DATA_BASE(t->view)); addr != -1;
+				 addr = NextNonzero(t->view, addr + 4))
+		{
+			t->used = p - t->buffer;
+			p = Reserve(t);
+			p = Hex8(p, addr);
+			p = TEXT(p, "  ");
+			p = Hex8(p, Word(t, addr));
+			*p++ = '\n';
+		}
+	}
+	t->used = p - t->buffer;
+}
+
+/*
+ *  Format the Memory Access Exception message.
+ */
+static void ExceptionText(Trace *t, int pc, int addr)
+{
+	char *p = Reserve(t);
+
+	p = TEXT(p, "Memory Access Exception at 0x");
+	p = Hex8(p, pc);
+	p = TEXT(p, ": address 0x");
+	p = Hex8(p, addr);
+	*p++ = '\n';
+	t->used = p - t->buffer;
+}
+
+/*
+ *  Trace the start of the step at pc, which must be mips->pc. Returns 0,
+ *  after tracing the message Simulate() stops with, if the instruction
+ *  there is not supported.
+ */
+int TraceStep(Computer *mips, int pc)
+{
+	Trace *t = mips->trace;
+
+	if (!t->binary && !t->running)
+	{
+		return StepText(t, pc);
+	}
+	t->pending.pc = pc;
+	t->pending.instr = Fetch(mips, pc);
+	if (!Supported(t->pending.instr))
+	{
+		PutRecord(t, TRACE_UNSUPPORTED);
+		return 0;
+	}
+	return 1;
+}
+
+/*
+ *  Trace what PrintInfo(changedReg, changedMem) prints.
+ */
+void TraceInfo(Computer *mips, int changedReg, int changedMem)
+{
+	Trace *t = mips->trace;
+
+	if (!t->binary && !t->running)
+	{
+		InfoText(t, changedReg, changedMem);
+		return;
+	}
+	t->pending.reg = changedReg == -1 ? 0 : changedReg == HILO_REG ? mips->hi : mips->registers[changedReg];
+	t->pending.addr = changedMem;
+	t->pending.mem = changedMem == -1 ? 0 : Fetch(mips, changedMem);
+	if (changedReg == HILO_REG)
+	{
+		/* No instruction changes both, so LO takes the place of the word */
+		t->pending.mem = mips->lo;
+	}
+	PutRecord(t, TRACE_CHANGES(changedReg));
+}
+
+/*
+ *  Trace the Memory Access Exception that stops the program, pc being
+ *  the updated pc it is reported with.
+ */
+void TraceException(Computer *mips, int pc, int addr)
+{
+	Trace *t = mips->trace;
+
+	if (!t->binary && !t->running)
+	{
+		ExceptionText(t, pc, addr);
+		return;
+	}
+	t->pending.reg = pc;
+	t->pending.addr = addr;
+	PutRecord(t, TRACE_EXCEPTION);
+}
+
+/*
+ *  Bring the machine being formatted up to date with rec and format
+ *  the text of its step. next is the record after rec, which gives the
+ *  new pc; it is only looked at if rec does not stop the program.
+ */
+void TraceReplay(Computer *mips, const TraceRecord *rec, const TraceRecord *next)
+{
+	Trace *t = mips->trace;
+	unsigned int k = (unsigned int)(rec->pc - TEXT_BASE) / 4;
+	int reg, addr;
+
+	if (k < (unsigned int)(t->view->textWords + t->view->dataWords))
+	{
+		t->view->memory[k] = rec->instr;
+		MarkNonzero(t->view, rec->pc);
+	}
+	t->view->pc = rec->pc;
+	if (!StepText(t, rec->pc))
+	{
+		return;
+	}
+	if (rec->how == TRACE_EXCEPTION)
+	{
+		ExceptionText(t, rec->reg, rec->addr);
+		return;
+	}
+	reg = TRACE_CHANGED_REG(rec->how);
+	addr = rec->addr;
+	if (reg == HILO_REG)
+	{
+		t->view->hi = rec->reg;
+		t->view->lo = rec->mem;
+	}
+	else if (reg != -1)
+	{
+		t->view->registers[reg] = rec->reg;
+	}
+	if (addr != -1 && !BAD_DATA_ADDR(t->view, addr))
+	{
+		t->view->memory[(unsigned int)(addr - TEXT_BASE) / 4] = rec->mem;
+		MarkNonzero(t->view, addr);
+	}
+	t->view->pc = next->pc;
+	InfoText(t, reg, addr);
+}